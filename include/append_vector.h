@@ -163,6 +163,11 @@ namespace AppendVectorNS {
 			return el;
 		}
 
+		const T& operator [](int idx) const {
+			const auto& vec = vecs[idx / APPEND_VECTOR_SIZE];
+			return vec[idx % APPEND_VECTOR_SIZE];
+		}
+
 		Iterator begin() {
 			return Iterator(*this, 0, 0);
 		}
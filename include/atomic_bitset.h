@@ -0,0 +1,55 @@
+/*! \file */
+#ifndef _ATOMIC_BITSET_H
+#define _ATOMIC_BITSET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// A set of IDs that many threads can add to at once, without locks.
+//
+// The bits are kept in chunks of 65,536, which are only allocated once an ID
+// in their range is set, so a sparse set stays small. A thread that finds its
+// chunk missing allocates one and installs it with a compare-and-swap; bits
+// are set with an atomic OR on their 64-bit word.
+//
+// reserve() allocates the chunks for a range of IDs up front, when it's known
+// (e.g. from the .pbf's block index), so the threads needn't race to install
+// them.
+//
+// Chunks come from mmap_allocator, so they're released with the arena of the
+// phase that allocated them once clear() has freed them.
+
+class AtomicBitset {
+public:
+	// IDs up to 2^34: well above the largest OSM node ID
+	static const size_t ChunkBits = 65536;
+	static const size_t MaxChunks = 256 * 1024;
+
+	AtomicBitset();
+	~AtomicBitset();
+	AtomicBitset(const AtomicBitset&) = delete;
+	AtomicBitset& operator=(const AtomicBitset&) = delete;
+
+	bool test(uint64_t id) const;
+	void set(uint64_t id);
+
+	// Allocate the chunks for IDs from minId to maxId
+	void reserve(uint64_t minId, uint64_t maxId);
+
+	// Free the chunks. Not safe while other threads use the set.
+	void clear();
+
+	size_t chunks() const;
+
+private:
+	static const size_t ChunkWords = ChunkBits / 64;
+	using Word = std::atomic<uint64_t>;
+
+	Word* chunk(size_t index);
+
+	std::unique_ptr<std::atomic<Word*>[]> table;
+};
+
+#endif //_ATOMIC_BITSET_H
@@ -0,0 +1,65 @@
+/*! \file */
+#ifndef _BINARY_FILE_H
+#define _BINARY_FILE_H
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+// Reading and writing the files tilemaker keeps beside its inputs and stores:
+// the .pbf index and saved stores. Numbers are in native byte order, as the
+// files are caches for this machine. Reads throw std::runtime_error if the
+// file is truncated or corrupt, so a loader can catch that and start afresh.
+
+namespace BinaryFile {
+	template<typename T> void write(std::ostream& out, const T& value) {
+		out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	inline void writeString(std::ostream& out, const std::string& value) {
+		write<uint32_t>(out, value.size());
+		out.write(value.data(), value.size());
+	}
+
+	// Bytes left to read, to check lengths read from the file against
+	inline uint64_t remaining(std::istream& in) {
+		std::streampos here = in.tellg();
+		in.seekg(0, std::ios::end);
+		std::streampos end = in.tellg();
+		in.seekg(here);
+		if (!in || here < 0 || end < here) throw std::runtime_error("unreadable");
+		return end - here;
+	}
+
+	template<typename T> T read(std::istream& in) {
+		T value;
+		in.read(reinterpret_cast<char*>(&value), sizeof(T));
+		if (!in) throw std::runtime_error("truncated");
+		return value;
+	}
+
+	inline std::string readString(std::istream& in) {
+		uint32_t size = read<uint32_t>(in);
+		if (size > remaining(in)) throw std::runtime_error("corrupt");
+		std::string value(size, '\0');
+		in.read(&value[0], size);
+		if (!in) throw std::runtime_error("truncated");
+		return value;
+	}
+
+	// magic is a string literal; its terminating NUL isn't in the file
+	template<size_t N> void writeMagic(std::ostream& out, const char (&magic)[N]) {
+		out.write(magic, N - 1);
+	}
+
+	template<size_t N> bool readMagic(std::istream& in, const char (&magic)[N]) {
+		char read[N - 1];
+		in.read(read, N - 1);
+		return in && memcmp(read, magic, N - 1) == 0;
+	}
+}
+
+#endif //_BINARY_FILE_H
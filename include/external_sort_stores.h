@@ -0,0 +1,86 @@
+#ifndef _EXTERNAL_SORT_STORES_H
+#define _EXTERNAL_SORT_STORES_H
+
+#include <memory>
+#include <string>
+#include "node_store.h"
+#include "way_store.h"
+#include "external_sorter.h"
+
+// ExternalSortNodeStore and ExternalSortWayStore let SortedNodeStore and
+// SortedWayStore be used when the input isn't sorted, or is more than one
+// file (e.g. a planet and an overlay).
+//
+// The sorted stores need each thread to insert IDs in increasing order. These
+// wrappers accept IDs in any order, spill them to disk in sorted runs, and at
+// finalize() merge the runs into the wrapped store in ID order. Once they're
+// finalized, everything is delegated to the wrapped store.
+
+class ExternalSortNodeStore : public NodeStore {
+public:
+	// Runs are written to a temporary directory within directory; each
+	// inserting thread buffers up to bufferBytes before writing a run
+	ExternalSortNodeStore(std::shared_ptr<NodeStore> store, const std::string& directory, size_t bufferBytes);
+
+	void reopen() override;
+	void finalize(size_t threadNum) override;
+	LatpLon at(NodeID i) const override { return store->at(i); }
+	size_t size() const override { return store->size(); }
+	void batchStart() override {}
+	void insert(const std::vector<element_t>& elements) override;
+	void clear() override;
+
+	bool contains(size_t shard, NodeID id) const override { return store->contains(shard, id); }
+	NodeStore& shard(size_t shard) override { return *this; }
+	const NodeStore& shard(size_t shard) const override { return *this; }
+	size_t shards() const override { return 1; }
+
+private:
+	struct Codec {
+		static uint64_t id(const element_t& element) { return element.first; }
+		static size_t bytes(const element_t& element) { return sizeof(NodeID) + sizeof(LatpLon); }
+		static void write(std::ostream& out, const element_t& element);
+		static void read(std::istream& in, element_t& element);
+	};
+
+	std::shared_ptr<NodeStore> store;
+	const std::string directory;
+	ExternalSorter<element_t, Codec> sorter;
+};
+
+class ExternalSortWayStore : public WayStore {
+public:
+	using element_t = std::pair<WayID, std::vector<NodeID>>;
+
+	ExternalSortWayStore(std::shared_ptr<WayStore> store, const std::string& directory, size_t bufferBytes);
+
+	void reopen() override;
+	void batchStart() override {}
+	using WayStore::at;
+	void at(WayID wayid, std::vector<LatpLon>& out) const override { store->at(wayid, out); }
+	bool requiresNodes() const override { return store->requiresNodes(); }
+	void insertLatpLons(std::vector<ll_element_t>& newWays) override;
+	void insertNodes(const std::vector<element_t>& newWays) override;
+	void clear() override;
+	std::size_t size() const override { return store->size(); }
+	void finalize(unsigned int threadNum) override;
+
+	bool contains(size_t shard, WayID id) const override { return store->contains(shard, id); }
+	WayStore& shard(size_t shard) override { return *this; }
+	const WayStore& shard(size_t shard) const override { return *this; }
+	size_t shards() const override { return 1; }
+
+private:
+	struct Codec {
+		static uint64_t id(const element_t& element) { return element.first; }
+		static size_t bytes(const element_t& element) { return sizeof(WayID) + sizeof(uint32_t) + element.second.size() * sizeof(NodeID); }
+		static void write(std::ostream& out, const element_t& element);
+		static void read(std::istream& in, element_t& element);
+	};
+
+	std::shared_ptr<WayStore> store;
+	const std::string directory;
+	ExternalSorter<element_t, Codec> sorter;
+};
+
+#endif
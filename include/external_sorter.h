@@ -0,0 +1,323 @@
+/*! \file */
+#ifndef _EXTERNAL_SORTER_H
+#define _EXTERNAL_SORTER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/filesystem.hpp>
+
+// ExternalSorter sorts more elements than fit in memory, by ID.
+//
+// Each thread adds elements to its own buffer. When a buffer is full, it's
+// sorted and written to a temporary file as a "run". merge() then reads the
+// runs back in ID order, a range of IDs on each thread, and passes them on in
+// sorted batches.
+//
+// Runs are indexed by group (groupSize consecutive IDs), so each merging
+// thread can start reading every run at its first group. If there are more
+// runs than can be read at once, they're first merged into fewer, longer ones.
+//
+// Codec describes how an element is stored:
+//   static uint64_t id(const T&);
+//   static size_t bytes(const T&);            // exactly as many as write() writes
+//   static void write(std::ostream&, const T&);
+//   static void read(std::istream&, T&);
+
+template<typename T, typename Codec>
+class ExternalSorter {
+
+public:
+	ExternalSorter(uint64_t groupSize, size_t bufferBytes):
+		groupSize(groupSize), bufferBytes(bufferBytes), runCount(0) { }
+
+	~ExternalSorter() {
+		clear();
+	}
+
+	// Write runs to a new directory within parent
+	void open(const std::string& parent) {
+		clear();
+		boost::filesystem::path dir = boost::filesystem::path(parent) / boost::filesystem::unique_path("tilemaker-sort-%%%%-%%%%");
+		boost::filesystem::create_directories(dir);
+		directory = dir.string();
+	}
+
+	// Thread-safe; each thread has its own buffer
+	void add(const std::vector<T>& elements) {
+		Buffer& buffer = threadBuffer();
+		for (const T& element : elements) {
+			buffer.bytes += Codec::bytes(element);
+			buffer.elements.push_back(element);
+		}
+		if (buffer.bytes >= bufferBytes)
+			spill(buffer);
+	}
+
+	// Pass every element added so far to emit, in ascending ID order within
+	// each call to startRange(). Ranges are merged on threadNum threads, and
+	// each starts on a new group. An ID added more than once is kept once.
+	void merge(
+		size_t threadNum,
+		std::function<void()> startRange,
+		std::function<void(std::vector<T>&)> emit
+	) {
+		{
+			boost::asio::thread_pool pool(threadNum);
+			for (auto& entry : buffers) {
+				Buffer* buffer = &entry.second;
+				boost::asio::post(pool, [this, buffer]() { spill(*buffer); });
+			}
+			pool.join();
+		}
+		compact(threadNum);
+
+		std::vector<uint64_t> groups;
+		for (const Run& run : runs)
+			for (const auto& group : run.groups)
+				groups.push_back(group.first);
+		std::sort(groups.begin(), groups.end());
+		groups.erase(std::unique(groups.begin(), groups.end()), groups.end());
+
+		const size_t groupsPerRange = groups.size() / (threadNum * 4) + 1;
+		boost::asio::thread_pool pool(threadNum);
+		for (size_t i = 0; i < groups.size(); i += groupsPerRange) {
+			uint64_t firstGroup = groups[i];
+			uint64_t endGroup = i + groupsPerRange < groups.size() ? groups[i + groupsPerRange] : std::numeric_limits<uint64_t>::max();
+			boost::asio::post(pool, [=, &startRange, &emit]() {
+				std::vector<const Run*> all;
+				for (const Run& run : runs)
+					all.push_back(&run);
+
+				startRange();
+				std::vector<T> batch;
+				mergeRuns(all, firstGroup, endGroup, [&](T& element) {
+					batch.push_back(std::move(element));
+					if (batch.size() == BATCH_SIZE) {
+						emit(batch);
+						batch.clear();
+					}
+				});
+				if (!batch.empty())
+					emit(batch);
+			});
+		}
+		pool.join();
+	}
+
+	// Drop all elements and runs
+	void clear() {
+		buffers.clear();
+		for (const Run& run : runs)
+			boost::filesystem::remove(run.filename);
+		runs.clear();
+		if (!directory.empty()) {
+			boost::system::error_code ec;
+			boost::filesystem::remove(directory, ec);
+		}
+	}
+
+	size_t runsWritten() const { return runCount; }
+
+private:
+	static const size_t BATCH_SIZE = 8192;
+
+	// Runs read at once by one merge; each has an open file and a buffer, and
+	// threadNum merges run at once, so keep well below the usual limit of
+	// 1024 open files
+	static size_t maxFanIn(size_t threadNum) {
+		return std::max<size_t>(8, 512 / std::max<size_t>(threadNum, 1));
+	}
+
+	struct Buffer {
+		std::vector<T> elements;
+		size_t bytes = 0;
+	};
+
+	struct Run {
+		std::string filename;
+		uint64_t bytes;
+		// The offset of each group's first element
+		std::vector<std::pair<uint64_t, uint64_t>> groups;
+	};
+
+	// Writes a run as it's given sorted elements
+	class RunWriter {
+	public:
+		RunWriter(const std::string& filename, uint64_t groupSize): groupSize(groupSize) {
+			run.filename = filename;
+			run.bytes = 0;
+			out.rdbuf()->pubsetbuf(buffer, sizeof(buffer));
+			out.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!out) throw std::runtime_error("couldn't write " + filename);
+		}
+
+		void write(const T& element) {
+			uint64_t group = Codec::id(element) / groupSize;
+			if (run.groups.empty() || run.groups.back().first != group)
+				run.groups.push_back({ group, run.bytes });
+			Codec::write(out, element);
+			run.bytes += Codec::bytes(element);
+		}
+
+		Run finish() {
+			out.close();
+			if (!out) throw std::runtime_error("couldn't write " + run.filename);
+			return std::move(run);
+		}
+
+	private:
+		const uint64_t groupSize;
+		char buffer[1 << 16];
+		std::ofstream out;
+		Run run;
+	};
+
+	// Reads the part of a run that covers [firstGroup, endGroup)
+	struct RunReader {
+		RunReader(const Run& run, uint64_t firstGroup, uint64_t endGroup): remaining(0) {
+			auto byGroup = [](const std::pair<uint64_t, uint64_t>& entry, uint64_t group) { return entry.first < group; };
+			auto first = std::lower_bound(run.groups.begin(), run.groups.end(), firstGroup, byGroup);
+			auto end = std::lower_bound(first, run.groups.end(), endGroup, byGroup);
+			if (first == end) return;
+
+			uint64_t start = first->second;
+			remaining = (end == run.groups.end() ? run.bytes : end->second) - start;
+			in.rdbuf()->pubsetbuf(buffer, sizeof(buffer));
+			in.open(run.filename, std::ios::in | std::ios::binary);
+			in.seekg(start);
+			if (!in) throw std::runtime_error("couldn't read " + run.filename);
+		}
+
+		bool next() {
+			if (remaining == 0) return false;
+			Codec::read(in, current);
+			if (!in) throw std::runtime_error("truncated external sort run");
+			remaining -= Codec::bytes(current);
+			return true;
+		}
+
+		char buffer[1 << 16];
+		std::ifstream in;
+		uint64_t remaining;
+		T current;
+	};
+
+	Buffer& threadBuffer() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return buffers[std::this_thread::get_id()];
+	}
+
+	void spill(Buffer& buffer) {
+		if (buffer.elements.empty()) return;
+
+		// Stable, so that if a thread adds an ID twice, the merge sees the first
+		std::stable_sort(buffer.elements.begin(), buffer.elements.end(), [](const T& a, const T& b) {
+			return Codec::id(a) < Codec::id(b);
+		});
+
+		std::unique_ptr<RunWriter> writer(new RunWriter(nextFilename(), groupSize));
+		for (const T& element : buffer.elements)
+			writer->write(element);
+		Run run = writer->finish();
+
+		buffer.elements.clear();
+		buffer.elements.shrink_to_fit();
+		buffer.bytes = 0;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		runs.push_back(std::move(run));
+	}
+
+	// Merge runs a few at a time until there are few enough to read at once
+	void compact(size_t threadNum) {
+		const size_t fanIn = maxFanIn(threadNum);
+		while (runs.size() > fanIn) {
+			std::vector<Run> merged;
+			std::mutex mergedMutex;
+			boost::asio::thread_pool pool(threadNum);
+			for (size_t i = 0; i < runs.size(); i += fanIn) {
+				boost::asio::post(pool, [&, i]() {
+					std::vector<const Run*> some;
+					for (size_t j = i; j < std::min(runs.size(), i + fanIn); j++)
+						some.push_back(&runs[j]);
+
+					std::unique_ptr<RunWriter> writer(new RunWriter(nextFilename(), groupSize));
+					mergeRuns(some, 0, std::numeric_limits<uint64_t>::max(), [&](T& element) { writer->write(element); });
+					Run run = writer->finish();
+
+					std::lock_guard<std::mutex> lock(mergedMutex);
+					merged.push_back(std::move(run));
+				});
+			}
+			pool.join();
+
+			for (const Run& run : runs)
+				boost::filesystem::remove(run.filename);
+			runs = std::move(merged);
+		}
+	}
+
+	// Pass the elements of [firstGroup, endGroup) in runs to output, in ID order
+	void mergeRuns(
+		const std::vector<const Run*>& from,
+		uint64_t firstGroup,
+		uint64_t endGroup,
+		const std::function<void(T&)>& output
+	) const {
+		std::vector<std::unique_ptr<RunReader>> readers;
+		// Smallest ID first; for equal IDs, the earlier run
+		typedef std::pair<uint64_t, size_t> Head;
+		std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+		for (const Run* run : from) {
+			readers.emplace_back(new RunReader(*run, firstGroup, endGroup));
+			if (readers.back()->next())
+				heads.push({ Codec::id(readers.back()->current), readers.size() - 1 });
+		}
+
+		bool any = false;
+		uint64_t last = 0;
+		while (!heads.empty()) {
+			size_t i = heads.top().second;
+			heads.pop();
+
+			RunReader& reader = *readers[i];
+			uint64_t id = Codec::id(reader.current);
+			if (!any || id != last)
+				output(reader.current);
+			any = true;
+			last = id;
+
+			if (reader.next())
+				heads.push({ Codec::id(reader.current), i });
+		}
+	}
+
+	std::string nextFilename() {
+		return directory + "/run-" + std::to_string(runCount++);
+	}
+
+	const uint64_t groupSize;
+	const size_t bufferBytes;
+	std::string directory;
+
+	std::mutex mutex;
+	std::map<std::thread::id, Buffer> buffers;
+	std::vector<Run> runs;
+	std::atomic<size_t> runCount;
+};
+
+#endif //_EXTERNAL_SORTER_H
@@ -0,0 +1,57 @@
+#ifndef _FLAT_NODE_STORE_H
+#define _FLAT_NODE_STORE_H
+
+#include "node_store.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// FlatNodeStore keeps nodes in a flat array indexed by their OSM ID, so
+// access is constant time whatever order the input is in.
+//
+// The array is a sparse file, mapped into memory. Pages that no node was
+// written to are never allocated, so a store for the whole planet only
+// takes disk (and page cache) for the ranges of IDs that are in use. It's
+// best suited to planet-sized inputs: small extracts spread few nodes over
+// many pages.
+//
+// Unlike CompactNodeStore, the input doesn't need to be renumbered, and
+// it knows which nodes it holds, so it can be used with ShardedNodeStore.
+
+class FlatNodeStore : public NodeStore
+{
+
+public:
+	// The file is created in directory, and removed when the store is
+	FlatNodeStore(const std::string& directory);
+	~FlatNodeStore();
+
+	void reopen() override;
+	void finalize(size_t threadNum) override {}
+	LatpLon at(NodeID i) const override;
+	size_t size() const override;
+	void batchStart() override {}
+	void insert(const std::vector<element_t>& elements) override;
+	void clear() override {
+		reopen();
+	}
+
+	bool contains(size_t shard, NodeID id) const override;
+	NodeStore& shard(size_t shard) override { return *this; }
+	const NodeStore& shard(size_t shard) const override { return *this; }
+	size_t shards() const override { return 1; }
+
+private:
+	std::string directory;
+	std::string filename;
+	std::unique_ptr<boost::interprocess::file_mapping> file;
+	std::unique_ptr<boost::interprocess::mapped_region> region;
+	LatpLon* nodes;
+	std::atomic<uint64_t> totalNodes;
+
+	void close();
+};
+
+#endif
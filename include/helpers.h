@@ -4,6 +4,8 @@
 
 #include <sstream>
 #include <vector>
+#include <cstdint>
+#include <functional>
 
 #define Z_DEFAULT_COMPRESSION -1
 
@@ -35,6 +37,25 @@ inline std::vector<std::string> split_string(std::string &inputStr, char sep) {
 	return res;
 }
 
+// 128-bit content hash (MurmurHash3 x64), used to spot identical tiles
+struct Hash128 {
+	uint64_t low;
+	uint64_t high;
+
+	bool operator==(const Hash128 &other) const { return low == other.low && high == other.high; }
+	bool operator!=(const Hash128 &other) const { return !(*this == other); }
+	std::string hex() const;
+};
+
+namespace std {
+	template<>
+	struct hash<Hash128> {
+		size_t operator()(const Hash128 &h) const { return h.low; }
+	};
+}
+
+Hash128 hash128(const std::string &data);
+
 struct OffsetAndLength {
 	uint64_t offset;
 	uint64_t length;
@@ -51,6 +72,36 @@ std::vector<std::string> parseBox(const std::string& bbox);
 std::string compress_string(const std::string& str,
                             int compressionlevel = Z_DEFAULT_COMPRESSION,
                             bool asGzip = false);
+// As above, but compresses into output (replacing its contents), reusing its capacity
+void compress_string(std::string& output,
+                     const std::string& str,
+                     int compressionlevel = Z_DEFAULT_COMPRESSION,
+                     bool asGzip = false);
+
+///\brief Codec and level used to compress tiles (the "compress" setting in config.json)
+struct Compression {
+	enum class Codec: char { None = 0, Gzip = 1, Deflate = 2, Zstd = 3 };
+	Codec codec = Codec::Gzip;
+	int level = Z_DEFAULT_COMPRESSION;	// codec's default unless set
+
+	Compression() { }
+	Compression(Codec codec, int level = Z_DEFAULT_COMPRESSION): codec(codec), level(level) { }
+
+	bool enabled() const { return codec != Codec::None; }
+	std::string name() const;
+	// Throws std::invalid_argument for an unknown codec name or out-of-range level
+	static Compression parse(const std::string& codecName, int level = Z_DEFAULT_COMPRESSION);
+	static bool zstdAvailable();
+};
+
+void compress_string(std::string& output, const std::string& str, const Compression& compression);
+void decompress_string(std::string& output, const char* input, uint32_t inputSize, const Compression& compression);
+
+// Decompress a zstd frame or an LZ4 block whose decompressed size is known (as
+// in .pbf blobs) into output, reusing its capacity. Throws if tilemaker was
+// built without the codec.
+void decompress_zstd(std::string& output, const char* input, uint32_t inputSize, uint32_t outputSize);
+void decompress_lz4(std::string& output, const char* input, uint32_t inputSize, uint32_t outputSize);
 
 std::string boost_validity_error(unsigned failure);
 
@@ -4,46 +4,107 @@
 
 #include <string>
 #include <mutex>
+#include <thread>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_set>
 #include "external/sqlite_modern_cpp.h"
+#include "helpers.h"
+#include "output_queue.h"
+
+// Maximum number of tiles waiting for the writer thread
+#define MBTILES_QUEUE_SIZE 1024
+// Number of rows written by each multi-row INSERT
+#define MBTILES_ROWS_PER_INSERT 64
+// Commit after this many tiles
+#define MBTILES_TRANSACTION_SIZE 100000
 
 struct PendingStatement {
 	int zoom;
 	int x;
 	int y;
 	std::string data;
+	bool hasData;
+	std::string tileId;
 	bool isMerge;
 };
 
 /** \brief Write to MBTiles (sqlite) database
 *
+* New files use the deduplicating map/images schema, with a `tiles` view for
+* readers. Each distinct tile is stored once in `images`, keyed by the hash of
+* its uncompressed data. Merging into an existing file that has a plain `tiles`
+* table keeps writing to that table.
+*
+* Tile workers never touch SQLite when saving a tile: they queue it for a
+* dedicated writer thread, which writes it using multi-row INSERTs and
+* commits every MBTILES_TRANSACTION_SIZE tiles.
+*
+* When merging into an existing file, the index of existing tiles is loaded
+* up front, and workers read existing tiles through their own read-only
+* connections (the file is switched to WAL mode for the duration, so these
+* don't contend with the writer).
+*
 * (note that sqlite_modern_cpp.h is very slightly changed from the original, for blob support and an .init method)
 */
 class MBTiles { 
+	// A read-only connection used by one tile worker at a time (--merge)
+	struct ReadConnection {
+		sqlite::database db;
+		sqlite::database_binder select;
+		ReadConnection(std::shared_ptr<sqlite3> conn);
+	};
+
 	sqlite::database db;
-	std::vector<sqlite::database_binder> preparedStatements;
-	std::mutex m;
-	bool inTransaction;
+	std::vector<sqlite::database_binder> preparedStatements;	// one row
+	std::vector<sqlite::database_binder> multiRowStatements;	// MBTILES_ROWS_PER_INSERT rows
+	std::mutex m;	// guards db
+	bool inTransaction = false;
+	bool deduplicate = false;
+	bool hasMerged = false;
+	uint64_t tilesInTransaction = 0;
+
+	std::thread writerThread;
+	OutputQueue<PendingStatement> writeQueue;
+	SpareBuffers spareBuffers;	// tile data the writer has finished with
+
+	std::unordered_set<Hash128> knownTileData;
+	std::mutex knownTileDataMutex;
+
+	std::string filename;
+	bool merging = false;
+	std::unordered_set<uint64_t> existingTiles;
+	std::vector<std::unique_ptr<ReadConnection>> idleReaders;
+	std::mutex idleReadersMutex;
 
-	std::shared_ptr<std::vector<PendingStatement>> pendingStatements1, pendingStatements2;
-	std::mutex pendingStatementsMutex;
+	std::unique_ptr<ReadConnection> acquireReader();
+	void releaseReader(std::unique_ptr<ReadConnection> reader);
 
-	void insertOrReplace(int zoom, int x, int y, const std::string& data, bool isMerge);
-	void flushPendingStatements();
+	void prepareInsert(const std::string &sql, const std::string &row);
+	void writeQueuedTiles();
+	void writeBatch(const std::deque<PendingStatement> &batch);
+	template<typename Bind>
+	void insertRows(int statement, const std::vector<const PendingStatement*> &rows, Bind bind);
+	void stopWriter();
 
 public:
 	MBTiles();
 	virtual ~MBTiles();
-	void openForWriting(std::string &filename);
+	void openForWriting(std::string &filename, bool merging = false);
 	void writeMetadata(std::string key, std::string value);
-	void saveTile(int zoom, int x, int y, std::string *data, bool isMerge);
+	bool isNewTileData(const Hash128 &hash);
+	void saveTile(int zoom, int x, int y, std::string &&data, bool isMerge, const Hash128 &hash);
+	void saveDuplicateTile(int zoom, int x, int y, bool isMerge, const Hash128 &hash);
+	// An empty buffer for a worker's next tile, reusing written tiles' memory
+	std::string spareBuffer();
 	void closeForWriting();
 
 	void openForReading(std::string &filename);
 	void readBoundingBox(double &minLon, double &maxLon, double &minLat, double &maxLat);
 	void readTileList(std::vector<std::tuple<int,int,int>> &tileList);
 	std::vector<char> readTile(int zoom, int col, int row);
-	bool readTileAndUncompress(std::string &data, int zoom, int col, int row, bool isCompressed, bool asGzip);
+	bool readTileAndUncompress(std::string &data, int zoom, int col, int row, const Compression &compression);
 };
 
 #endif //_MBTILES_H
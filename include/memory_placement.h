@@ -0,0 +1,50 @@
+#ifndef _MEMORY_PLACEMENT_H
+#define _MEMORY_PLACEMENT_H
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Opt-in placement of the stores' memory, and of the threads that read it.
+//
+// On large machines, node and way lookups are random accesses across many
+// GB, so they pay for TLB misses and, with several sockets, for memory that's
+// attached to another socket. Huge pages cover more memory per TLB entry.
+// Interleaving spreads the stores across the NUMA nodes, so no one node's
+// memory bandwidth is the bottleneck, and pinning keeps each worker on one
+// node, rather than migrating and losing its caches.
+//
+// This applies to the memory void_mmap_allocator maps itself, not to
+// --store files. Everything is a no-op where the OS doesn't support it.
+
+class MemoryPlacement {
+public:
+	enum class HugePages { None, Transparent, Explicit };
+	enum class Numa { None, Interleave };
+
+	// Throws std::invalid_argument for an unknown name
+	static HugePages parseHugePages(const std::string& name);
+	static Numa parseNuma(const std::string& name);
+	// Parse a list of CPUs or nodes from /sys, like "0-3,8,10-11"
+	static std::vector<int> parseCpuList(const std::string& list);
+
+	static void configure(HugePages hugePages, Numa numa, bool pinThreads);
+	// Whether huge pages or NUMA interleave were asked for
+	static bool placesMemory();
+
+	// Map size bytes of anonymous memory, placed as configured. size is
+	// rounded up to a whole number of huge pages if need be. Returns nullptr
+	// on failure.
+	static void* map(size_t& size);
+	static void unmap(void* address, size_t size);
+
+	// Pin the calling thread to a NUMA node's CPUs, if configured. Each
+	// thread is given the next node in turn, the first time it calls this.
+	static void pinThread();
+
+	static size_t numaNodes();
+	static void report(std::ostream& out);
+};
+
+#endif
@@ -2,7 +2,9 @@
 #define _MMAP_ALLOCATOR_H
 
 #include <cstddef>
+#include <ostream>
 #include <sstream>
+#include <string>
 
 class void_mmap_allocator
 {
@@ -10,8 +12,18 @@ public:
 	typedef std::size_t size_type;
 
 	static void *allocate(size_type n, const void *hint = 0);
+	// Return memory to the region it came from. A large block's pages go back
+	// to the OS at once; a region is unmapped once it's empty and a later
+	// phase has begun.
+	static void deallocate(void *p);
 	static void reportStoreSize(std::ostringstream &str);
 	static void openMmapFile(const std::string& mmapFilename);
+
+	// Allocate from new regions, in an arena named after the phase, and
+	// release the memory that earlier phases have finished with
+	static void beginPhase(const std::string& name);
+	// Write how much memory each arena is using
+	static void reportArenas(std::ostream& out);
 };
 
 template<typename T>
@@ -44,9 +56,7 @@ public:
 
 	void deallocate(pointer p, size_type n)
 	{
-		// This is a no-op. Most usage of tilemaker should never deallocate
-		// an mmap_allocator resource. On program termination, everything gets
-		// freed.
+		void_mmap_allocator::deallocate(p);
 	}
 
 	void construct(pointer p, const_reference val)
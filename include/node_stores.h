@@ -4,6 +4,7 @@
 #include <mutex>
 #include <memory>
 #include "node_store.h"
+#include "flat_node_store.h"
 #include "sorted_node_store.h"
 #include "sharded_node_store.h"
 #include "mmap_allocator.h"
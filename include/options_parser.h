@@ -25,11 +25,21 @@ namespace OptionsParser {
 		std::string storeFile;
 		bool fast = false;
 		bool compact = false;
+		bool flatNodes = false;
 		bool skipIntegrity = false;
 		bool uncompressedNodes = false;
 		bool uncompressedWays = false;
 		bool materializeGeometries = false;
 		bool shardStores = false;
+		bool spillWays = false;
+		bool pbfIndex = false;
+		uint32_t blockCacheMB = 0;
+		std::string blockCacheCompress;
+		uint32_t decodeThreads = 0;
+		uint32_t externalSortMB = 0;
+		bool reuseStores = false;
+		std::string hugePages;
+		std::string numa;
 	};
 
 	struct Options {
@@ -37,6 +47,7 @@ namespace OptionsParser {
 		std::string luaFile;
 		std::string jsonFile;
 		uint32_t threadNum = 0;
+		bool pinThreads = false;
 		std::string outputFile;
 		std::string bbox;
 
@@ -45,6 +56,7 @@ namespace OptionsParser {
 		bool quiet = false;
 		bool verbose = false;
 		bool mergeSqlite = false;
+		bool clustered = false;
 		OutputMode outputMode = OutputMode::File;
 		bool logTileTimings = false;
 	};
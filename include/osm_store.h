@@ -2,6 +2,7 @@
 #ifndef _OSM_STORE_H
 #define _OSM_STORE_H
 
+#include "atomic_bitset.h"
 #include "geom.h"
 #include "coordinates.h"
 #include "mmap_allocator.h"
@@ -19,20 +20,24 @@ extern bool verbose;
 class NodeStore;
 class WayStore;
 
+// The nodes, ways or relations that the scan phases found are needed.
+// While disabled, every object counts as used.
 class UsedObjects {
 public:
 	enum class Status: bool { Disabled = false, Enabled = true };
 	UsedObjects(Status status);
-	bool test(NodeID id);
-	void set(NodeID id);
+	bool test(uint64_t id) const;
+	void set(uint64_t id);
+	// Allocate for IDs from minId to maxId up front, when they're known
+	void reserve(uint64_t minId, uint64_t maxId);
 	void enable();
 	bool enabled() const;
 	void clear();
 
 private:
 	Status status;
-	std::vector<std::mutex> mutex;
-	std::vector<std::vector<bool>> ids;
+	// From the scan phases' arenas, so they're released once cleared
+	AtomicBitset ids;
 };
 
 // A comparator for data_view so it can be used in boost's flat_map
@@ -43,56 +48,6 @@ struct DataViewLessThan {
 };
 
 
-//
-// Internal data structures.
-//
-// list of ways used by relations
-// by noting these in advance, we don't need to store all ways in the store
-class UsedWays {
-
-private:
-	std::vector<bool> usedList;
-	mutable std::mutex mutex;
-
-public:
-	bool inited = false;
-
-	// Size the vector to a reasonable estimate, to avoid resizing on the fly
-	// TODO: it'd be preferable if UsedWays didn't know about compact mode --
-	//   instead, use an efficient data structure if numNodes < 1B, otherwise
-	//   use a large bitvector
-	void reserve(bool compact, size_t numNodes) {
-		std::lock_guard<std::mutex> lock(mutex);
-		if (inited) return;
-		inited = true;
-		if (compact) {
-			// If we're running in compact mode, way count is roughly 1/9th of node count... say 1/8 to be safe
-			usedList.reserve(numNodes/8);
-		} else {
-			// Otherwise, we could have anything up to the current max node ID (approaching 2**30 in summer 2021)
-			// 2**31 is 0.25GB with a vector<bool>
-			usedList.reserve(pow(2,31));
-		}
-	}
-	
-	// Mark a way as used
-	void insert(WayID wayid) {
-		std::lock_guard<std::mutex> lock(mutex);
-		if (wayid>usedList.size()) usedList.resize(wayid+256);
-		usedList[wayid] = true;
-	}
-	
-	// See if a way is used
-	bool at(WayID wayid) const {
-		return (wayid>usedList.size()) ? false : usedList[wayid];
-	}
-	
-	void clear() {
-		std::lock_guard<std::mutex> lock(mutex);
-		usedList.clear();
-	}
-};
-
 // scanned relations store
 class RelationScanStore {
 
@@ -109,6 +64,16 @@ public:
 
 	RelationScanStore(): relationsForWays(128), relationsForNodes(128), relationTags(128), mutex(128) {}
 
+	void clear() {
+		for (size_t shard = 0; shard < mutex.size(); shard++) {
+			std::lock_guard<std::mutex> lock(mutex[shard]);
+			relationsForWays[shard].clear();
+			relationsForNodes[shard].clear();
+			relationTags[shard].clear();
+		}
+		relationsForRelations.clear();
+	}
+
 	void relation_contains_way(RelationID relid, WayID wayid, std::string role) {
 		uint16_t roleId = relationRoles.getOrAddRole(role);
 		const size_t shard = wayid % mutex.size();
@@ -268,10 +233,10 @@ protected:
 	bool require_integrity = true;
 
 	RelationStore relations; // unused
-	UsedWays used_ways;
 
 public:
 	UsedObjects usedNodes;
+	UsedObjects usedWays;
 	UsedObjects usedRelations;
 
 	OSMStore(NodeStore& nodes, WayStore& ways):
@@ -281,6 +246,8 @@ public:
 		// a member of a way used by a used relation, or a way that meets the way_keys
 		// criteria.
 		usedNodes(UsedObjects::Status::Disabled),
+		// A way is used if it's a member of a used relation
+		usedWays(UsedObjects::Status::Enabled),
 		// A relation is used only if it was previously accepted from relation_scan_function
 		usedRelations(UsedObjects::Status::Enabled)
 	{ 
@@ -301,14 +268,12 @@ public:
 	}
 	void relations_sort(unsigned int threadNum);
 
-	void mark_way_used(WayID i) { used_ways.insert(i); }
-	bool way_is_used(WayID i) { return used_ways.at(i); }
-
-	void ensureUsedWaysInited();
-
 	using tag_map_t = boost::container::flat_map<std::string, std::string>;
 
 	void clear();
+	// Free what's only needed while reading the .pbf: the scanned relations,
+	// and which ways and relations are used
+	void clearScanData();
 	void reportSize() const;
 
 	// Relation -> MultiPolygon or MultiLinestring
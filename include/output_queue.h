@@ -0,0 +1,135 @@
+/*! \file */
+#ifndef _OUTPUT_QUEUE_H
+#define _OUTPUT_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+
+// OutputQueue hands finished tiles from the worker threads to a single
+// writer thread.
+//
+// Workers only hold the lock long enough to append an item, and block if the
+// writer falls `capacity` items behind, so memory use is bounded when the disk
+// is slow. The writer takes everything queued in one go.
+//
+// It keeps enough statistics to tell whether the output stage is the
+// bottleneck: if workers stall for long, writing can't keep up.
+
+template<typename T>
+class OutputQueue {
+
+public:
+	OutputQueue(size_t capacity): capacity(capacity) { }
+
+	// Queue an item, waiting if the queue is full. onQueue is called with the
+	// queue locked, immediately before the item is added, so items are
+	// written in the order onQueue sees them.
+	template<typename F>
+	void push(T &&item, F onQueue) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (queue.size() >= capacity) {
+			auto start = std::chrono::steady_clock::now();
+			notFull.wait(lock, [&]() { return queue.size() < capacity; });
+			stallTime += std::chrono::steady_clock::now() - start;
+			numStalls++;
+		}
+		onQueue();
+		queue.emplace_back(std::move(item));
+		maxDepth = std::max(maxDepth, queue.size());
+		lock.unlock();
+		notEmpty.notify_one();
+	}
+
+	void push(T &&item) { push(std::move(item), []() { }); }
+
+	// Writer thread: move everything queued into batch, waiting if there's
+	// nothing yet. Returns false once finish() has been called and the
+	// queue is empty.
+	bool popAll(std::deque<T> &batch) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (queue.empty() && !finished) {
+			auto start = std::chrono::steady_clock::now();
+			notEmpty.wait(lock, [&]() { return !queue.empty() || finished; });
+			idleTime += std::chrono::steady_clock::now() - start;
+		}
+		if (queue.empty()) return false;
+		depthTotal += queue.size();
+		depthSamples++;
+		batch.swap(queue);
+		lock.unlock();
+		notFull.notify_all();
+		return true;
+	}
+
+	// No more items will be queued; the writer drains what's left then stops
+	void finish() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			finished = true;
+		}
+		notEmpty.notify_all();
+	}
+
+	std::string stats() {
+		using std::chrono::duration_cast;
+		using std::chrono::milliseconds;
+		std::lock_guard<std::mutex> lock(mutex);
+		std::ostringstream ss;
+		ss << "queue depth max " << maxDepth << "/" << capacity;
+		if (depthSamples > 0) ss << ", mean " << (depthTotal / depthSamples);
+		ss << "; workers stalled " << numStalls << " times for " << duration_cast<milliseconds>(stallTime).count() << "ms";
+		ss << "; writer idle " << duration_cast<milliseconds>(idleTime).count() << "ms";
+		return ss.str();
+	}
+
+private:
+	const size_t capacity;
+	std::mutex mutex;
+	std::condition_variable notEmpty, notFull;
+	std::deque<T> queue;
+	bool finished = false;
+
+	size_t maxDepth = 0;
+	uint64_t depthTotal = 0, depthSamples = 0;
+	uint64_t numStalls = 0;
+	std::chrono::steady_clock::duration stallTime{}, idleTime{};
+};
+
+// SpareBuffers holds tile buffers that a writer thread has finished with, so
+// workers can reuse their capacity rather than allocate for every tile. It
+// keeps at most `capacity` buffers; any more are freed.
+
+class SpareBuffers {
+
+public:
+	SpareBuffers(size_t capacity): capacity(capacity) { }
+
+	// Writer thread: hand back a buffer once it's been written
+	void put(std::string &&buffer) {
+		buffer.clear();
+		std::lock_guard<std::mutex> lock(mutex);
+		if (spares.size() < capacity) spares.emplace_back(std::move(buffer));
+	}
+
+	// An empty buffer, with the capacity of a previous tile if there's one spare
+	std::string take() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (spares.empty()) return std::string();
+		std::string rv = std::move(spares.back());
+		spares.pop_back();
+		return rv;
+	}
+
+private:
+	const size_t capacity;
+	std::mutex mutex;
+	std::vector<std::string> spares;
+};
+
+#endif //_OUTPUT_QUEUE_H
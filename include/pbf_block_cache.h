@@ -0,0 +1,63 @@
+/*! \file */
+#ifndef _PBF_BLOCK_CACHE_H
+#define _PBF_BLOCK_CACHE_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <map>
+#include "helpers.h"
+#include "pbf_reader.h"
+
+// PbfBlockCache keeps decompressed .pbf blocks in memory between read phases.
+//
+// Way and relation blocks are read several times (the scan phases, then once
+// per shard), and inflating them each time is a large part of the reading
+// time. The cache keeps blocks, as they're first read, until it reaches its
+// memory budget. Phases read the blocks in the same order each time, so
+// keeping what fits (rather than evicting) means the cached blocks stay cached.
+//
+// Blocks can be kept as they are, or recompressed with a codec that's faster
+// to decompress than zlib (e.g. zstd), so more fit in the budget.
+//
+// Blocks are keyed by their file and offset, so one cache can serve all the
+// inputs of a run.
+
+class PbfBlockCache {
+
+public:
+	PbfBlockCache(size_t budget, const Compression& compression);
+
+	// The decompressed block at [offset, offset + length) of input. If the block isn't
+	// cached, it's read with reader, and cached if keep is true.
+	// The data is valid until the next read on this thread.
+	protozero::data_view read(
+		PbfReader::PbfReader& reader,
+		const PbfReader::MappedPbf& input,
+		uint64_t offset,
+		int32_t length,
+		bool keep
+	);
+
+	// Drop the blocks that retain() returns false for
+	void retain(std::function<bool(const PbfReader::MappedPbf& input, uint64_t offset)> retain);
+	void clear();
+
+	std::string stats() const;
+
+private:
+	typedef std::shared_ptr<const std::string> Entry;
+
+	const size_t budget;
+	const Compression compression;
+
+	mutable std::mutex mutex;
+	std::map<std::pair<const PbfReader::MappedPbf*, uint64_t>, Entry> entries;
+	size_t used;
+
+	std::atomic<uint64_t> hits, misses;
+};
+
+#endif //_PBF_BLOCK_CACHE_H
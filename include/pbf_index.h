@@ -0,0 +1,65 @@
+/*! \file */
+#ifndef _PBF_INDEX_H
+#define _PBF_INDEX_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "pbf_reader.h"
+
+// Bump if the format of the index file changes
+#define PBF_INDEX_VERSION 1
+#define PBF_INDEX_EXTENSION ".tmidx"
+
+// PbfIndex is what tilemaker learns about a .osm.pbf before reading it: its
+// header, where each block is, and what each block contains.
+//
+// Finding that out means walking every block header, and on a planet file,
+// decompressing blocks to find where the ways and relations start. The index
+// can be saved next to the .pbf (as file.osm.pbf.tmidx), and is reused as long
+// as the .pbf's size and modification time haven't changed.
+
+class PbfIndex {
+
+public:
+	struct Block {
+		uint64_t offset;
+		int32_t length;
+		bool hasNodes, hasWays, hasRelations;
+
+		// ID ranges of each type in the block (min > max if there are none);
+		// only known once the blocks have been classified
+		uint64_t minNodeId, maxNodeId;
+		uint64_t minWayId, maxWayId;
+		uint64_t minRelationId, maxRelationId;
+	};
+
+	PbfReader::HeaderBlock header;
+	std::vector<Block> blocks;
+	size_t blockBytes;	// total size of the blocks
+	bool classified;	// do the hasNodes etc. flags come from the blocks' contents?
+
+	PbfIndex();
+
+	static std::string indexFilename(const std::string& pbfFilename);
+
+	// Load the index saved beside the .pbf; false if there's none, or it's stale
+	bool load(const std::string& pbfFilename);
+
+	// Read the header and find the blocks. Every block may contain anything.
+	void scan(const PbfReader::MappedPbf& input);
+
+	// Decompress every block to find out exactly what it contains
+	void classify(const PbfReader::MappedPbf& input, unsigned int threadNum);
+
+	// Save beside the .pbf; false if that's not possible (e.g. read-only directory)
+	bool save(const std::string& pbfFilename) const;
+
+private:
+	static bool fileStamp(const std::string& filename, uint64_t& size, int64_t& mtime);
+};
+
+// Read a .pbf's header, from its index if there is a valid one
+PbfReader::HeaderBlock ReadPbfHeader(const std::string& pbfFilename);
+
+#endif //_PBF_INDEX_H
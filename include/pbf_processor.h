@@ -11,7 +11,10 @@
 #include "osm_store.h"
 #include "significant_tags.h"
 #include "pbf_reader.h"
+#include "pbf_block_cache.h"
 #include "tag_map.h"
+#include "way_spill.h"
+#include "way_store.h"
 #include <protozero/data_view.hpp>
 
 class OsmLuaProcessing;
@@ -38,6 +41,11 @@ struct IndexedBlockMetadata: BlockMetadata {
 	size_t index;
 };
 
+// The ID range of each of an input's blocks, when its block index knows them
+struct ObjectIdRanges {
+	std::vector<std::pair<uint64_t, uint64_t>> nodes, ways, relations;
+};
+
 /**
  *\brief Reads a PBF OSM file and returns objects as a stream of events to a class derived from OsmLuaProcessing
  *
@@ -50,16 +58,33 @@ public:
 
 	PbfProcessor(OSMStore &osmStore);
 
-	using pbfreader_generate_output = std::function< std::shared_ptr<OsmLuaProcessing> () >;
-	using pbfreader_generate_stream = std::function< std::shared_ptr<std::istream> () >;
-
-	int ReadPbfFile(
+	// Keep up to budget bytes of decompressed blocks between phases
+	void enableBlockCache(size_t budget, const Compression& compression);
+	// Inflate blocks on decodeThreads separate threads, ahead of the threads
+	// that run Lua and fill the stores
+	void enablePipeline(unsigned int decodeThreads);
+	// The node and/or way stores were loaded from an earlier run, so don't
+	// fill them again
+	void useLoadedStores(bool nodes, bool ways);
+	// Store every node and way, not just those the profile needs, so the
+	// stores can be saved and reused with any profile
+	void storeAllObjects();
+	// With shard stores, read the ways once, spilling each later shard's
+	// ways to a file in directory, rather than reading them once per shard
+	void enableWaySpill(const std::string& directory);
+
+	// The output for objects read from inputFile
+	using pbfreader_generate_output = std::function< std::shared_ptr<OsmLuaProcessing> (const std::string& inputFile) >;
+
+	// Read the inputs a phase at a time: all their nodes, then all their
+	// ways, and so on, so the stores are built once for all of them
+	int ReadPbfFiles(
 		uint shards,
-		bool hasSortTypeThenID,
 		const SignificantTags& nodeKeys,
 		const SignificantTags& wayKeys,
 		unsigned int threadNum,
-		const pbfreader_generate_stream& generate_stream,
+		const std::vector<const PbfReader::MappedPbf*>& inputs,
+		bool writeIndex,
 		const pbfreader_generate_output& generate_output,
 		const NodeStore& nodeStore,
 		const WayStore& wayStore
@@ -76,13 +101,29 @@ public:
 	}
 
 private:
+	struct InputBlocks {
+		const PbfReader::MappedPbf* input;
+		bool locationsOnWays;
+		ObjectIdRanges idRanges;
+		std::map<std::size_t, BlockMetadata> blocks;
+	};
+
+	// The decompressed block, valid until the next read on this thread
+	protozero::data_view readBlockData(
+		const PbfReader::MappedPbf& input,
+		const BlockMetadata& blockMetadata,
+		ReadPhase phase,
+		uint shard,
+		uint effectiveShards
+	);
 	bool ReadBlock(
-		std::istream &infile,
+		protozero::data_view blob,
 		OsmLuaProcessing &output,
 		const BlockMetadata& blockMetadata,
 		const SignificantTags& nodeKeys,
 		const SignificantTags& wayKeys,
 		bool locationsOnWays,
+		uint32_t inputIndex,
 		ReadPhase phase,
 		uint shard,
 		uint effectiveShard
@@ -95,9 +136,34 @@ private:
 		const PbfReader::PrimitiveBlock& pb,
 		const SignificantTags& wayKeys,
 		bool locationsOnWays,
+		uint32_t inputIndex,
 		uint shard,
 		uint effectiveShards
 	);
+	void lookupWayNodes(const std::vector<NodeID>& refs, LatpLonVec& llVec, std::vector<NodeID>& nodeVec);
+	void emitWay(
+		OsmLuaProcessing& output,
+		bool wanted,
+		WayID wayId,
+		const LatpLonVec& llVec,
+		const std::vector<NodeID>& nodeVec,
+		const TagMap& tags,
+		std::vector<WayStore::ll_element_t>& llWays,
+		std::vector<std::pair<WayID, std::vector<NodeID>>>& nodeWays
+	);
+	void storeWays(
+		uint shard,
+		std::vector<WayStore::ll_element_t>& llWays,
+		std::vector<std::pair<WayID, std::vector<NodeID>>>& nodeWays
+	);
+	// Read back the ways spilled for a later shard
+	void readSpilledWays(
+		uint shard,
+		uint effectiveShards,
+		unsigned int threadNum,
+		const std::vector<const PbfReader::MappedPbf*>& inputs,
+		const pbfreader_generate_output& generate_output
+	);
 	bool ScanWays(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const SignificantTags& wayKeys);
 	bool ScanRelations(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const SignificantTags& wayKeys);
 	bool ReadRelations(
@@ -118,12 +184,28 @@ private:
 		return rel.vals[typePos] == val;
 	}
 
+	static const char* phaseName(ReadPhase phase);
+
 	/// Find a string in the dictionary
 	static int findStringPosition(const PbfReader::PrimitiveBlock& pb, const std::string& str);
 	
 	OSMStore &osmStore;
 	std::mutex ioMutex;
 	std::atomic<bool> compactWarningIssued;
+
+	size_t blockCacheBudget;
+	Compression blockCacheCompression;
+	std::unique_ptr<PbfBlockCache> blockCache;
+
+	unsigned int decodeThreads;
+
+	bool nodesLoaded;
+	bool waysLoaded;
+	bool storeAll;
+
+	std::string waySpillDirectory;
+	std::unique_ptr<WaySpill> waySpill;
+	bool waysSpilling;
 };
 
 int ReadPbfBoundingBox(const std::string &inputFile, double &minLon, double &maxLon, 
@@ -2,6 +2,8 @@
 #define _PBF_READER_H
 
 #include <istream>
+#include <memory>
+#include <string>
 #include <protozero/data_view.hpp>
 #include <protozero/pbf_message.hpp>
 #include <protozero/types.hpp>
@@ -269,6 +271,38 @@ namespace PbfReader {
 		PrimitiveGroups groupsImpl;
 	};
 
+	// A .osm.pbf file, memory-mapped read-only.
+	//
+	// The file is mapped once and shared by all threads, which decode blocks
+	// straight from the mapped bytes: there's no per-thread file handle, and
+	// no seek or copy per block.
+	class MappedPbf {
+	public:
+		enum class Access { Normal, Sequential, Random };
+
+		MappedPbf(const std::string& filename);
+		~MappedPbf();
+
+		const std::string& filename() const { return path; }
+		size_t size() const { return length; }
+
+		// The bytes at [offset, offset + size); throws if that's past the end
+		protozero::data_view view(size_t offset, size_t size) const;
+
+		// Hint how the file is about to be read, so the kernel can read ahead
+		// (or not) accordingly
+		void advise(Access access) const;
+		// Hint that [offset, offset + size) will be needed soon
+		void willNeed(size_t offset, size_t size) const;
+
+	private:
+		struct Mapping;
+		std::string path;
+		std::unique_ptr<Mapping> mapping;
+		const char* data;
+		size_t length;
+	};
+
 	// This is a little weird: we use a class only to get private storage
 	// for multiple PBF readers. Due to the way we plumb the input files
 	// elsewhere in the system, the readers don't own them, and are not
@@ -277,6 +311,12 @@ namespace PbfReader {
 	public:
 		BlobHeader readBlobHeader(std::istream& input);
 		protozero::data_view readBlob(int32_t datasize, std::istream& input);
+
+		// Read the blob header at offset, advancing offset past it
+		BlobHeader readBlobHeader(const MappedPbf& input, size_t& offset);
+		// Decode a blob in place: uncompressed data isn't copied
+		protozero::data_view readBlob(protozero::data_view blob);
+
 		HeaderBlock readHeaderBlock(protozero::data_view data);
 		HeaderBBox readHeaderBBox(protozero::data_view data);
 		PrimitiveBlock& readPrimitiveBlock(protozero::data_view data);
@@ -284,6 +324,8 @@ namespace PbfReader {
 		HeaderBlock readHeaderFromFile(std::istream& input);
 
 	private:
+		BlobHeader parseBlobHeader(protozero::data_view data);
+
 		std::string blobStorage; // the blob as stored in the PBF
 		std::string blobStorage2; // the blob after decompression, if needed
 		PrimitiveBlock pb;
@@ -0,0 +1,31 @@
+/*! \file */
+#ifndef _PBF_VARINT_H
+#define _PBF_VARINT_H
+
+#include <cstdint>
+#include <vector>
+#include <protozero/data_view.hpp>
+
+// Bulk decoding of the packed, delta-coded sint64 fields that make up most of
+// a .pbf: DenseNodes ids/lats/lons, and Way refs/lats/lons.
+//
+// On CPUs with fast BMI2, we load 8 bytes at once, find every varint that
+// ends in them from the continuation bits, and gather each one's 7-bit groups
+// with a single pext. Elsewhere, and for the last few bytes of a field, varints
+// are decoded one at a time, but still straight into the output.
+
+namespace PbfReader {
+	enum class DeltaDecoder { Scalar, Bmi2 };
+
+	// The fastest decoder this CPU supports; chosen once
+	DeltaDecoder bestDeltaDecoder();
+	const char* deltaDecoderName(DeltaDecoder decoder);
+
+	// Decode a packed field of zigzag-encoded deltas, appending the running
+	// total (starting from, and updating, sum) to output. T can be narrower than
+	// 64 bits, in which case the total wraps as it would in a T.
+	template<typename T>
+	void decodeDeltas(protozero::data_view data, uint64_t& sum, std::vector<T>& output, DeltaDecoder decoder = bestDeltaDecoder());
+}
+
+#endif //_PBF_VARINT_H
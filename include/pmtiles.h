@@ -3,7 +3,16 @@
 #define _PMTILES_H
 
 #include <fstream>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <condition_variable>
 #include "external/pmtiles.hpp"
+#include "helpers.h"
+#include "output_queue.h"
 
 struct TileOffset {
 	uint64_t offset : 40;
@@ -21,10 +30,12 @@ struct TileOffset {
 #define FIRST_LEAF_TILE 1365
 // Threshold for using the root directory only
 #define ROOT_ONLY 2200
-// Maximum size in bytes of tiles considered "tiny" (i.e. potentially repeatable)
-#define TINY_LENGTH 100
-// Expire the tiny cache when it reaches this size
-#define TINY_MAX_SIZE 10000
+// Maximum number of compressed tiles waiting for the writer thread
+#define WRITE_QUEUE_SIZE 1024
+// Size of the output stream buffer used by the writer thread
+#define WRITE_BUFFER_SIZE (4 * 1024 * 1024)
+// Clustered output: stop starting new batches when this many bytes are waiting to be written in order
+#define REORDER_BUFFER_SIZE (1024 * 1024 * 1024)
 
 class PMTiles { 
 
@@ -34,22 +45,68 @@ public:
 
 	pmtiles::headerv3 header;
 	bool isSparse = true;
+	bool isClustered = false;
+	Compression compression;	// for tiles; directories and metadata use gzip, or zstd if tiles do
 
 	void open(std::string &filename);
-	void saveTile(int zoom, int x, int y, std::string &data);
+	void saveTile(int zoom, int x, int y, const std::string &data);
 	void close(std::string &metadata);
 
+	// Clustered output: batches of tiles are registered in ascending tile ID
+	// order before they are processed; tiles are written once every batch that
+	// could precede them has completed.
+	void queueBatch(uint64_t firstTileId);
+	void startBatch(uint64_t firstTileId);
+	void completeBatch(uint64_t firstTileId);
+
 private:
 	std::ofstream outputStream;
-	std::mutex fileMutex;	// guards file writes, numTilesWritten
-	std::mutex indexMutex;	// guards access to sparseIndex, denseIndex, tinyCache, numTilesAddressed
+	std::vector<char> outputBuffer;
+	std::mutex fileMutex;	// guards leaf directory writes
+	std::mutex indexMutex;	// guards access to sparseIndex, denseIndex, dedupIndex, numTilesAddressed
 	uint64_t leafStart = 0;
 	uint64_t numTilesWritten = 0;
 	uint64_t numTilesAddressed = 0;
 	uint64_t numTileEntries = 0;
 	std::map<uint64_t, TileOffset> sparseIndex;
 	std::vector<TileOffset> denseIndex;
-	std::unordered_map<std::string, TileOffset> tinyCache;
+	std::unordered_map<Hash128, TileOffset> dedupIndex;	// hash of uncompressed tile -> where it was written
+	std::vector<pmtiles::entryv3> rootEntries;
+	std::vector<pmtiles::entryv3> leafEntries;
+
+	// Clustered output: compressed tiles wait in reorderBuffer until all
+	// earlier batches are done, then are written and indexed in tile ID order.
+	// Leaf directories go to a temporary file as they fill, and are appended
+	// after the tile data on close.
+	struct ClusteredTile {
+		std::string compressed;
+		Hash128 hash;
+	};
+	std::mutex reorderMutex;	// guards reorderBuffer, pendingBatches, and (in clustered mode) dedupIndex, numTilesAddressed, the directory entries and leafStream
+	std::condition_variable reorderDrained;
+	std::map<uint64_t, ClusteredTile> reorderBuffer;
+	std::set<uint64_t> pendingBatches;
+	uint64_t reorderBytes = 0;
+	std::string leafFilename;
+	std::fstream leafStream;
+
+	// Tiles are compressed by the worker threads, then handed to a single
+	// writer thread through a bounded queue. Offsets are allocated when a tile
+	// is queued, so the queue is always drained in file order.
+	std::thread writerThread;
+	OutputQueue<std::string> writeQueue;
+	SpareBuffers spareBuffers;	// written tiles, whose memory workers compress the next into
+	uint64_t nextTileOffset = 0;	// guarded by writeQueue, as is numTilesWritten
+	uint64_t numDuplicates = 0;
+
+	uint64_t queueTile(std::string &&compressed);
+	Compression internalCompression() const;
+	static uint8_t headerCompression(const Compression &c);
+	void writeQueuedTiles();
+	void stopWriter();
+	void reportWriterStats();
+	void writeClusteredTiles(uint64_t beforeTileId);
+	void appendLeafDirectories();
 
 	void appendWithRLE(std::vector<pmtiles::entryv3> &entries, pmtiles::entryv3 &entry);
 	void appendTileEntry(uint64_t tileId, TileOffset offset, std::vector<pmtiles::entryv3> &rootEntries, std::vector<pmtiles::entryv3> &entries);
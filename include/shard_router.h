@@ -0,0 +1,62 @@
+#ifndef _SHARD_ROUTER_H
+#define _SHARD_ROUTER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// ShardRouter records which shards of a ShardedNodeStore or ShardedWayStore
+// hold IDs in each range of 4,096 IDs, so a lookup can go straight to the
+// store that owns an ID rather than asking each store in turn.
+//
+// Objects with nearby IDs were usually created together, in the same place,
+// so most ranges are in a single shard. Where a range spans several shards,
+// only those shards need to be asked.
+//
+// It takes one byte per range: 4MB to cover 2^34 IDs. IDs past that aren't
+// routed, and could be in any shard.
+
+class ShardRouter {
+public:
+	static const uint64_t GroupBits = 12;
+	static const uint64_t MaxGroups = (1ull << 34) >> GroupBits;
+	static const uint8_t AnyShard = 0xFF;
+
+	ShardRouter(): groups(new std::atomic<uint8_t>[MaxGroups]) {
+		clear();
+	}
+
+	void clear() {
+		for (uint64_t i = 0; i < MaxGroups; i++)
+			groups[i].store(0, std::memory_order_relaxed);
+	}
+
+	// Called as objects are inserted, from any thread
+	void mark(size_t shard, uint64_t id) {
+		const uint64_t group = id >> GroupBits;
+		if (group >= MaxGroups)
+			return;
+
+		// Most marks repeat one already made, so avoid contending for the line
+		const uint8_t bit = 1 << shard;
+		if (!(groups[group].load(std::memory_order_relaxed) & bit))
+			groups[group].fetch_or(bit, std::memory_order_relaxed);
+	}
+
+	// A bitmask of the shards that may hold id
+	uint8_t shards(uint64_t id) const {
+		const uint64_t group = id >> GroupBits;
+		if (group >= MaxGroups)
+			return AnyShard;
+		return groups[group].load(std::memory_order_relaxed);
+	}
+
+	bool mayContain(size_t shard, uint64_t id) const {
+		return shards(id) & (1 << shard);
+	}
+
+private:
+	std::unique_ptr<std::atomic<uint8_t>[]> groups;
+};
+
+#endif
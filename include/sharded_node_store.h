@@ -4,6 +4,7 @@
 #include <functional>
 #include <memory>
 #include "node_store.h"
+#include "shard_router.h"
 
 class ShardedNodeStore : public NodeStore {
 public:
@@ -27,6 +28,8 @@ public:
 private:
 	std::function<std::shared_ptr<NodeStore>()> createNodeStore;
 	std::vector<std::shared_ptr<NodeStore>> stores;
+	// Which stores hold which ranges of IDs, so lookups go straight to them
+	ShardRouter router;
 };
 
 #endif
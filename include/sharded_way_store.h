@@ -4,6 +4,7 @@
 #include <functional>
 #include <memory>
 #include "way_store.h"
+#include "shard_router.h"
 
 class NodeStore;
 
@@ -13,7 +14,8 @@ public:
 	~ShardedWayStore();
 	void reopen() override;
 	void batchStart() override;
-	std::vector<LatpLon> at(WayID wayid) const override;
+	using WayStore::at;
+	void at(WayID wayid, std::vector<LatpLon>& out) const override;
 	bool requiresNodes() const override;
 	void insertLatpLons(std::vector<WayStore::ll_element_t> &newWays) override;
 	void insertNodes(const std::vector<std::pair<WayID, std::vector<NodeID>>>& newWays) override;
@@ -30,6 +32,10 @@ private:
 	std::function<std::shared_ptr<WayStore>()> createWayStore;
 	const NodeStore& nodeStore;
 	std::vector<std::shared_ptr<WayStore>> stores;
+	// Which stores hold which ranges of IDs, so lookups go straight to them
+	ShardRouter router;
+	// What shard() returns: each store, noting in router which IDs it's given
+	std::vector<std::shared_ptr<WayStore>> routedStores;
 };
 
 #endif
@@ -78,8 +78,8 @@ public:
 	class LayerDefinition layers;
 	uint baseZoom, startZoom, endZoom;
 	uint mvtVersion, combineBelow;
-	bool includeID, compress, gzip, highResolution;
-	std::string compressOpt;
+	bool includeID, highResolution;
+	Compression compression;	// for the output format in use
 	bool clippingBoxFromJSON;
 	double minLon, minLat, maxLon, maxLat;
 	std::string projectName, projectVersion, projectDesc;
@@ -88,7 +88,8 @@ public:
 	Config();
 	virtual ~Config();
 
-	void readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, Box &clippingBox);
+	void readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, Box &clippingBox, OptionsParser::OutputMode outputMode);
+	void readCompression(const rapidjson::Value &settings, OptionsParser::OutputMode outputMode);
 	void enlargeBbox(double cMinLon, double cMaxLon, double cMinLat, double cMaxLat);
 };
 
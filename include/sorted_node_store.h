@@ -3,6 +3,7 @@
 
 #include "node_store.h"
 #include "mmap_allocator.h"
+#include "sorted_store_file.h"
 #include <atomic>
 #include <map>
 #include <memory>
@@ -75,6 +76,10 @@ public:
 	const NodeStore& shard(size_t shard) const override { return *this; }
 	size_t shards() const override { return 1; }
 
+	// Save the finalized store, or use one saved by an earlier run (see SortedStoreFile)
+	bool save(const std::string& filename, const std::string& stamp) const;
+	bool load(const std::string& filename, const std::string& stamp);
+
 private: 
 	// When true, store chunks compressed. Only store compressed if the
 	// chunk is sufficiently large.
@@ -82,7 +87,10 @@ private:
 
 	mutable std::mutex orphanageMutex;
 	std::vector<SortedNodeStoreTypes::GroupInfo*> groups;
+	std::vector<uint32_t> groupSizes;
 	std::vector<std::pair<void*, size_t>> allocatedMemory;
+	// The groups, when they were loaded from a file
+	std::unique_ptr<SortedStoreFile> loaded;
 
 	// The orphanage stores nodes that come from groups that may be worked on by
 	// multiple threads. They'll get folded into the index during finalize()
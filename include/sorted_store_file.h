@@ -0,0 +1,63 @@
+/*! \file */
+#ifndef _SORTED_STORE_FILE_H
+#define _SORTED_STORE_FILE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// SortedStoreFile saves the groups of a finalized SortedNodeStore or
+// SortedWayStore, so a later run on the same input can use them instead of
+// building the store again.
+//
+// A group only refers to its own contents by relative offsets, so groups are
+// written as they are, and used in place from a read-only mapping of the
+// file. Concurrent runs that map the same file share its pages.
+//
+// The file records a "stamp" of what it was built from (the inputs' paths,
+// sizes and mtimes, and any options that change what's stored). It's only
+// used if the stamp still matches.
+
+#define SORTED_STORE_FILE_VERSION 1
+
+class SortedStoreFile {
+
+public:
+	struct Group {
+		uint64_t index;
+		const char* data;
+		uint64_t size;
+	};
+
+	// The stamp for a store built from these inputs
+	static std::string stamp(const std::vector<std::string>& inputFiles, const std::string& options);
+
+	// Write kind ("nodes", "ways") of store; counts are the store's totals.
+	// False if the file can't be written.
+	static bool save(
+		const std::string& filename,
+		const std::string& kind,
+		const std::string& stamp,
+		const std::vector<uint64_t>& counts,
+		const std::vector<Group>& groups
+	);
+
+	// Map a saved store; false if there's none, or it's stale
+	bool load(const std::string& filename, const std::string& kind, const std::string& stamp);
+
+	// Valid while this is loaded
+	const std::vector<uint64_t>& counts() const { return loadedCounts; }
+	const std::vector<Group>& groups() const { return loadedGroups; }
+	uint64_t bytes() const { return region ? region->get_size() : 0; }
+
+private:
+	std::unique_ptr<boost::interprocess::file_mapping> file;
+	std::unique_ptr<boost::interprocess::mapped_region> region;
+	std::vector<uint64_t> loadedCounts;
+	std::vector<Group> loadedGroups;
+};
+
+#endif //_SORTED_STORE_FILE_H
@@ -7,6 +7,7 @@
 #include <mutex>
 #include "way_store.h"
 #include "mmap_allocator.h"
+#include "sorted_store_file.h"
 
 class NodeStore;
 
@@ -87,7 +88,8 @@ public:
 	~SortedWayStore();
 	void reopen() override;
 	void batchStart() override;
-	std::vector<LatpLon> at(WayID wayid) const override;
+	using WayStore::at;
+	void at(WayID wayid, std::vector<LatpLon>& out) const override;
 	bool requiresNodes() const override { return true; }
 	void insertLatpLons(std::vector<WayStore::ll_element_t> &newWays) override;
 	void insertNodes(const std::vector<std::pair<WayID, std::vector<NodeID>>>& newWays) override;
@@ -99,6 +101,10 @@ public:
 	WayStore& shard(size_t shard) override { return *this; }
 	const WayStore& shard(size_t shard) const override { return *this; }
 	size_t shards() const override { return 1; }
+
+	// Save the finalized store, or use one saved by an earlier run (see SortedStoreFile)
+	bool save(const std::string& filename, const std::string& stamp) const;
+	bool load(const std::string& filename, const std::string& stamp);
 	
 	static uint16_t encodeWay(
 		const std::vector<NodeID>& way,
@@ -107,13 +113,18 @@ public:
 	);
 
 	static std::vector<NodeID> decodeWay(uint16_t flags, const uint8_t* input);
+	// As above, but into out, so it can be reused between ways
+	static void decodeWay(uint16_t flags, const uint8_t* input, std::vector<NodeID>& out);
 
 private:
 	bool compressWays;
 	const NodeStore& nodeStore;
 	mutable std::mutex orphanageMutex;
 	std::vector<SortedWayStoreTypes::GroupInfo*> groups;
+	std::vector<uint32_t> groupSizes;
 	std::vector<std::pair<void*, size_t>> allocatedMemory;
+	// The groups, when they were loaded from a file
+	std::unique_ptr<SortedStoreFile> loaded;
 
 	// The orphanage stores nodes that come from groups that may be worked on by
 	// multiple threads. They'll get folded into the index during finalize()
@@ -6,7 +6,10 @@
 #include <set>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include <boost/sort/sort.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
 #include "output_object.h"
 #include "append_vector.h"
 #include "clip_cache.h"
@@ -52,88 +55,149 @@ struct OutputObjectXYID {
 	uint64_t id;
 };
 
+// Objects within a z6 tile are ordered by the Morton (Z-order) key of their
+// offset, x bit before y bit at each level. This clusters them by parent tile:
+// all the objects in any tile at z6 or higher form one contiguous run.
+inline uint16_t spreadZ6OffsetBits(Z6Offset v) {
+	uint16_t x = v;
+	x = (x | (x << 4)) & 0x0F0F;
+	x = (x | (x << 2)) & 0x3333;
+	x = (x | (x << 1)) & 0x5555;
+	return x;
+}
+
+inline uint16_t z6OffsetKey(Z6Offset x, Z6Offset y) {
+	return (spreadZ6OffsetBits(x) << 1) | spreadZ6OffsetBits(y);
+}
+
+template<typename OO> bool z6OffsetOrder(const OO& a, const OO& b) {
+	return z6OffsetKey(a.x, a.y) < z6OffsetKey(b.x, b.y);
+}
+
+inline Z6Offset compactZ6OffsetBits(uint16_t x) {
+	x &= 0x5555;
+	x = (x | (x >> 1)) & 0x3333;
+	x = (x | (x >> 2)) & 0x0F0F;
+	x = (x | (x >> 4)) & 0x00FF;
+	return x;
+}
+
+template<typename OO>
+OutputObjectID outputObjectWithId(const OO& input) {
+	return OutputObjectID({ input.oo, 0 });
+}
+
+template<>
+inline OutputObjectID outputObjectWithId<OutputObjectXYID>(const OutputObjectXYID& input) {
+	return OutputObjectID({ input.oo, input.id });
+}
+
+// The finalized, read-only objects of one z6 tile. The objects stay in the
+// AppendVector they were sorted in, which is moved here rather than copied.
+// Their Morton keys are held in a parallel array, so a lookup's binary search
+// reads 2 bytes an object and touches few cache lines.
+template<typename OO> struct Z6Bucket {
+	std::vector<uint16_t, mmap_allocator<uint16_t>> keys;
+	AppendVectorNS::AppendVector<OO> objects;
+
+	// Take over the sorted objects (leaving an empty AppendVector behind) and index their keys
+	void assign(AppendVectorNS::AppendVector<OO>& sorted) {
+		std::swap(objects, sorted);
+		keys.reserve(objects.size());
+		for (auto it = objects.begin(); it != objects.end(); it++)
+			keys.push_back(z6OffsetKey(it->x, it->y));
+	}
+	OutputObjectID at(size_t i) const {
+		return outputObjectWithId(objects[i]);
+	}
+
+	// Index of the first key >= needle (branchless binary search)
+	size_t lowerBound(uint16_t needle) const {
+		size_t n = keys.size();
+		if (n == 0) return 0;
+		const uint16_t* k = keys.data();
+		size_t lo = 0;
+		while (n > 1) {
+			size_t half = n / 2;
+			lo = k[lo + half] < needle ? lo + half : lo;
+			n -= half;
+		}
+		return lo + (k[lo] < needle);
+	}
+};
+
+// Buckets holding more than 1/FINALIZE_LARGE_BUCKET_SHARE of a thread's fair
+// share of objects are sorted with all threads; the rest are sorted whole, one per thread.
+#define FINALIZE_LARGE_BUCKET_SHARE 2
+
 template<typename OO> void finalizeObjects(
 	const std::string& name,
 	const size_t& threadNum,
 	const unsigned int& indexZoom,
 	typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator begin,
 	typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator end,
-	typename std::vector<std::vector<OO>>& lowZoom
+	typename std::vector<std::vector<OO>>& lowZoom,
+	std::vector<Z6Bucket<OO>>& buckets
 	) {
-	size_t z6OffsetDivisor = indexZoom >= CLUSTER_ZOOM ? (1 << (indexZoom - CLUSTER_ZOOM)) : 1;
 #ifdef CLOCK_MONOTONIC
 	timespec startTs, endTs;
 	clock_gettime(CLOCK_MONOTONIC, &startTs);
 #endif
 
-	int i = -1;
+	// On a global extract, most of the 4,096 z6 buckets are populated, and it's
+	// best to give each thread whole buckets to sort. On a small extract, a
+	// handful of buckets hold nearly everything (e.g. Colorado has ~9 z6 tiles,
+	// 1 of which has 95% of its output objects), so those are sorted in turn
+	// with a multi-threaded sort to keep every thread busy.
+	size_t total = 0;
+	std::vector<size_t> large, small;
+	for (auto it = begin; it != end; it++) total += it->size();
+	size_t largeSize = std::max<size_t>(1, total / std::max<size_t>(1, threadNum * FINALIZE_LARGE_BUCKET_SHARE));
 	for (auto it = begin; it != end; it++) {
-		i++;
-		if (it->size() > 0 || i % 50 == 0 || i == 4095) {
-			std::cout << "\r" << name << ": finalizing z6 tile " << (i + 1) << "/" << CLUSTER_ZOOM_AREA;
+		if (it->size() == 0) continue;
+		(it->size() >= largeSize && threadNum > 1 ? large : small).push_back(it - begin);
+	}
+	// biggest first, so no thread is left with a big bucket at the end
+	std::sort(small.begin(), small.end(), [&](size_t a, size_t b) { return begin[a].size() > begin[b].size(); });
 
-#ifdef CLOCK_MONOTONIC
-			clock_gettime(CLOCK_MONOTONIC, &endTs);
-			uint64_t elapsedNs = 1e9 * (endTs.tv_sec - startTs.tv_sec) + endTs.tv_nsec - startTs.tv_nsec;
-			std::cout << " (" << std::to_string((uint32_t)(elapsedNs / 1e6)) << " ms)";
-#endif
-			std::cout << std::flush;
-		}
-		if (it->size() == 0)
-			continue;
+	std::mutex progressMutex;
+	size_t finished = 0;
+	const size_t populated = large.size() + small.size();
+	auto finalizeBucket = [&](size_t i, size_t sortThreads) {
+		auto& objects = begin[i];
 
 		// We track a separate copy of low zoom objects to avoid scanning large
 		// lists of objects that may be on slow disk storage.
-		for (auto objectIt = it->begin(); objectIt != it->end(); objectIt++)
+		for (auto objectIt = objects.begin(); objectIt != objects.end(); objectIt++)
 			if (objectIt->oo.minZoom < CLUSTER_ZOOM)
 				lowZoom[i].push_back(*objectIt);
 
-		// If the user is doing a a small extract, there are few populated
-		// entries in `object`.
-		//
-		// e.g. Colorado has ~9 z6 tiles, 1 of which has 95% of its output
-		// objects.
-		//
-		// This optimizes for the small extract case by doing:
-		// - for each vector in objects
-		//   - do a multi-threaded sort of vector
-		//
-		// For small extracts, this ensures that all threads are used even if
-		// only a handful of entries in `objects` are non-empty.
-		//
-		// For a global extract, this will have some overhead of repeatedly
-		// setting up/tearing down threads. In that case, it would be 
-		// better to assign chunks of `objects` to each thread.
-		//
-		// That's a future performance improvement, so deferring for now.
-		boost::sort::block_indirect_sort(
-			it->begin(),
-			it->end(), 
-			[indexZoom](const OO& a, const OO& b) {
-				// Cluster by parent zoom, so that a subsequent search
-				// can find a contiguous range of entries for any tile
-				// at zoom 6 or higher.
-				const size_t aX = a.x;
-				const size_t aY = a.y;
-				const size_t bX = b.x;
-				const size_t bY = b.y;
-				for (size_t z = CLUSTER_ZOOM; z <= indexZoom; z++) {
-					const auto aXz = aX / (1 << (indexZoom - z));
-					const auto bXz = bX / (1 << (indexZoom - z));
-					if (aXz != bXz)
-						return aXz < bXz;
-
-					const auto aYz = aY / (1 << (indexZoom - z));
-					const auto bYz = bY / (1 << (indexZoom - z));
-
-					if (aYz != bYz)
-						return aYz < bYz;
-				}
+		if (sortThreads > 1)
+			boost::sort::block_indirect_sort(objects.begin(), objects.end(), z6OffsetOrder<OO>, sortThreads);
+		else
+			boost::sort::pdqsort(objects.begin(), objects.end(), z6OffsetOrder<OO>);
+
+		buckets[i].assign(objects);
+
+		std::lock_guard<std::mutex> lock(progressMutex);
+		finished++;
+		std::cout << "\r" << name << ": finalizing z6 tile " << finished << "/" << populated;
+#ifdef CLOCK_MONOTONIC
+		clock_gettime(CLOCK_MONOTONIC, &endTs);
+		uint64_t elapsedNs = 1e9 * (endTs.tv_sec - startTs.tv_sec) + endTs.tv_nsec - startTs.tv_nsec;
+		std::cout << " (" << std::to_string((uint32_t)(elapsedNs / 1e6)) << " ms)";
+#endif
+		std::cout << std::flush;
+	};
+
+	for (size_t i : large)
+		finalizeBucket(i, threadNum);
 
-				return false;
-			},
-			threadNum
-		);
+	if (!small.empty()) {
+		boost::asio::thread_pool pool(std::max<size_t>(1, threadNum));
+		for (size_t i : small)
+			boost::asio::post(pool, [&, i]() { finalizeBucket(i, 1); });
+		pool.join();
 	}
 
 	std::cout << std::endl;
@@ -141,22 +205,24 @@ template<typename OO> void finalizeObjects(
 
 template<typename OO> void collectTilesWithObjectsAtZoomTemplate(
 	const unsigned int& indexZoom,
-	const typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator objects,
-	const size_t size,
+	const std::vector<Z6Bucket<OO>>& buckets,
 	std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms
 ) {
 	size_t maxZoom = zooms.size() - 1;
 	uint16_t z6OffsetDivisor = indexZoom >= CLUSTER_ZOOM ? (1 << (indexZoom - CLUSTER_ZOOM)) : 1;
 	int64_t lastX = -1;
 	int64_t lastY = -1;
-	for (size_t i = 0; i < size; i++) {
+	for (size_t i = 0; i < buckets.size(); i++) {
 		const size_t z6x = i / CLUSTER_ZOOM_WIDTH;
 		const size_t z6y = i % CLUSTER_ZOOM_WIDTH;
+		const auto& keys = buckets[i].keys;
+
+		for (size_t j = 0; j < keys.size(); j++) {
+			if (j > 0 && keys[j] == keys[j-1]) continue;
 
-		for (size_t j = 0; j < objects[i].size(); j++) {
 			// Compute the x, y at the base zoom level
-			TileCoordinate baseX = z6x * z6OffsetDivisor + objects[i][j].x;
-			TileCoordinate baseY = z6y * z6OffsetDivisor + objects[i][j].y;
+			TileCoordinate baseX = z6x * z6OffsetDivisor + compactZ6OffsetBits(keys[j] >> 1);
+			TileCoordinate baseY = z6y * z6OffsetDivisor + compactZ6OffsetBits(keys[j]);
 
 			// Translate the x, y at the requested zoom level
 			TileCoordinate x = baseX / (1 << (indexZoom - maxZoom));
@@ -176,19 +242,9 @@ template<typename OO> void collectTilesWithObjectsAtZoomTemplate(
 	}
 }
 
-template<typename OO>
-OutputObjectID outputObjectWithId(const OO& input) {
-	return OutputObjectID({ input.oo, 0 });
-}
-
-template<>
-inline OutputObjectID outputObjectWithId<OutputObjectXYID>(const OutputObjectXYID& input) {
-	return OutputObjectID({ input.oo, input.id });
-}
-
 template<typename OO> void collectLowZoomObjectsForTile(
 	const unsigned int& indexZoom,
-	typename std::vector<std::vector<OO>> objects,
+	const typename std::vector<std::vector<OO>>& objects,
 	unsigned int zoom,
 	const TileCoordinates& dstIndex,
 	std::vector<OutputObjectID>& output
@@ -222,7 +278,7 @@ template<typename OO> void collectLowZoomObjectsForTile(
 
 template<typename OO> void collectObjectsForTileTemplate(
 	const unsigned int& indexZoom,
-	typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator objects,
+	const std::vector<Z6Bucket<OO>>& buckets,
 	size_t iStart,
 	size_t iEnd,
 	unsigned int zoom,
@@ -243,9 +299,11 @@ template<typename OO> void collectObjectsForTileTemplate(
 	uint16_t z6OffsetDivisor = indexZoom >= CLUSTER_ZOOM ? (1 << (indexZoom - CLUSTER_ZOOM)) : 1;
 
 	for (size_t i = iStart; i < iEnd; i++) {
+		const Z6Bucket<OO>& bucket = buckets[i];
+
 		// If z >= 6, we can compute the exact bounds within the objects array.
-		// Translate to the base zoom, then do a binary search to find
-		// the starting point.
+		// Translate to the base zoom: the tile's objects are then the contiguous
+		// run of keys from its top-left corner's key, spanning 4^(levels below).
 		TileCoordinate z6x = dstIndex.x / (1 << (clampedZoom - CLUSTER_ZOOM));
 		TileCoordinate z6y = dstIndex.y / (1 << (clampedZoom - CLUSTER_ZOOM));
 
@@ -255,63 +313,13 @@ template<typename OO> void collectObjectsForTileTemplate(
 		Z6Offset needleX = baseX - z6x * z6OffsetDivisor;
 		Z6Offset needleY = baseY - z6y * z6OffsetDivisor;
 
-		// Kind of gross that we have to do this. Might be better if we split
-		// into two arrays, one of x/y and one of OOs. Would have better locality for
-		// searching, too.
-		OutputObject dummyOo(POINT_, 0, 0, 0, 0);
-		const size_t bz = indexZoom;
-
-		const OO targetXY = {dummyOo, needleX, needleY };
-		auto iter = std::lower_bound(
-			objects[i].begin(),
-			objects[i].end(),
-			targetXY,
-			[bz](const OO& a, const OO& b) {
-				// Cluster by parent zoom, so that a subsequent search
-				// can find a contiguous range of entries for any tile
-				// at zoom 6 or higher.
-				const size_t aX = a.x;
-				const size_t aY = a.y;
-				const size_t bX = b.x;
-				const size_t bY = b.y;
-				for (size_t z = CLUSTER_ZOOM; z <= bz; z++) {
-					const auto aXz = aX / (1 << (bz - z));
-					const auto aYz = aY / (1 << (bz - z));
-					const auto bXz = bX / (1 << (bz - z));
-					const auto bYz = bY / (1 << (bz - z));
-
-					if (aXz != bXz)
-						return aXz < bXz;
-
-					if (aYz != bYz)
-						return aYz < bYz;
-				}
-				return false;
-			}
-		);
+		uint16_t firstKey = z6OffsetKey(needleX, needleY);
+		uint32_t endKey = firstKey + (1u << (2 * (indexZoom - clampedZoom)));
 
-		for (; iter != objects[i].end(); iter++) {
-			// Compute the x, y at the base zoom level
-			TileCoordinate baseX = z6x * z6OffsetDivisor + iter->x;
-			TileCoordinate baseY = z6y * z6OffsetDivisor + iter->y;
-
-			// Translate the x, y at the requested zoom level
-			TileCoordinate x = baseX / (1 << (indexZoom - clampedZoom));
-			TileCoordinate y = baseY / (1 << (indexZoom - clampedZoom));
-
-			if (dstIndex.x == x && dstIndex.y == y) {
-				if (iter->oo.minZoom <= zoom) {
-					output.push_back(outputObjectWithId(*iter));
-				}
-			} else {
-				// Short-circuit when we're confident we'd no longer see relevant matches.
-				// We've ordered the entries in `objects` such that all objects that
-				// share the same tile at any zoom are in contiguous runs.
-				//
-				// Thus, as soon as we fail to find a match, we can stop looking.
-				break;
+		for (size_t j = bucket.lowerBound(firstKey); j < bucket.keys.size() && bucket.keys[j] < endKey; j++) {
+			if (bucket.objects[j].oo.minZoom <= zoom) {
+				output.push_back(bucket.at(j));
 			}
-
 		}
 	}
 }
@@ -356,10 +364,15 @@ protected:
 	//
 	// If config.include_ids is true, objectsWithIds will be populated.
 	// Otherwise, objects.
+	//
+	// These are only used while reading: finalize() sorts them and moves them
+	// into finalizedObjects/finalizedObjectsWithIds, which are used for lookups.
 	std::vector<AppendVectorNS::AppendVector<OutputObjectXY>> objects;
 	std::vector<std::vector<OutputObjectXY>> lowZoomObjects;
 	std::vector<AppendVectorNS::AppendVector<OutputObjectXYID>> objectsWithIds;
 	std::vector<std::vector<OutputObjectXYID>> lowZoomObjectsWithIds;
+	std::vector<Z6Bucket<OutputObjectXY>> finalizedObjects;
+	std::vector<Z6Bucket<OutputObjectXYID>> finalizedObjectsWithIds;
 	
 	// rtree index of large objects
 	using oo_rtree_param_type = boost::geometry::index::quadratic<128>;
@@ -0,0 +1,120 @@
+/*! \file */
+#ifndef _TILE_SCHEDULER_H
+#define _TILE_SCHEDULER_H
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include "coordinates.h"
+
+// Highest zoom the cost model keeps totals for (higher zooms share the last slot)
+#define TILE_SCHEDULER_MAX_ZOOM 24
+// A tile is expensive if it takes this many times its zoom's mean...
+#define TILE_SCHEDULER_EXPENSIVE_FACTOR 8
+// ...once there are this many samples at that zoom...
+#define TILE_SCHEDULER_MIN_SAMPLES 16
+// ...or if it takes longer than this (ns)
+#define TILE_SCHEDULER_EXPENSIVE_NS 250000000
+
+typedef std::pair<unsigned int, TileCoordinates> ZoomedTileCoordinates;
+
+// TileCostModel learns how long tiles take, so the scheduler can spot
+// expensive tiles (e.g. low-zoom tiles covering a huge coastline polygon)
+// before it reaches them.
+//
+// A tile's children cover the same features, so the model remembers the time
+// and object count of each expensive tile, and estimates its children's cost
+// from it. Per-zoom averages fill in where there's no parent to go on.
+
+class TileCostModel {
+
+public:
+	// Record a tile's object count (when it starts) and time (when it's done).
+	// Both return true if that makes the tile expensive.
+	bool recordObjects(unsigned int zoom, TileCoordinates index, size_t objects);
+	bool recordTime(unsigned int zoom, TileCoordinates index, uint64_t ns);
+
+	// Estimated cost in ns
+	double estimate(unsigned int zoom, TileCoordinates index) const;
+
+private:
+	struct Measured {
+		size_t objects = 0;
+		uint64_t ns = 0;
+	};
+	struct ZoomTotals {
+		uint64_t tiles = 0, ns = 0;
+		uint64_t objectTiles = 0, objects = 0;
+		uint64_t childNs = 0, parentNs = 0;	// for tiles with an expensive parent
+	};
+
+	mutable std::mutex mutex;
+	std::unordered_map<uint64_t, Measured> expensive;
+	ZoomTotals totals[TILE_SCHEDULER_MAX_ZOOM+1];
+
+	static uint64_t key(unsigned int zoom, TileCoordinates index);
+	static unsigned int slot(unsigned int zoom);
+	static double defaultCost(unsigned int zoom);
+};
+
+// TileScheduler runs a list of tiles on a number of worker threads.
+//
+// Each worker owns a contiguous range of the (spatially sorted) tile list,
+// which it works through from the front. A worker that runs out steals the
+// back half of the busiest worker's remaining range, so the list stays
+// balanced without breaking up spatial locality.
+//
+// When a tile turns out to be expensive, its children are promoted: they are
+// queued ahead of everything else, most expensive first, so the long-running
+// tiles start as early as possible rather than being left for the tail.
+
+class TileScheduler {
+
+public:
+	// tiles must be sorted by order (used to find a tile's children)
+	TileScheduler(
+		const std::deque<ZoomedTileCoordinates> &tiles,
+		std::function<bool(const ZoomedTileCoordinates&, const ZoomedTileCoordinates&)> order,
+		unsigned int numWorkers
+	);
+
+	// Run by each worker thread (workerId 0..numWorkers-1).
+	// process(i) is called for each tile index in turn.
+	void work(unsigned int workerId, std::function<void(size_t)> process);
+
+	// Call from process() as soon as the tile's object count is known
+	void tileObjects(size_t i, size_t objects);
+
+	std::string stats() const;
+
+private:
+	struct Range {
+		std::mutex mutex;
+		size_t front = 0, back = 0;
+	};
+
+	const std::deque<ZoomedTileCoordinates> &tiles;
+	std::function<bool(const ZoomedTileCoordinates&, const ZoomedTileCoordinates&)> order;
+	std::vector<std::unique_ptr<Range>> ranges;
+	std::unique_ptr<std::atomic<bool>[]> claimed;
+	TileCostModel costs;
+
+	std::mutex promotedMutex;
+	std::vector<std::pair<double, size_t>> promoted;	// (estimated cost, tile index), a max-heap
+	std::unique_ptr<std::atomic<bool>[]> childrenPromoted;
+
+	std::atomic<uint64_t> numSteals, numStolen, numPromoted;
+
+	bool claim(size_t i);
+	bool nextPromoted(size_t &i);
+	bool nextOwn(Range &range, size_t &i);
+	bool steal(unsigned int workerId);
+	void promoteChildren(size_t i);
+};
+
+#endif //_TILE_SCHEDULER_H
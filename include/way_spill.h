@@ -0,0 +1,106 @@
+/*! \file */
+#ifndef _WAY_SPILL_H
+#define _WAY_SPILL_H
+
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "coordinates.h"
+#include "tag_map.h"
+
+// WaySpill lets --shard-stores --spill-ways read the .pbf's ways once, rather than once
+// per shard.
+//
+// While the first shard's ways are read, a way whose first node is in a
+// later shard is written to that shard's spill file: its ID, node IDs and
+// tags, which is all the Lua profile and the way store need. Each later
+// shard then reads its ways back from its own file.
+//
+// Each thread buffers the ways it spills, and writes them as a "chunk" at
+// the end of each batch of blocks, so a chunk's ways are in ID order, as
+// the way stores expect within a batch. Chunks are read back one per
+// thread at a time.
+
+class WaySpill {
+
+public:
+	// A spilled way. Its node IDs and tags are valid until the next way is read.
+	struct Way {
+		uint32_t input;
+		WayID id;
+		std::vector<NodeID> refs;
+		std::vector<Tag> tags;
+	};
+
+	class Chunk {
+	public:
+		Chunk(std::string data): data(std::move(data)), offset(0) {}
+		// Read the next way, if there is one
+		bool next(Way& way);
+
+	private:
+		std::string data;
+		size_t offset;
+	};
+
+	WaySpill(size_t shards);
+	~WaySpill();
+
+	// Write the spill files to a new directory within parent
+	void open(const std::string& parent);
+
+	// Thread-safe; input is the way's index among the inputs
+	void add(size_t shard, uint32_t input, WayID id, const std::vector<uint64_t>& refs, const TagMap& tags);
+
+	// Write this thread's spilled ways; call at the end of each batch
+	void flush();
+
+	// Call once every way has been spilled, before reading any back
+	void finish();
+
+	// Pass each chunk of shard's ways to process, on threadNum threads
+	void read(size_t shard, size_t threadNum, const std::function<void(Chunk&)>& process);
+
+	uint64_t ways(size_t shard) const { return files[shard].ways; }
+	size_t chunks(size_t shard) const { return files[shard].chunks.size(); }
+	uint64_t bytes() const;
+
+	// Remove the spill files
+	void clear();
+
+private:
+	struct File {
+		std::string filename;
+		std::unique_ptr<std::ofstream> out;
+		uint64_t bytes = 0;
+		uint64_t ways = 0;
+		// The offset and size of each chunk
+		std::vector<std::pair<uint64_t, uint64_t>> chunks;
+		std::unique_ptr<std::mutex> mutex;
+	};
+
+	struct Buffer {
+		std::string data;
+		uint64_t ways = 0;
+	};
+
+	std::vector<Buffer>& threadBuffers();
+	void clearBuffers();
+	void write(size_t shard, Buffer& buffer);
+
+	const size_t shards;
+	std::string directory;
+	std::vector<File> files;
+
+	std::mutex mutex;
+	std::map<std::thread::id, std::vector<Buffer>> buffers;
+	uint64_t generation;
+};
+
+#endif //_WAY_SPILL_H
@@ -14,7 +14,14 @@ public:
 	// Run on each thread when a batch of blocks is started. Only
 	// meaningful for SortedWayStore
 	virtual void batchStart() = 0;
-	virtual std::vector<LatpLon> at(WayID wayid) const = 0;
+	// Decode the way's locations into out, replacing its contents. Callers
+	// that look up many ways reuse out, so lookups don't allocate.
+	virtual void at(WayID wayid, std::vector<LatpLon>& out) const = 0;
+	std::vector<LatpLon> at(WayID wayid) const {
+		std::vector<LatpLon> rv;
+		at(wayid, rv);
+		return rv;
+	}
 	virtual bool requiresNodes() const = 0;
 	virtual void insertLatpLons(std::vector<ll_element_t>& newWays) = 0;
 	virtual void insertNodes(const std::vector<std::pair<WayID, std::vector<NodeID>>>& newWays) = 0;
@@ -14,7 +14,8 @@ public:
 
 	void reopen() override;
 	void batchStart() override {}
-	std::vector<LatpLon> at(WayID wayid) const override;
+	using WayStore::at;
+	void at(WayID wayid, std::vector<LatpLon>& out) const override;
 	bool requiresNodes() const override { return false; }
 	void insertLatpLons(std::vector<WayStore::ll_element_t> &newWays) override;
 	void insertNodes(const std::vector<std::pair<WayID, std::vector<NodeID>>>& newWays) override;
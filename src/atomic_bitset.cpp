@@ -0,0 +1,80 @@
+#include "atomic_bitset.h"
+#include "mmap_allocator.h"
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+AtomicBitset::AtomicBitset(): table(new std::atomic<Word*>[MaxChunks]) {
+	for (size_t i = 0; i < MaxChunks; i++)
+		table[i].store(nullptr, std::memory_order_relaxed);
+}
+
+AtomicBitset::~AtomicBitset() {
+	clear();
+}
+
+bool AtomicBitset::test(uint64_t id) const {
+	const size_t index = id / ChunkBits;
+	if (index >= MaxChunks)
+		return false;
+
+	const Word* words = table[index].load(std::memory_order_acquire);
+	if (words == nullptr)
+		return false;
+
+	const size_t bit = id % ChunkBits;
+	return words[bit / 64].load(std::memory_order_relaxed) & (1ull << (bit % 64));
+}
+
+void AtomicBitset::set(uint64_t id) {
+	const size_t index = id / ChunkBits;
+	if (index >= MaxChunks)
+		throw std::out_of_range("ID " + std::to_string(id) + " is too large to track");
+
+	const size_t bit = id % ChunkBits;
+	Word& word = chunk(index)[bit / 64];
+	const uint64_t mask = 1ull << (bit % 64);
+
+	// Most IDs are set more than once, so avoid writing to a shared cache line
+	if ((word.load(std::memory_order_relaxed) & mask) == 0)
+		word.fetch_or(mask, std::memory_order_relaxed);
+}
+
+void AtomicBitset::reserve(uint64_t minId, uint64_t maxId) {
+	const size_t last = std::min<uint64_t>(maxId / ChunkBits, MaxChunks - 1);
+	for (size_t index = minId / ChunkBits; index <= last; index++)
+		chunk(index);
+}
+
+void AtomicBitset::clear() {
+	for (size_t i = 0; i < MaxChunks; i++) {
+		Word* words = table[i].exchange(nullptr, std::memory_order_relaxed);
+		if (words != nullptr)
+			void_mmap_allocator::deallocate(words);
+	}
+}
+
+size_t AtomicBitset::chunks() const {
+	size_t rv = 0;
+	for (size_t i = 0; i < MaxChunks; i++)
+		if (table[i].load(std::memory_order_relaxed) != nullptr)
+			rv++;
+	return rv;
+}
+
+AtomicBitset::Word* AtomicBitset::chunk(size_t index) {
+	Word* words = table[index].load(std::memory_order_acquire);
+	if (words != nullptr)
+		return words;
+
+	Word* fresh = static_cast<Word*>(void_mmap_allocator::allocate(ChunkWords * sizeof(Word)));
+	for (size_t i = 0; i < ChunkWords; i++)
+		new (&fresh[i]) Word(0);
+
+	// If another thread installed a chunk first, use theirs
+	if (table[index].compare_exchange_strong(words, fresh, std::memory_order_acq_rel, std::memory_order_acquire))
+		return fresh;
+	void_mmap_allocator::deallocate(fresh);
+	return words;
+}
@@ -0,0 +1,98 @@
+#include "external_sort_stores.h"
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+	// SortedNodeStore and SortedWayStore both group 256 chunks of 256 IDs.
+	// Merging a whole group on one thread avoids orphaned partial groups.
+	const uint64_t SortedGroupSize = 256 * 256;
+}
+
+ExternalSortNodeStore::ExternalSortNodeStore(std::shared_ptr<NodeStore> store, const std::string& directory, size_t bufferBytes):
+	store(store), directory(directory), sorter(SortedGroupSize, bufferBytes) {
+	sorter.open(directory);
+}
+
+void ExternalSortNodeStore::reopen() {
+	sorter.open(directory);
+	store->reopen();
+}
+
+void ExternalSortNodeStore::clear() {
+	sorter.open(directory);
+	store->clear();
+}
+
+void ExternalSortNodeStore::insert(const std::vector<element_t>& elements) {
+	sorter.add(elements);
+}
+
+void ExternalSortNodeStore::finalize(size_t threadNum) {
+	sorter.merge(
+		threadNum,
+		[&]() { store->batchStart(); },
+		[&](std::vector<element_t>& elements) { store->insert(elements); }
+	);
+	std::cout << "external sort: merged " << sorter.runsWritten() << " node runs" << std::endl;
+	sorter.clear();
+	store->finalize(threadNum);
+}
+
+void ExternalSortNodeStore::Codec::write(std::ostream& out, const element_t& element) {
+	out.write(reinterpret_cast<const char*>(&element.first), sizeof(NodeID));
+	out.write(reinterpret_cast<const char*>(&element.second), sizeof(LatpLon));
+}
+
+void ExternalSortNodeStore::Codec::read(std::istream& in, element_t& element) {
+	in.read(reinterpret_cast<char*>(&element.first), sizeof(NodeID));
+	in.read(reinterpret_cast<char*>(&element.second), sizeof(LatpLon));
+}
+
+ExternalSortWayStore::ExternalSortWayStore(std::shared_ptr<WayStore> store, const std::string& directory, size_t bufferBytes):
+	store(store), directory(directory), sorter(SortedGroupSize, bufferBytes) {
+	sorter.open(directory);
+}
+
+void ExternalSortWayStore::reopen() {
+	sorter.open(directory);
+	store->reopen();
+}
+
+void ExternalSortWayStore::clear() {
+	sorter.open(directory);
+	store->clear();
+}
+
+void ExternalSortWayStore::insertLatpLons(std::vector<ll_element_t>& newWays) {
+	throw std::runtime_error("ExternalSortWayStore only stores node IDs");
+}
+
+void ExternalSortWayStore::insertNodes(const std::vector<element_t>& newWays) {
+	sorter.add(newWays);
+}
+
+void ExternalSortWayStore::finalize(unsigned int threadNum) {
+	sorter.merge(
+		threadNum,
+		[&]() { store->batchStart(); },
+		[&](std::vector<element_t>& elements) { store->insertNodes(elements); }
+	);
+	std::cout << "external sort: merged " << sorter.runsWritten() << " way runs" << std::endl;
+	sorter.clear();
+	store->finalize(threadNum);
+}
+
+void ExternalSortWayStore::Codec::write(std::ostream& out, const element_t& element) {
+	uint32_t length = element.second.size();
+	out.write(reinterpret_cast<const char*>(&element.first), sizeof(WayID));
+	out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+	out.write(reinterpret_cast<const char*>(element.second.data()), length * sizeof(NodeID));
+}
+
+void ExternalSortWayStore::Codec::read(std::istream& in, element_t& element) {
+	uint32_t length = 0;
+	in.read(reinterpret_cast<char*>(&element.first), sizeof(WayID));
+	in.read(reinterpret_cast<char*>(&length), sizeof(length));
+	element.second.resize(length);
+	in.read(reinterpret_cast<char*>(element.second.data()), length * sizeof(NodeID));
+}
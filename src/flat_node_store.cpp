@@ -0,0 +1,91 @@
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include "flat_node_store.h"
+
+namespace FlatNodeStoreTypes {
+	// Like SortedNodeStore, support 2^34 = 17B nodes, about twice the
+	// IDs the planet currently uses. It's 128GB of address space, but only
+	// the pages that are written to take space.
+	const uint64_t MaxNodes = 1ull << 34;
+
+	// An unwritten slot reads as zeros, which is a valid location. Slots
+	// are stored with the sign bit of latp flipped, so an unwritten one
+	// decodes to a latp of INT32_MIN, which projection never produces.
+	const int32_t PresentBit = INT32_MIN;
+	inline bool present(const LatpLon& slot) { return slot.latp != 0; }
+	inline LatpLon encode(const LatpLon& ll) { return { ll.latp ^ PresentBit, ll.lon }; }
+	inline LatpLon decode(const LatpLon& slot) { return { slot.latp ^ PresentBit, slot.lon }; }
+}
+
+using namespace FlatNodeStoreTypes;
+
+FlatNodeStore::FlatNodeStore(const std::string& directory):
+	directory(directory), nodes(nullptr), totalNodes(0) {
+	reopen();
+}
+
+FlatNodeStore::~FlatNodeStore() {
+	close();
+}
+
+void FlatNodeStore::close() {
+	region.reset();
+	file.reset();
+	nodes = nullptr;
+
+	if (!filename.empty()) {
+		boost::system::error_code ec;
+		boost::filesystem::remove(filename, ec);
+		filename.clear();
+	}
+}
+
+void FlatNodeStore::reopen() {
+	close();
+	totalNodes = 0;
+
+	boost::filesystem::create_directories(directory);
+	filename = (boost::filesystem::path(directory) / boost::filesystem::unique_path("flat-nodes-%%%%-%%%%.dat")).string();
+	if (std::ofstream(filename.c_str()).fail())
+		throw std::runtime_error("Failed to open flat nodes file " + filename);
+
+	// Growing an empty file leaves a hole, so no disk is used until nodes are written
+	boost::filesystem::resize_file(filename, MaxNodes * sizeof(LatpLon));
+
+	using namespace boost::interprocess;
+	file.reset(new file_mapping(filename.c_str(), read_write));
+	region.reset(new mapped_region(*file, read_write));
+	nodes = static_cast<LatpLon*>(region->get_address());
+}
+
+bool FlatNodeStore::contains(size_t shard, NodeID i) const {
+	return i < MaxNodes && present(nodes[i]);
+}
+
+LatpLon FlatNodeStore::at(NodeID i) const {
+	if (!contains(0, i))
+		throw std::out_of_range("Could not find node with id " + std::to_string(i));
+
+	return decode(nodes[i]);
+}
+
+size_t FlatNodeStore::size() const {
+	return totalNodes;
+}
+
+void FlatNodeStore::insert(const std::vector<element_t>& elements) {
+	// Each node has its own slot, so threads can write without a lock
+	uint64_t newNodes = 0;
+	for (const auto& element : elements) {
+		if (element.first >= MaxNodes)
+			throw std::out_of_range("Node ID " + std::to_string(element.first) + " is too large for the flat node store");
+
+		LatpLon& slot = nodes[element.first];
+		if (!present(slot))
+			newNodes++;
+		slot = encode(element.second);
+	}
+	totalNodes += newNodes;
+}
@@ -10,6 +10,12 @@
 
 #include <sys/stat.h>
 #include "external/libdeflate/libdeflate.h"
+#ifdef TM_ZSTD
+#include <zstd.h>
+#endif
+#ifdef TM_LZ4
+#include <lz4.h>
+#endif
 #include "helpers.h"
 
 #ifdef _MSC_VER
@@ -75,6 +81,29 @@ public:
 thread_local Compressor compressor(6);
 thread_local Decompressor decompressor;
 
+#ifdef TM_ZSTD
+class ZstdContexts {
+public:
+	ZSTD_CCtx* cctx;
+	ZSTD_DCtx* dctx;
+
+	ZstdContexts(): cctx(ZSTD_createCCtx()), dctx(ZSTD_createDCtx()) {
+		if (!cctx || !dctx)
+			throw std::runtime_error("ZSTD_createCCtx/ZSTD_createDCtx failed");
+	}
+
+	ZstdContexts & operator=(const ZstdContexts&) = delete;
+	ZstdContexts(const ZstdContexts&) = delete;
+
+	~ZstdContexts() {
+		ZSTD_freeCCtx(cctx);
+		ZSTD_freeDCtx(dctx);
+	}
+};
+
+thread_local ZstdContexts zstdContexts;
+#endif
+
 // Bounding box string parsing
 
 double bboxElementFromStr(const std::string& number) {
@@ -103,32 +132,92 @@ std::vector<std::string> parseBox(const std::string& bbox) {
 std::string compress_string(const std::string& str,
                             int compressionlevel,
                             bool asGzip) {
+	std::string rv;
+	compress_string(rv, str, compressionlevel, asGzip);
+	return rv;
+}
+
+void compress_string(std::string& output,
+                     const std::string& str,
+                     int compressionlevel,
+                     bool asGzip) {
 	if (compressionlevel == Z_DEFAULT_COMPRESSION)
 		compressionlevel = 6;
 
 	if (compressionlevel != compressor.level)
 		compressor.setLevel(compressionlevel);
 
-	std::string rv;
 	if (asGzip) {
 		size_t maxSize = libdeflate_gzip_compress_bound(compressor.compressor, str.size());
-		rv.resize(maxSize);
+		output.resize(maxSize);
 
-		size_t compressedSize = libdeflate_gzip_compress(compressor.compressor, str.data(), str.size(), &rv[0], maxSize);
+		size_t compressedSize = libdeflate_gzip_compress(compressor.compressor, str.data(), str.size(), &output[0], maxSize);
 		if (compressedSize == 0)
 			throw std::runtime_error("libdeflate_gzip_compress failed");
-		rv.resize(compressedSize);
+		output.resize(compressedSize);
 	} else {
 		size_t maxSize = libdeflate_zlib_compress_bound(compressor.compressor, str.size());
-		rv.resize(maxSize);
+		output.resize(maxSize);
 
-		size_t compressedSize = libdeflate_zlib_compress(compressor.compressor, str.data(), str.size(), &rv[0], maxSize);
+		size_t compressedSize = libdeflate_zlib_compress(compressor.compressor, str.data(), str.size(), &output[0], maxSize);
 		if (compressedSize == 0)
 			throw std::runtime_error("libdeflate_zlib_compress failed");
-		rv.resize(compressedSize);
+		output.resize(compressedSize);
 	}
+}
 
-	return rv;
+// MurmurHash3 x64 128-bit (Austin Appleby, public domain)
+static inline uint64_t rotl64(uint64_t x, int8_t r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+Hash128 hash128(const std::string &data) {
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data());
+	const size_t len = data.size();
+	const size_t nblocks = len / 16;
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0;
+
+	for (size_t i = 0; i < nblocks; i++) {
+		uint64_t k1, k2;
+		memcpy(&k1, bytes + i * 16, 8);
+		memcpy(&k2, bytes + i * 16 + 8, 8);
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	const uint8_t* tail = bytes + nblocks * 16;
+	uint64_t k1 = 0, k2 = 0;
+	size_t rest = len & 15;
+	for (size_t i = rest; i > 8; i--) k2 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 9) * 8);
+	if (rest > 8) { k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2; }
+	for (size_t i = std::min<size_t>(rest, 8); i > 0; i--) k1 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 1) * 8);
+	if (rest > 0) { k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1; }
+
+	h1 ^= len; h2 ^= len;
+	h1 += h2; h2 += h1;
+	h1 = fmix64(h1); h2 = fmix64(h2);
+	h1 += h2; h2 += h1;
+	return { h1, h2 };
+}
+
+std::string Hash128::hex() const {
+	std::ostringstream ss;
+	ss << std::hex << std::setfill('0') << std::setw(16) << high << std::setw(16) << low;
+	return ss.str();
 }
 
 // Decompress an STL string using zlib and return the original data.
@@ -175,6 +264,125 @@ void decompress_string(std::string& output, const char* input, uint32_t inputSiz
 	}
 }
 
+// ----	Compression codecs
+
+std::string Compression::name() const {
+	switch (codec) {
+		case Codec::None:    return "none";
+		case Codec::Gzip:    return "gzip";
+		case Codec::Deflate: return "deflate";
+		case Codec::Zstd:    return "zstd";
+	}
+	return "";
+}
+
+bool Compression::zstdAvailable() {
+#ifdef TM_ZSTD
+	return true;
+#else
+	return false;
+#endif
+}
+
+Compression Compression::parse(const std::string& codecName, int level) {
+	Compression c;
+	if      (codecName == "gzip"   ) { c.codec = Codec::Gzip; }
+	else if (codecName == "deflate") { c.codec = Codec::Deflate; }
+	else if (codecName == "zstd"   ) { c.codec = Codec::Zstd; }
+	else if (codecName == "none"   ) { c.codec = Codec::None; }
+	else throw std::invalid_argument("unknown compression \"" + codecName + "\"");
+
+	if (c.codec == Codec::Zstd && !zstdAvailable())
+		throw std::invalid_argument("tilemaker was built without zstd support");
+
+	if (level != Z_DEFAULT_COMPRESSION) {
+		bool valid = true;
+		if (c.codec == Codec::Gzip || c.codec == Codec::Deflate) valid = level >= 1 && level <= 12;
+#ifdef TM_ZSTD
+		if (c.codec == Codec::Zstd) valid = level >= ZSTD_minCLevel() && level <= ZSTD_maxCLevel();
+#endif
+		if (!valid) throw std::invalid_argument("compression level " + std::to_string(level) + " isn't valid for " + codecName);
+	}
+	c.level = level;
+	return c;
+}
+
+void compress_string(std::string& output, const std::string& str, const Compression& compression) {
+	switch (compression.codec) {
+		case Compression::Codec::None:
+			output = str;
+			return;
+		case Compression::Codec::Gzip:
+		case Compression::Codec::Deflate:
+			compress_string(output, str, compression.level, compression.codec == Compression::Codec::Gzip);
+			return;
+		case Compression::Codec::Zstd: {
+#ifdef TM_ZSTD
+			int level = compression.level == Z_DEFAULT_COMPRESSION ? ZSTD_CLEVEL_DEFAULT : compression.level;
+			size_t maxSize = ZSTD_compressBound(str.size());
+			output.resize(maxSize);
+			size_t compressedSize = ZSTD_compressCCtx(zstdContexts.cctx, &output[0], maxSize, str.data(), str.size(), level);
+			if (ZSTD_isError(compressedSize))
+				throw std::runtime_error(std::string("ZSTD_compressCCtx failed: ") + ZSTD_getErrorName(compressedSize));
+			output.resize(compressedSize);
+			return;
+#else
+			throw std::runtime_error("tilemaker was built without zstd support");
+#endif
+		}
+	}
+}
+
+void decompress_string(std::string& output, const char* input, uint32_t inputSize, const Compression& compression) {
+	switch (compression.codec) {
+		case Compression::Codec::None:
+			output.assign(input, inputSize);
+			return;
+		case Compression::Codec::Gzip:
+		case Compression::Codec::Deflate:
+			decompress_string(output, input, inputSize, compression.codec == Compression::Codec::Gzip);
+			return;
+		case Compression::Codec::Zstd: {
+#ifdef TM_ZSTD
+			unsigned long long size = ZSTD_getFrameContentSize(input, inputSize);
+			if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+				throw std::runtime_error("ZSTD_getFrameContentSize failed");
+			output.resize(size);
+			size_t rv = ZSTD_decompressDCtx(zstdContexts.dctx, &output[0], size, input, inputSize);
+			if (ZSTD_isError(rv))
+				throw std::runtime_error(std::string("ZSTD_decompressDCtx failed: ") + ZSTD_getErrorName(rv));
+			output.resize(rv);
+			return;
+#else
+			throw std::runtime_error("tilemaker was built without zstd support");
+#endif
+		}
+	}
+}
+
+void decompress_zstd(std::string& output, const char* input, uint32_t inputSize, uint32_t outputSize) {
+#ifdef TM_ZSTD
+	output.resize(outputSize);
+	size_t rv = ZSTD_decompressDCtx(zstdContexts.dctx, &output[0], outputSize, input, inputSize);
+	if (ZSTD_isError(rv))
+		throw std::runtime_error(std::string("ZSTD_decompressDCtx failed: ") + ZSTD_getErrorName(rv));
+	output.resize(rv);
+#else
+	throw std::runtime_error("tilemaker was built without zstd support");
+#endif
+}
+
+void decompress_lz4(std::string& output, const char* input, uint32_t inputSize, uint32_t outputSize) {
+#ifdef TM_LZ4
+	output.resize(outputSize);
+	int rv = LZ4_decompress_safe(input, &output[0], inputSize, outputSize);
+	if (rv < 0)
+		throw std::runtime_error("LZ4_decompress_safe failed");
+	output.resize(rv);
+#else
+	throw std::runtime_error("tilemaker was built without lz4 support");
+#endif
+}
 
 // Parse a Boost error
 std::string boost_validity_error(unsigned failure) {
@@ -6,18 +6,40 @@
 using namespace sqlite;
 using namespace std;
 
-MBTiles::MBTiles():
-  pendingStatements1(std::make_shared<std::vector<PendingStatement>>()),
-  pendingStatements2(std::make_shared<std::vector<PendingStatement>>())
-{}
+// Indexes into preparedStatements/multiRowStatements
+// (the map/images schema uses all three; a plain tiles table only the first two)
+#define INSERT_TILE 0
+#define REPLACE_TILE 1
+#define INSERT_IMAGE 2
+
+// Time a merge-mode reader will wait for the file to become available
+#define MBTILES_READ_TIMEOUT_MS 60000
+
+// Key for the existing tile index (TMS row, as stored)
+static inline uint64_t tileKey(int zoom, int x, int tmsY) {
+	return (static_cast<uint64_t>(zoom) << 58) | (static_cast<uint64_t>(x) << 29) | static_cast<uint64_t>(tmsY);
+}
+
+MBTiles::MBTiles(): writeQueue(MBTILES_QUEUE_SIZE), spareBuffers(MBTILES_QUEUE_SIZE) { }
 
 MBTiles::~MBTiles() {
+	stopWriter();
+	idleReaders.clear();
 	if (db && inTransaction) db << "COMMIT;"; // commit all the changes if open
+	if (db && merging) {
+		try {
+			db << "PRAGMA journal_mode=DELETE;"; // fold the WAL back in, so the .mbtiles is a single file again
+		} catch(runtime_error &e) {
+			cout << "Couldn't leave WAL mode (not fatal): " << e.what() << endl;
+		}
+	}
 }
 
 // ---- Write .mbtiles
 
-void MBTiles::openForWriting(string &filename) {
+void MBTiles::openForWriting(string &filename, bool merging) {
+	this->filename = filename;
+	this->merging = merging;
 	db.init(filename);
 
 	db << "PRAGMA synchronous = OFF;";
@@ -39,14 +61,48 @@ void MBTiles::openForWriting(string &filename) {
 	db << "PRAGMA page_size = 65536;";
 	db << "VACUUM;"; // make sure page_size takes effect
 	db << "CREATE TABLE IF NOT EXISTS metadata (name text, value text, UNIQUE (name));";
-	db << "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);";
-	db << "CREATE UNIQUE INDEX IF NOT EXISTS tile_index on tiles (zoom_level, tile_column, tile_row);";
-	preparedStatements.emplace_back(db << "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);");
-	preparedStatements.emplace_back(db << "REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);");
+
+	// if we're merging into a file with a plain tiles table, carry on using that
+	int hasTilesTable = 0;
+	db << "SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name='tiles';" >> hasTilesTable;
+	deduplicate = (hasTilesTable == 0);
+
+	if (deduplicate) {
+		db << "CREATE TABLE IF NOT EXISTS map (zoom_level integer, tile_column integer, tile_row integer, tile_id text);";
+		db << "CREATE UNIQUE INDEX IF NOT EXISTS map_index on map (zoom_level, tile_column, tile_row);";
+		db << "CREATE TABLE IF NOT EXISTS images (tile_data blob, tile_id text);";
+		db << "CREATE UNIQUE INDEX IF NOT EXISTS images_id on images (tile_id);";
+		db << "CREATE VIEW IF NOT EXISTS tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;";
+		prepareInsert("INSERT INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES ", "(?,?,?,?)");
+		prepareInsert("REPLACE INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES ", "(?,?,?,?)");
+		prepareInsert("INSERT OR IGNORE INTO images (tile_id, tile_data) VALUES ", "(?,?)");
+	} else {
+		db << "CREATE UNIQUE INDEX IF NOT EXISTS tile_index on tiles (zoom_level, tile_column, tile_row);";
+		prepareInsert("INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES ", "(?,?,?,?)");
+		prepareInsert("REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES ", "(?,?,?,?)");
+	}
+
+	if (merging) {
+		// WAL lets the workers' read-only connections read while we write
+		db << "PRAGMA journal_mode=WAL;";
+		db << "SELECT zoom_level,tile_column,tile_row FROM tiles" >> [&](int z, int col, int row) {
+			existingTiles.insert(tileKey(z, col, row));
+		};
+		cout << "Merging into " << existingTiles.size() << " existing tiles" << endl;
+	}
 
 	db << "BEGIN;"; // begin a transaction
 	cout << "Creating mbtiles at " << filename << endl;
 	inTransaction = true;
+	writerThread = std::thread(&MBTiles::writeQueuedTiles, this);
+}
+
+// Prepare single-row and multi-row versions of an INSERT statement
+void MBTiles::prepareInsert(const std::string &sql, const std::string &row) {
+	std::string rows = row;
+	for (int i = 1; i < MBTILES_ROWS_PER_INSERT; i++) rows += "," + row;
+	preparedStatements.emplace_back(db << (sql + row + ";"));
+	multiRowStatements.emplace_back(db << (sql + rows + ";"));
 }
 	
 void MBTiles::writeMetadata(string key, string value) {
@@ -55,47 +111,117 @@ void MBTiles::writeMetadata(string key, string value) {
 	m.unlock();
 }
 
-void MBTiles::insertOrReplace(int zoom, int x, int y, const std::string& data, bool isMerge) {
-	// NB: assumes we have the `m` mutex
-	int tmsY = pow(2, zoom) - 1 - y;
-	int s = isMerge ? 1 : 0;
-	preparedStatements[s].reset();
-	preparedStatements[s] << zoom << x << tmsY && data;
-	preparedStatements[s].execute();
+// Writer thread: write everything queued, then wait for more
+void MBTiles::writeQueuedTiles() {
+	std::deque<PendingStatement> batch;
+	while (writeQueue.popAll(batch)) {
+		{
+			std::lock_guard<std::mutex> lock(m);
+			writeBatch(batch);
+		}
+		for (auto &stmt : batch)
+			if (stmt.hasData) spareBuffers.put(std::move(stmt.data));
+		batch.clear();
+	}
 }
 
-void MBTiles::flushPendingStatements() {
+void MBTiles::writeBatch(const std::deque<PendingStatement> &batch) {
 	// NB: assumes we have the `m` mutex
+	std::vector<const PendingStatement*> rows[3];
+	for (const auto &stmt : batch) {
+		if (stmt.isMerge) hasMerged = true;
+		rows[stmt.isMerge ? REPLACE_TILE : INSERT_TILE].push_back(&stmt);
+		if (deduplicate && stmt.hasData) rows[INSERT_IMAGE].push_back(&stmt);
+	}
 
-	for (int i = 0; i < 2; i++) {
-		while(!pendingStatements2->empty()) {
-			const PendingStatement& stmt = pendingStatements2->back();
-			insertOrReplace(stmt.zoom, stmt.x, stmt.y, stmt.data, stmt.isMerge);
-			pendingStatements2->pop_back();
+	auto tmsY = [](const PendingStatement &stmt) { return static_cast<int>(pow(2, stmt.zoom) - 1 - stmt.y); };
+	if (deduplicate) {
+		insertRows(INSERT_IMAGE, rows[INSERT_IMAGE], [](database_binder &s, const PendingStatement &stmt) {
+			s << stmt.tileId && stmt.data;
+		});
+		for (int i : { INSERT_TILE, REPLACE_TILE }) {
+			insertRows(i, rows[i], [&](database_binder &s, const PendingStatement &stmt) {
+				s << stmt.zoom << stmt.x << tmsY(stmt) << stmt.tileId;
+			});
 		}
+	} else {
+		for (int i : { INSERT_TILE, REPLACE_TILE }) {
+			insertRows(i, rows[i], [&](database_binder &s, const PendingStatement &stmt) {
+				s << stmt.zoom << stmt.x << tmsY(stmt) && stmt.data;
+			});
+		}
+	}
 
-		std::lock_guard<std::mutex> lock(pendingStatementsMutex);
-		pendingStatements1.swap(pendingStatements2);
+	// commit in chunks, so SQLite doesn't have to hold one huge transaction
+	tilesInTransaction += batch.size();
+	if (tilesInTransaction >= MBTILES_TRANSACTION_SIZE) {
+		db << "COMMIT;";
+		db << "BEGIN;";
+		tilesInTransaction = 0;
 	}
 }
-	
-void MBTiles::saveTile(int zoom, int x, int y, string *data, bool isMerge) {
-	// If the lock is available, write directly to SQLite.
-	if (m.try_lock()) {
-		insertOrReplace(zoom, x, y, *data, isMerge);
-		flushPendingStatements();
-		m.unlock();
-	} else {
-		// Else buffer the write for later, copying its binary blob.
-		const std::lock_guard<std::mutex> lock(pendingStatementsMutex);
-		pendingStatements1->push_back({zoom, x, y, *data, isMerge});
+
+// Write rows using the multi-row statement where possible, then one at a time for the remainder
+template<typename Bind>
+void MBTiles::insertRows(int statement, const std::vector<const PendingStatement*> &rows, Bind bind) {
+	// NB: assumes we have the `m` mutex
+	size_t i = 0;
+	for (; i + MBTILES_ROWS_PER_INSERT <= rows.size(); i += MBTILES_ROWS_PER_INSERT) {
+		database_binder &s = multiRowStatements[statement];
+		s.reset();
+		for (size_t j = i; j < i + MBTILES_ROWS_PER_INSERT; j++) bind(s, *rows[j]);
+		s.execute();
+	}
+	for (; i < rows.size(); i++) {
+		database_binder &s = preparedStatements[statement];
+		s.reset();
+		bind(s, *rows[i]);
+		s.execute();
 	}
 }
 
+// Drain the queue and wait for the writer thread to finish
+void MBTiles::stopWriter() {
+	if (!writerThread.joinable()) return;
+	writeQueue.finish();
+	writerThread.join();
+}
+	
+// Check whether tile data with this hash (of the uncompressed tile) has been seen before.
+// The first caller for each hash gets true, and must pass the data to saveTile;
+// later callers can pass nullptr to share it.
+bool MBTiles::isNewTileData(const Hash128 &hash) {
+	if (!deduplicate) return true;
+	std::lock_guard<std::mutex> lock(knownTileDataMutex);
+	return knownTileData.insert(hash).second;
+}
+
+// Queue a tile for the writer thread, taking ownership of its binary blob.
+// Waits if the writer has fallen MBTILES_QUEUE_SIZE tiles behind.
+void MBTiles::saveTile(int zoom, int x, int y, string &&data, bool isMerge, const Hash128 &hash) {
+	writeQueue.push(PendingStatement{ zoom, x, y, std::move(data), true, deduplicate ? hash.hex() : "", isMerge });
+}
+
+std::string MBTiles::spareBuffer() {
+	return spareBuffers.take();
+}
+
+// Queue a tile whose data has already been saved (see isNewTileData)
+void MBTiles::saveDuplicateTile(int zoom, int x, int y, bool isMerge, const Hash128 &hash) {
+	writeQueue.push(PendingStatement{ zoom, x, y, "", false, deduplicate ? hash.hex() : "", isMerge });
+}
+
 void MBTiles::closeForWriting() {
-	flushPendingStatements();
-	preparedStatements[0].used(true);
-	preparedStatements[1].used(true);
+	stopWriter();
+	cout << "\nMBTiles writer: " << writeQueue.stats() << flush;
+	for (auto &statement : preparedStatements) statement.used(true);
+	for (auto &statement : multiRowStatements) statement.used(true);
+	idleReaders.clear();
+
+	// tiles replaced while merging may have left unused images
+	if (deduplicate && hasMerged) {
+		db << "DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map);";
+	}
 }
 
 // ---- Read mbtiles
@@ -124,28 +250,55 @@ vector<char> MBTiles::readTile(int zoom, int col, int row) {
 	return pbfBlob;
 }
 
-bool MBTiles::readTileAndUncompress(string &data, int zoom, int x, int y, bool isCompressed, bool asGzip) {
-	m.lock();
+bool MBTiles::readTileAndUncompress(string &data, int zoom, int x, int y, const Compression &compression) {
 	int tmsY = pow(2,zoom) - 1 - y;
-	int exists=0;
-	db << "SELECT COUNT(*) FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?" << zoom << x << tmsY >> exists;
-	m.unlock();
-	if (exists==0) return false;
+	if (existingTiles.find(tileKey(zoom, x, tmsY)) == existingTiles.end()) return false;
 
-	m.lock();
 	std::vector<char> compressed;
-	db << "SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?" << zoom << x << tmsY >> compressed;
-	m.unlock();
-
-	if (!isCompressed) {
-		data = std::string(compressed.data(), compressed.size());
-		return true;
+	std::unique_ptr<ReadConnection> reader = acquireReader();
+	try {
+		reader->select.reset();
+		reader->select << zoom << x << tmsY >> compressed;
+	} catch(sqlite::exceptions::no_rows &e) {
+		releaseReader(std::move(reader));
+		return false;
 	}
+	releaseReader(std::move(reader));
 
 	try {
-		decompress_string(data, compressed.data(), compressed.size(), asGzip);
+		decompress_string(data, compressed.data(), compressed.size(), compression);
 		return true;
 	} catch(std::runtime_error &e) {
 		return false;
 	}
 }
+
+MBTiles::ReadConnection::ReadConnection(std::shared_ptr<sqlite3> conn):
+	db(conn),
+	select(db << "SELECT tile_data FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?") {
+	select.used(true);
+}
+
+// Take an idle read-only connection, or open a new one.
+// There are never more of these than there are tile workers.
+std::unique_ptr<MBTiles::ReadConnection> MBTiles::acquireReader() {
+	{
+		std::lock_guard<std::mutex> lock(idleReadersMutex);
+		if (!idleReaders.empty()) {
+			std::unique_ptr<ReadConnection> reader = std::move(idleReaders.back());
+			idleReaders.pop_back();
+			return reader;
+		}
+	}
+	sqlite3 *conn = nullptr;
+	int ret = sqlite3_open_v2(filename.c_str(), &conn, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+	std::shared_ptr<sqlite3> ptr(conn, [](sqlite3 *p) { sqlite3_close_v2(p); });
+	if (ret != SQLITE_OK) sqlite::exceptions::throw_sqlite_error(ret);
+	sqlite3_busy_timeout(conn, MBTILES_READ_TIMEOUT_MS);
+	return std::unique_ptr<ReadConnection>(new ReadConnection(ptr));
+}
+
+void MBTiles::releaseReader(std::unique_ptr<ReadConnection> reader) {
+	std::lock_guard<std::mutex> lock(idleReadersMutex);
+	idleReaders.push_back(std::move(reader));
+}
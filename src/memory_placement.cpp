@@ -0,0 +1,198 @@
+#include "memory_placement.h"
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#endif
+
+namespace MemoryPlacementTypes {
+	const size_t HugePageSize = 2 * 1024 * 1024;
+
+	struct NumaNode {
+		int id;
+		std::vector<int> cpus;
+	};
+
+	MemoryPlacement::HugePages hugePages = MemoryPlacement::HugePages::None;
+	MemoryPlacement::Numa numa = MemoryPlacement::Numa::None;
+	bool pinThreads = false;
+
+	std::vector<NumaNode> nodes;
+	// The nodes that have CPUs; memory-only nodes have none to pin to
+	std::vector<size_t> cpuNodes;
+	std::once_flag topologyRead;
+	std::atomic<size_t> nextThread(0);
+	std::atomic<bool> hugePagesFallbackReported(false);
+
+	std::string readLine(const std::string& filename) {
+		std::ifstream in(filename);
+		std::string line;
+		std::getline(in, line);
+		return line;
+	}
+
+	void readTopology() {
+		for (int id : MemoryPlacement::parseCpuList(readLine("/sys/devices/system/node/online"))) {
+			nodes.push_back({ id, MemoryPlacement::parseCpuList(readLine("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist")) });
+			if (!nodes.back().cpus.empty())
+				cpuNodes.push_back(nodes.size() - 1);
+		}
+	}
+
+	const std::vector<NumaNode>& topology() {
+		std::call_once(topologyRead, readTopology);
+		return nodes;
+	}
+}
+
+using namespace MemoryPlacementTypes;
+
+// Parse a list like "0-3,8,10-11"
+std::vector<int> MemoryPlacement::parseCpuList(const std::string& list) {
+	std::vector<int> rv;
+	size_t start = 0;
+	while (start < list.size()) {
+		size_t end = list.find(',', start);
+		if (end == std::string::npos) end = list.size();
+		const std::string range = list.substr(start, end - start);
+		const size_t dash = range.find('-');
+		try {
+			const int first = std::stoi(range.substr(0, dash));
+			const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+			for (int i = first; i <= last; i++)
+				rv.push_back(i);
+		} catch (std::exception&) {
+			// Not a number, e.g. a trailing newline
+		}
+		start = end + 1;
+	}
+	return rv;
+}
+
+MemoryPlacement::HugePages MemoryPlacement::parseHugePages(const std::string& name) {
+	if (name == "none") return HugePages::None;
+	if (name == "transparent") return HugePages::Transparent;
+	if (name == "explicit") return HugePages::Explicit;
+	throw std::invalid_argument("unknown huge pages setting " + name + "; expected none, transparent or explicit");
+}
+
+MemoryPlacement::Numa MemoryPlacement::parseNuma(const std::string& name) {
+	if (name == "none") return Numa::None;
+	if (name == "interleave") return Numa::Interleave;
+	throw std::invalid_argument("unknown NUMA setting " + name + "; expected none or interleave");
+}
+
+void MemoryPlacement::configure(HugePages hugePages, Numa numa, bool pinThreads) {
+	MemoryPlacementTypes::hugePages = hugePages;
+	MemoryPlacementTypes::numa = numa;
+	MemoryPlacementTypes::pinThreads = pinThreads;
+}
+
+bool MemoryPlacement::placesMemory() {
+	return hugePages != HugePages::None || numa != Numa::None;
+}
+
+size_t MemoryPlacement::numaNodes() {
+	return topology().size();
+}
+
+void* MemoryPlacement::map(size_t& size) {
+#ifdef __linux__
+	if (hugePages != HugePages::None)
+		size = (size + HugePageSize - 1) / HugePageSize * HugePageSize;
+
+	void* address = MAP_FAILED;
+	if (hugePages == HugePages::Explicit) {
+		// Not MAP_NORESERVE: if too few huge pages are reserved, fail now
+		// rather than with SIGBUS when the memory is first touched
+		address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (address == MAP_FAILED && !hugePagesFallbackReported.exchange(true))
+			std::cerr << "warning: couldn't map explicit huge pages (see /proc/sys/vm/nr_hugepages), so using normal pages" << std::endl;
+	}
+	if (address == MAP_FAILED)
+		address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (address == MAP_FAILED)
+		return nullptr;
+
+	if (hugePages == HugePages::Transparent)
+		madvise(address, size, MADV_HUGEPAGE);
+
+	if (numa == Numa::Interleave && numaNodes() > 1) {
+		unsigned long mask = 0;
+		for (const NumaNode& node : topology())
+			if (node.id < 64)
+				mask |= 1ul << node.id;
+		// Best effort: the memory is still usable if this fails
+		syscall(SYS_mbind, address, size, MPOL_INTERLEAVE, &mask, 65, 0);
+	}
+	return address;
+#else
+	return nullptr;
+#endif
+}
+
+void MemoryPlacement::unmap(void* address, size_t size) {
+#ifdef __linux__
+	munmap(address, size);
+#endif
+}
+
+void MemoryPlacement::pinThread() {
+#ifdef __linux__
+	if (!pinThreads)
+		return;
+
+	thread_local bool pinned = false;
+	if (pinned)
+		return;
+	pinned = true;
+
+	// Take the nodes that have CPUs in turn
+	topology();
+	if (cpuNodes.empty())
+		return;
+	const NumaNode& node = nodes[cpuNodes[nextThread++ % cpuNodes.size()]];
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	for (int cpu : node.cpus)
+		if (cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+}
+
+void MemoryPlacement::report(std::ostream& out) {
+	if (hugePages == HugePages::None && numa == Numa::None && !pinThreads)
+		return;
+
+	out << "Memory placement: " << numaNodes() << " NUMA node" << (numaNodes() == 1 ? "" : "s");
+
+	if (hugePages == HugePages::Transparent) {
+		out << ", transparent huge pages";
+		// madvise only helps if THP is "always" or "madvise", not "never"
+		const std::string enabled = readLine("/sys/kernel/mm/transparent_hugepage/enabled");
+		if (enabled.find("[never]") != std::string::npos)
+			out << " (but they're disabled in /sys/kernel/mm/transparent_hugepage/enabled)";
+	} else if (hugePages == HugePages::Explicit) {
+		out << ", explicit huge pages (" << readLine("/proc/sys/vm/nr_hugepages") << " reserved)";
+	}
+
+	if (numa == Numa::Interleave)
+		out << (numaNodes() > 1 ? ", interleaved across nodes" : ", only one so not interleaved");
+
+	if (pinThreads)
+		out << ", workers pinned to nodes in turn";
+
+	out << std::endl;
+}
@@ -1,101 +1,148 @@
 #include "mmap_allocator.h"
+#include "memory_placement.h"
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
 
+#include <boost/interprocess/anonymous_shared_memory.hpp>
 #include <boost/interprocess/mapped_region.hpp>
 #include <boost/interprocess/managed_external_buffer.hpp>
 #include <boost/interprocess/file_mapping.hpp>
 
 #include <boost/filesystem.hpp>
 
-
-struct mmap_file
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Memory is handed out from regions: files in the --store directory, or
+// anonymous memory. Each thread allocates from its own region, and opens
+// another when it fills up.
+//
+// Regions belong to the arena of the phase that opened them. When a new
+// phase begins, threads move on to new regions, so data that only lives for
+// one phase doesn't share regions with data that lives longer. Once all of
+// a region's data has been deallocated, it's unmapped (and its file removed).
+// Until then, the pages inside large freed blocks are handed back to the OS.
+
+struct mmap_region
 {
 	std::string filename;
+	size_t arena;
+	char* address;
+	size_t size;
+	// Mapped by MemoryPlacement, rather than by region
+	bool placed = false;
 
 	std::mutex mutex;
 	boost::interprocess::file_mapping mapping;
 	boost::interprocess::mapped_region region;
 	boost::interprocess::managed_external_buffer buffer;
 
-	mmap_file(std::string const &filename, std::size_t offset = 0);
-	~mmap_file();
+	// A region backed by a file
+	mmap_region(std::string const &filename, size_t arena);
+	// A region of anonymous memory, which takes no RAM until it's used
+	mmap_region(size_t size, size_t arena);
+	~mmap_region();
 
-	void remove();
+	const char* begin() const { return address; }
+	bool contains(const void* p) const { return p >= begin() && p < begin() + size; }
+	size_t used() { return size - buffer.get_free_memory(); }
 };
 
-using mmap_file_ptr = std::shared_ptr<mmap_file>;
+using mmap_region_ptr = std::shared_ptr<mmap_region>;
+
+struct mmap_arena
+{
+	std::string name;
+	size_t regions = 0;
+	size_t mapped = 0;
+	size_t released = 0;
+};
 
-struct mmap_dir_t
+struct mmap_regions_t
 {
-	static constexpr std::size_t increase = 1024000000;  
+	static constexpr std::size_t file_increase = 1024000000;
+	static constexpr std::size_t shm_increase = 64000000;
 	static constexpr std::size_t alignment = 32;
+	// Freed blocks at least this big give their pages back to the OS
+	static constexpr std::size_t release_size = 1024 * 1024;
 
 	std::string mmap_dir_filename;
 	bool mmap_dir_created = false;
-
-public:
-	~mmap_dir_t();
-
-	bool is_open();
-	void open_mmap_file(std::string const &filename, size_t file_size = increase);
-	void resize_mmap_file(size_t add_size);
-	
+	size_t files_opened = 0;
 	size_t mmap_file_size = 0;
 
-	std::vector<mmap_file_ptr> files;
-};
+	std::vector<mmap_arena> arenas = { { "startup" } };
+	std::atomic<size_t> current_arena{0};
 
-thread_local mmap_file_ptr mmap_file_thread_ptr;
+	// Keyed by start address, to find the region a pointer came from
+	std::map<const char*, mmap_region_ptr> regions;
 
-struct mmap_shm 
-{
-	std::mutex mutex;
-	std::vector<uint8_t> region;
-	boost::interprocess::managed_external_buffer buffer;
-
-	static size_t mmap_file_size;
-
-	mmap_shm(size_t size);
+	~mmap_regions_t();
 
-	static void open(size_t add_size);
-	static void close();
+	bool is_open() const { return !mmap_dir_filename.empty(); }
+	mmap_region_ptr open_region(size_t add_size);
+	mmap_region_ptr find(const void* p) const;
+	void release_empty();
 };
 
-using mmap_shm_ptr = std::shared_ptr<mmap_shm>;
-
-using allocator_t = boost::interprocess::allocator<uint8_t, boost::interprocess::managed_external_buffer::segment_manager>;
-
-static mmap_dir_t mmap_dir;
-     
-std::vector< mmap_shm_ptr > mmap_shm_regions;  
-size_t mmap_shm::mmap_file_size = 0;
-thread_local mmap_shm_ptr mmap_shm_thread_region_ptr;
+static mmap_regions_t mmap_regions;
+// Containers destroyed at exit after mmap_regions mustn't look in it
+static bool mmap_regions_destroyed = false;
+thread_local mmap_region_ptr mmap_thread_region;
 
+// Guards mmap_regions
 std::mutex mmap_allocator_mutex;
 
-mmap_file::mmap_file(std::string const &filename, std::size_t offset)
+mmap_region::mmap_region(std::string const &filename, size_t arena)
 	: filename(filename)
+	, arena(arena)
+	, address(nullptr)
+	, size(0)
 	, mapping(filename.c_str(), boost::interprocess::read_write)
 	, region(mapping, boost::interprocess::read_write)
-	, buffer(boost::interprocess::create_only, reinterpret_cast<uint8_t *>(region.get_address()) + offset, region.get_size() - offset)
-{ }
-
-mmap_file::~mmap_file()
 {
-	mapping = boost::interprocess::file_mapping();
-	region = boost::interprocess::mapped_region();
-	buffer = boost::interprocess::managed_external_buffer();
+	address = static_cast<char*>(region.get_address());
+	size = region.get_size();
+	buffer = boost::interprocess::managed_external_buffer(boost::interprocess::create_only, address, size);
+}
 
-	remove();
+mmap_region::mmap_region(size_t size, size_t arena)
+	: arena(arena)
+	, address(nullptr)
+	, size(size)
+{
+	// Map it ourselves only if huge pages or NUMA interleave were asked for
+	if(MemoryPlacement::placesMemory())
+		address = static_cast<char*>(MemoryPlacement::map(this->size));
+	if(address != nullptr) {
+		placed = true;
+	} else {
+		region = boost::interprocess::mapped_region(boost::interprocess::anonymous_shared_memory(size));
+		address = static_cast<char*>(region.get_address());
+	}
+	buffer = boost::interprocess::managed_external_buffer(boost::interprocess::create_only, address, this->size);
 }
 
-void mmap_file::remove()
+mmap_region::~mmap_region()
 {
+	buffer = boost::interprocess::managed_external_buffer();
+	if(placed)
+		MemoryPlacement::unmap(address, size);
+	region = boost::interprocess::mapped_region();
+	mapping = boost::interprocess::file_mapping();
+
 	if(!filename.empty()) {
 		try {
 			boost::filesystem::remove(filename.c_str());
@@ -105,115 +152,185 @@ void mmap_file::remove()
 	}
 }
 
-void mmap_dir_t::open_mmap_file(std::string const &dir_filename, size_t file_size)
+mmap_region_ptr mmap_regions_t::open_region(size_t add_size)
 {
-	mmap_dir_filename = dir_filename;
-	mmap_file_size = file_size;
-
-	mmap_dir_created |= boost::filesystem::create_directory(dir_filename);
-
-	std::string new_filename = mmap_dir_filename + "/mmap_" + std::to_string(mmap_dir.files.size()) + ".dat";
-	std::cout << "Filename: " << new_filename << ", size: " << mmap_file_size << std::endl;
-	if(std::ofstream(new_filename.c_str()).fail())
-		throw std::runtime_error("Failed to open mmap file");
-	boost::filesystem::resize_file(new_filename.c_str(), 0);
-	boost::filesystem::resize_file(new_filename.c_str(), mmap_file_size);
-	mmap_file_thread_ptr = std::make_shared<mmap_file>(new_filename.c_str());
+	const size_t arena = current_arena;
+	mmap_region_ptr rv;
+
+	if(is_open()) {
+		auto size = file_increase + (add_size + alignment) - (add_size % alignment);
+		std::string new_filename = mmap_dir_filename + "/mmap_" + std::to_string(files_opened++) + ".dat";
+		if(std::ofstream(new_filename.c_str()).fail())
+			throw std::runtime_error("Failed to open mmap file");
+		boost::filesystem::resize_file(new_filename.c_str(), size);
+		rv = std::make_shared<mmap_region>(new_filename, arena);
+		mmap_file_size += size;
+	} else {
+		auto size = shm_increase + (add_size + alignment) - (add_size % alignment);
+		rv = std::make_shared<mmap_region>(size, arena);
+	}
 
-	mmap_dir.files.emplace_back(mmap_file_thread_ptr);
+	regions[rv->begin()] = rv;
+	arenas[arena].regions++;
+	arenas[arena].mapped += rv->size;
+	return rv;
 }
 
-void mmap_dir_t::resize_mmap_file(size_t add_size)
+mmap_region_ptr mmap_regions_t::find(const void* p) const
 {
-	auto offset = mmap_file_size;
-	auto size = increase + (add_size + alignment) - (add_size % alignment);
-
-	std::string new_filename = mmap_dir_filename + "/mmap_" + std::to_string(mmap_dir.files.size()) + ".dat";
-	if(std::ofstream(new_filename.c_str()).fail())
-		throw std::runtime_error("Failed to open mmap file");
-	boost::filesystem::resize_file(new_filename.c_str(), size);
-	mmap_file_thread_ptr = std::make_shared<mmap_file>(new_filename.c_str(), 0);
-
-	mmap_dir.files.emplace_back(mmap_file_thread_ptr);
-	mmap_file_size = offset + size;
+	auto it = regions.upper_bound(static_cast<const char*>(p));
+	if(it == regions.begin())
+		return nullptr;
+	--it;
+	return it->second->contains(p) ? it->second : nullptr;
 }
 
-bool mmap_dir_t::is_open() 
-{ 
-	return !mmap_dir.files.empty(); 
-}
-
- mmap_dir_t::~mmap_dir_t()
+void mmap_regions_t::release_empty()
 {
-	if(!mmap_dir_filename.empty()) {
-		try {
-			files.clear();
+	for(auto it = regions.begin(); it != regions.end(); ) {
+		mmap_region_ptr& region = it->second;
+
+		// A region that a thread may still allocate from is kept
+		bool release = region->arena != current_arena && region.use_count() == 1;
+		if(release) {
+			std::lock_guard<std::mutex> lock(region->mutex);
+			release = region->buffer.all_memory_deallocated();
+		}
 
-			if(mmap_dir_created) {
-				boost::filesystem::remove(mmap_dir_filename.c_str());
-			}
-		} catch(boost::filesystem::filesystem_error &e) {
-			std::cout << e.what() << std::endl;
+		if(!release) {
+			++it;
+			continue;
 		}
+
+		mmap_arena& arena = arenas[region->arena];
+		arena.regions--;
+		arena.mapped -= region->size;
+		arena.released += region->size;
+		if(!region->filename.empty())
+			mmap_file_size -= region->size;
+		it = regions.erase(it);
 	}
 }
 
-mmap_shm::mmap_shm(size_t size) 
-	: region(size)
-	, buffer(boost::interprocess::create_only, region.data(), region.size())
-{ }
-
-void mmap_shm::open(size_t add_size)
+mmap_regions_t::~mmap_regions_t()
 {
-	constexpr std::size_t increase = 64000000;  
-	constexpr std::size_t alignment = 32;
-
-	auto size = increase + (add_size + alignment) - (add_size % alignment);
-	mmap_shm_thread_region_ptr = std::make_shared<mmap_shm>(size);
-	mmap_shm_regions.emplace_back(mmap_shm_thread_region_ptr);
-	mmap_file_size += size;
+	mmap_regions_destroyed = true;
+	try {
+		regions.clear();
+
+		// The regions' files are gone, but others may have been saved there
+		// to keep (e.g. --reuse-stores), so only remove it if it's empty
+		if(mmap_dir_created && boost::filesystem::is_empty(mmap_dir_filename)) {
+			boost::filesystem::remove(mmap_dir_filename.c_str());
+		}
+	} catch(boost::filesystem::filesystem_error &e) {
+		std::cout << e.what() << std::endl;
+	}
 }
 
-void mmap_shm::close() 
+// Give back the pages inside a freed block. The block's ends are left alone,
+// as the allocator keeps its bookkeeping there; the rest reads back as zeroes
+// when it's next allocated. MADV_REMOVE frees anonymous shared memory, and
+// punches a hole in a --store file; private memory (from MemoryPlacement)
+// needs MADV_DONTNEED.
+static void release_pages(void *p, size_t size)
 {
-	mmap_shm_regions.clear();
-	mmap_shm_thread_region_ptr.reset();
+#ifdef MADV_REMOVE
+	static const uintptr_t page = sysconf(_SC_PAGESIZE);
+	constexpr uintptr_t margin = 256;
+	const uintptr_t start = (reinterpret_cast<uintptr_t>(p) + margin + page - 1) & ~(page - 1);
+	const uintptr_t end = (reinterpret_cast<uintptr_t>(p) + size - margin) & ~(page - 1);
+	if(end > start && madvise(reinterpret_cast<void*>(start), end - start, MADV_REMOVE) != 0)
+		madvise(reinterpret_cast<void*>(start), end - start, MADV_DONTNEED);
+#endif
 }
 
 void * void_mmap_allocator::allocate(size_type n, const void *hint)
 {
 	while(true) {
-		try {
-			if(mmap_dir.is_open() && mmap_file_thread_ptr != nullptr) {	
-				auto &i = *mmap_file_thread_ptr;
-				std::lock_guard<std::mutex> lock(i.mutex);
-				allocator_t allocator(i.buffer.get_segment_manager());
-				return &(*allocator.allocate(n, hint));
-			} else if(mmap_shm_thread_region_ptr != nullptr) {	
-				auto &i = *mmap_shm_thread_region_ptr;
-				std::lock_guard<std::mutex> lock(i.mutex);
-				allocator_t allocator(i.buffer.get_segment_manager());
-				return &(*allocator.allocate(n, hint));
+		mmap_region_ptr region = mmap_thread_region;
+		if(region != nullptr && region->arena == mmap_regions.current_arena) {
+			try {
+				std::lock_guard<std::mutex> lock(region->mutex);
+				return region->buffer.allocate(n);
+			} catch(boost::interprocess::bad_alloc &e) {
+				// This region is full
 			}
-		} catch(boost::interprocess::bad_alloc &e) {
-			// This mmap file is full
 		}
 
 		std::lock_guard<std::mutex> lock(mmap_allocator_mutex);
-		if(mmap_dir.is_open()) 
-			mmap_dir.resize_mmap_file(n);
-		else
-			mmap_shm::open(n);
+		mmap_thread_region = mmap_regions.open_region(n);
 	}
 }
 
+void void_mmap_allocator::deallocate(void *p)
+{
+	if(p == nullptr || mmap_regions_destroyed)
+		return;
+
+	// Memory is usually freed by the thread that allocated it
+	mmap_region_ptr region = mmap_thread_region;
+	if(region == nullptr || !region->contains(p)) {
+		std::lock_guard<std::mutex> lock(mmap_allocator_mutex);
+		region = mmap_regions.find(p);
+	}
+
+	// Not ours, e.g. part of a store loaded from disk
+	if(region == nullptr)
+		return;
+
+	// The region stays locked until the pages are gone, so they can't be reused first
+	std::lock_guard<std::mutex> lock(region->mutex);
+	const size_t size = region->buffer.get_segment_manager()->size(p);
+	region->buffer.deallocate(p);
+	if(size >= mmap_regions_t::release_size)
+		release_pages(p, size);
+}
+
 void void_mmap_allocator::reportStoreSize(std::ostringstream &str) {
-	if (mmap_dir.mmap_file_size>0) { str << "Store size " << (mmap_dir.mmap_file_size / 1000000000) << "G | "; }
+	if (mmap_regions.mmap_file_size>0) { str << "Store size " << (mmap_regions.mmap_file_size / 1000000000) << "G | "; }
 }
 
 void void_mmap_allocator::openMmapFile(const std::string& mmapFilename) {
-	mmap_dir.open_mmap_file(mmapFilename);
+	std::lock_guard<std::mutex> lock(mmap_allocator_mutex);
+	mmap_regions.mmap_dir_filename = mmapFilename;
+	mmap_regions.mmap_dir_created |= boost::filesystem::create_directory(mmapFilename);
+
+	mmap_thread_region = mmap_regions.open_region(0);
+	std::cout << "Filename: " << mmap_thread_region->filename << ", size: " << mmap_thread_region->size << std::endl;
 }
 
+void void_mmap_allocator::beginPhase(const std::string& name) {
+	std::lock_guard<std::mutex> lock(mmap_allocator_mutex);
+	mmap_regions.arenas.push_back({ name });
+	mmap_regions.current_arena = mmap_regions.arenas.size() - 1;
 
+	// Worker threads from earlier phases have exited; this thread moves on too
+	mmap_thread_region.reset();
+	mmap_regions.release_empty();
 
+#ifdef __GLIBC__
+	// Scratch data on the heap was freed as the last phase ended
+	malloc_trim(0);
+#endif
+}
+
+void void_mmap_allocator::reportArenas(std::ostream& out) {
+	std::lock_guard<std::mutex> lock(mmap_allocator_mutex);
+	std::vector<size_t> used(mmap_regions.arenas.size());
+	for (const auto& entry : mmap_regions.regions) {
+		std::lock_guard<std::mutex> regionLock(entry.second->mutex);
+		used[entry.second->arena] += entry.second->used();
+	}
+
+	for (size_t i = 0; i < mmap_regions.arenas.size(); i++) {
+		const mmap_arena& arena = mmap_regions.arenas[i];
+		if (arena.regions == 0 && arena.released == 0)
+			continue;
+
+		out << "Arena " << arena.name << ": " << (used[i] / 1000000) << " MB used of " << (arena.mapped / 1000000) << " MB in " << arena.regions << " regions";
+		if (arena.released > 0)
+			out << ", " << (arena.released / 1000000) << " MB released";
+		out << std::endl;
+	}
+}
@@ -23,6 +23,7 @@ po::options_description getParser(OptionsParser::Options& options) {
 		("output", po::value< string >(&options.outputFile),                             "target directory or .mbtiles/.pmtiles file")
 		("bbox",   po::value< string >(&options.bbox),                                   "bounding box to use if input file does not have a bbox header set, example: minlon,minlat,maxlon,maxlat")
 		("merge"  ,po::bool_switch(&options.mergeSqlite),                                "merge with existing .mbtiles (overwrites otherwise)")
+		("clustered",po::bool_switch(&options.clustered),                                "write .pmtiles in tile ID order (clustered)")
 		("config", po::value< string >(&options.jsonFile)->default_value("config.json"), "config JSON file")
 		("process",po::value< string >(&options.luaFile)->default_value("process.lua"),  "tag-processing Lua file")
 		("quiet",  po::bool_switch(&options.quiet),                                      "quiet, suppress standard output")
@@ -34,11 +35,22 @@ po::options_description getParser(OptionsParser::Options& options) {
 		("store",  po::value< string >(&options.osm.storeFile),  "temporary storage for node/ways/relations data")
 		("fast",   po::bool_switch(&options.osm.fast), "prefer speed at the expense of memory")
 		("compact",po::bool_switch(&options.osm.compact),  "use faster data structure for node lookups\nNOTE: This requires the input to be renumbered (osmium renumber)")
+		("flat-nodes",po::bool_switch(&options.osm.flatNodes),  "store nodes in a sparse file indexed by node ID, for constant-time lookups without renumbering (best for the planet)")
 		("no-compress-nodes", po::bool_switch(&options.osm.uncompressedNodes),  "store nodes uncompressed")
 		("no-compress-ways", po::bool_switch(&options.osm.uncompressedWays),  "store ways uncompressed")
 		("materialize-geometries", po::bool_switch(&options.osm.materializeGeometries),  "materialize geometries; uses more memory")
 		("shard-stores", po::bool_switch(&options.osm.shardStores),  "use an alternate reading/writing strategy for low-memory machines")
+		("spill-ways", po::bool_switch(&options.osm.spillWays),  "with --shard-stores, read the .pbf's ways once, spilling each later shard's ways to disk")
+		("pbf-index", po::bool_switch(&options.osm.pbfIndex),  "save an index of the .pbf's blocks beside it, to start faster next time")
+		("block-cache", po::value<uint32_t>(&options.osm.blockCacheMB)->default_value(0),  "keep up to this many MB of decompressed .pbf blocks between reading phases")
+		("block-cache-compress", po::value<string>(&options.osm.blockCacheCompress)->default_value("none"),  "recompress cached blocks (none or zstd)")
+		("decode-threads", po::value<uint32_t>(&options.osm.decodeThreads)->default_value(0),  "decompress .pbf blocks on this many separate threads, ahead of the Lua threads")
+		("external-sort", po::value<uint32_t>(&options.osm.externalSortMB)->default_value(0),  "sort nodes and ways in this many MB, spilling to disk, so unsorted or multiple .pbfs can use the compact sorted stores")
+		("reuse-stores", po::bool_switch(&options.osm.reuseStores),  "save the node and way stores in the --store directory, and reuse them on later runs with the same .pbf")
+		("huge-pages", po::value<string>(&options.osm.hugePages)->default_value("none"),  "back the stores with huge pages (none, transparent or explicit)")
+		("numa", po::value<string>(&options.osm.numa)->default_value("none"),  "spread the stores across NUMA nodes (none or interleave)")
 		("threads",po::value<uint32_t>(&options.threadNum)->default_value(0),              "number of threads (automatically detected if 0)")
+		("pin-threads", po::bool_switch(&options.pinThreads),  "pin worker threads to NUMA nodes in turn")
 			;
 
 	desc.add(performance);
@@ -80,6 +92,14 @@ OptionsParser::Options OptionsParser::parse(const int argc, const char* argv[])
 		}
 	}
 
+	// Saved stores are mapped rather than read into memory, so there's no
+	// need to shard them
+	if (options.osm.reuseStores) {
+		if (options.osm.storeFile.empty())
+			throw OptionException{ "--reuse-stores needs a --store directory" };
+		options.osm.shardStores = false;
+	}
+
 	if (vm.count("help")) {
 		options.showHelp = true;
 		return options;
@@ -4,6 +4,8 @@
 using namespace std;
 
 thread_local GeometryCache<Linestring> linestringCache;
+// Ways are decoded here, so looking one up doesn't allocate
+thread_local std::vector<LatpLon> wayNodes;
 
 OsmMemTiles::OsmMemTiles(
 	size_t threadNum,
@@ -83,9 +85,10 @@ Geometry OsmMemTiles::buildWayGeometry(
 }
 
 void OsmMemTiles::populateLinestring(Linestring& ls, NodeID objectID) const {
-	std::vector<LatpLon> nodes = wayStore.at(OSM_ID(objectID));
+	wayStore.at(OSM_ID(objectID), wayNodes);
 
-	for (const LatpLon& node : nodes) {
+	ls.reserve(ls.size() + wayNodes.size());
+	for (const LatpLon& node : wayNodes) {
 		boost::geometry::range::push_back(ls, boost::geometry::make<Point>(node.lon/10000000.0, node.latp/10000000.0));
 	}
 }
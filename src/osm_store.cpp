@@ -11,24 +11,31 @@
 #include "way_store.h"
 
 using namespace std;
+
+// Scratch buffers for mergeMultiPolygonWays, so looking up ways doesn't allocate
+thread_local std::vector<LatpLon> mergeWayNodes;
+thread_local std::vector<LatpLon> mergeWayEnds;
 namespace bg = boost::geometry;
 
 static inline bool isClosed(const std::vector<LatpLon>& way) {
 	return way.begin() == way.end();
 }
 
-UsedObjects::UsedObjects(Status status): status(status), mutex(256), ids(256 * 1024) {
+UsedObjects::UsedObjects(Status status): status(status) {
 }
 
-bool UsedObjects::test(NodeID id) {
+bool UsedObjects::test(uint64_t id) const {
 	if (status == Status::Disabled)
 		return true;
+	return ids.test(id);
+}
 
-	const size_t chunk = id / 65536;
-	if (ids[chunk].size() == 0)
-		return false;
+void UsedObjects::set(uint64_t id) {
+	ids.set(id);
+}
 
-	return ids[chunk][id % 65536];
+void UsedObjects::reserve(uint64_t minId, uint64_t maxId) {
+	ids.reserve(minId, maxId);
 }
 
 void UsedObjects::enable() {
@@ -39,19 +46,9 @@ bool UsedObjects::enabled() const {
 	return status == Status::Enabled;
 }
 
-void UsedObjects::set(NodeID id) {
-	const size_t chunk = id / 65536;
-
-	std::lock_guard<std::mutex> lock(mutex[chunk % mutex.size()]);
-	if (ids[chunk].size() == 0)
-		ids[chunk].resize(65536);
-
-	ids[chunk][id % 65536] = true;
-}
-
 void UsedObjects::clear() {
-	// This data is not needed after PbfProcessor's ReadPhase::Nodes has completed,
-	// and it takes up to ~1.5GB of RAM.
+	// This data is not needed after the reading phase that consults it, and
+	// for nodes it takes up to ~1.5GB of RAM. test() still works afterwards.
 	ids.clear();
 }
 
@@ -127,7 +124,8 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 	for (auto it = itBegin; it != itEnd; ++it) {
 		if (done[*it]) { continue; }
 		try {
-			auto const &way = ways.at(*it);
+			auto &way = mergeWayNodes;
+			ways.at(*it, way);
 			if (isClosed(way) || results.empty()) {
 				// if start==end, simply add it to the set
 				results.emplace_back(way.begin(), way.end());
@@ -149,7 +147,8 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 		if (waylist.empty()) { nodemap.erase(nodemap.find(n)); }
 	};
 	auto removeWay = [&](WayID w) {
-		auto const &way = ways.at(w);
+		auto &way = mergeWayEnds;
+		ways.at(w, way);
 		LatpLon first = way.front();
 		LatpLon last  = way.back();
 		if (startNodes.find(first) != startNodes.end()) { deleteFromWayList(first, w, true ); }
@@ -172,7 +171,8 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 				if (startNodes.find(rLast)!=startNodes.end()) {
 					// append to the result
 					auto match = startNodes.find(rLast)->second;
-					auto nodes = ways.at(match.back());
+					auto &nodes = mergeWayNodes;
+					ways.at(match.back(), nodes);
 					rt->insert(rt->end(), nodes.begin(), nodes.end());
 					removeWay(match.back());
 					added++;
@@ -180,7 +180,8 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 				} else if (endNodes.find(rLast)!=endNodes.end()) {
 					// append reversed to the original
 					auto match = endNodes.find(rLast)->second;
-					auto nodes = ways.at(match.back());
+					auto &nodes = mergeWayNodes;
+					ways.at(match.back(), nodes);
 					rt->insert(rt->end(),
 						std::make_reverse_iterator(nodes.end()),
 						std::make_reverse_iterator(nodes.begin()));
@@ -190,7 +191,8 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 				} else if (endNodes.find(rFirst)!=endNodes.end()) {
 					// prepend to the original
 					auto match = endNodes.find(rFirst)->second;
-					auto nodes = ways.at(match.back());
+					auto &nodes = mergeWayNodes;
+					ways.at(match.back(), nodes);
 					rt->insert(rt->begin(), nodes.begin(), nodes.end());
 					removeWay(match.back());
 					added++;
@@ -198,7 +200,8 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 				} else if (startNodes.find(rFirst)!=startNodes.end()) {
 					// prepend reversed to the original
 					auto match = startNodes.find(rFirst)->second;
-					auto nodes = ways.at(match.back());
+					auto &nodes = mergeWayNodes;
+					ways.at(match.back(), nodes);
 					rt->insert(rt->begin(),
 						std::make_reverse_iterator(nodes.end()),
 						std::make_reverse_iterator(nodes.begin()));
@@ -215,7 +218,8 @@ void OSMStore::mergeMultiPolygonWays(std::vector<LatpLonDeque> &results, std::ma
 			if (added>0) continue;
 			for (auto nt : (i==0 ? startNodes : endNodes)) {
 				WayID w = nt.second.back();
-				auto const &way = ways.at(w);
+				auto &way = mergeWayNodes;
+				ways.at(w, way);
 				results.emplace_back(way.begin(), way.end());
 				added++;
 				removeWay(w);
@@ -236,15 +240,17 @@ void OSMStore::reopen() {
 	relations.reopen();
 }
 
-void OSMStore::ensureUsedWaysInited() {
-	if (!used_ways.inited) used_ways.reserve(use_compact_nodes, nodes.size());
-}
-
 void OSMStore::clear() {
 	nodes.clear();
 	ways.clear();
 	relations.clear();
-	used_ways.clear();
+	usedWays.clear();
 } 
 
+void OSMStore::clearScanData() {
+	scannedRelations.clear();
+	usedWays.clear();
+	usedRelations.clear();
+}
+
 
@@ -0,0 +1,78 @@
+#include "pbf_block_cache.h"
+#include <sstream>
+
+PbfBlockCache::PbfBlockCache(size_t budget, const Compression& compression):
+	budget(budget), compression(compression), used(0), hits(0), misses(0) { }
+
+protozero::data_view PbfBlockCache::read(
+	PbfReader::PbfReader& reader,
+	const PbfReader::MappedPbf& input,
+	uint64_t offset,
+	int32_t length,
+	bool keep
+) {
+	// Keeps the entry we returned alive, even if the cache is cleared
+	thread_local Entry current;
+	thread_local std::string uncompressed;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = entries.find({ &input, offset });
+		current = it == entries.end() ? nullptr : it->second;
+	}
+	if (current) {
+		hits++;
+		if (!compression.enabled())
+			return { current->data(), current->size() };
+		decompress_string(uncompressed, current->data(), current->size(), compression);
+		return { uncompressed.data(), uncompressed.size() };
+	}
+
+	misses++;
+	protozero::data_view data = reader.readBlob(input.view(offset, length));
+	if (!keep) return data;
+
+	{
+		// Check the budget before making a copy. It's approximate when
+		// recompressing, but only by a block.
+		std::lock_guard<std::mutex> lock(mutex);
+		if (used + data.size() > budget) return data;
+	}
+
+	std::shared_ptr<std::string> entry = std::make_shared<std::string>();
+	if (compression.enabled())
+		compress_string(*entry, std::string(data.data(), data.size()), compression);
+	else
+		entry->assign(data.data(), data.size());
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (used + entry->size() <= budget && entries.emplace(std::make_pair(&input, offset), entry).second)
+		used += entry->size();
+	return data;
+}
+
+void PbfBlockCache::retain(std::function<bool(const PbfReader::MappedPbf& input, uint64_t offset)> retain) {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto it = entries.begin(); it != entries.end(); ) {
+		if (retain(*it->first.first, it->first.second)) {
+			it++;
+		} else {
+			used -= it->second->size();
+			it = entries.erase(it);
+		}
+	}
+}
+
+void PbfBlockCache::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.clear();
+	used = 0;
+}
+
+std::string PbfBlockCache::stats() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::ostringstream ss;
+	ss << "block cache: " << hits << " hits, " << misses << " misses, "
+		<< entries.size() << " blocks (" << (used / 1048576) << "/" << (budget / 1048576) << " MB, " << compression.name() << ")";
+	return ss.str();
+}
@@ -0,0 +1,213 @@
+#include "pbf_index.h"
+#include "binary_file.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/filesystem.hpp>
+
+// The index file is:
+//   - "TMPBFIDX", version, the .pbf's size and mtime
+//   - whether the blocks were classified, and their total size
+//   - the header: bbox and optional features
+//   - the blocks
+//   - "TMPBFIDX" again, so a truncated file isn't mistaken for a valid one
+
+using namespace BinaryFile;
+
+namespace {
+	const char indexMagic[] = "TMPBFIDX";
+	// offset, length, flags and six IDs
+	const uint64_t BlockRecordBytes = 8 + 4 + 1 + 6 * 8;
+
+	// Thread-local so that we can re-use buffers during parsing.
+	thread_local PbfReader::PbfReader reader;
+}
+
+PbfIndex::PbfIndex(): blockBytes(0), classified(false) {
+	header.hasBbox = false;
+}
+
+std::string PbfIndex::indexFilename(const std::string& pbfFilename) {
+	return pbfFilename + PBF_INDEX_EXTENSION;
+}
+
+bool PbfIndex::fileStamp(const std::string& filename, uint64_t& size, int64_t& mtime) {
+	boost::system::error_code ec;
+	size = boost::filesystem::file_size(filename, ec);
+	if (ec) return false;
+	mtime = boost::filesystem::last_write_time(filename, ec);
+	return !ec;
+}
+
+bool PbfIndex::load(const std::string& pbfFilename) {
+	uint64_t size;
+	int64_t mtime;
+	if (!fileStamp(pbfFilename, size, mtime)) return false;
+
+	std::ifstream in(indexFilename(pbfFilename), std::ios::in | std::ios::binary);
+	if (!in) return false;
+
+	try {
+		if (!readMagic(in, indexMagic) || read<uint32_t>(in) != PBF_INDEX_VERSION) return false;
+		if (read<uint64_t>(in) != size || read<int64_t>(in) != mtime) return false;
+
+		classified = read<uint8_t>(in);
+		blockBytes = read<uint64_t>(in);
+
+		header.hasBbox = read<uint8_t>(in);
+		header.bbox.minLon = read<double>(in);
+		header.bbox.maxLon = read<double>(in);
+		header.bbox.minLat = read<double>(in);
+		header.bbox.maxLat = read<double>(in);
+		header.optionalFeatures.clear();
+		for (uint32_t i = read<uint32_t>(in); i > 0; i--)
+			header.optionalFeatures.insert(readString(in));
+
+		const uint64_t count = read<uint64_t>(in);
+		if (count > remaining(in) / BlockRecordBytes) throw std::runtime_error("corrupt");
+		blocks.resize(count);
+		for (Block& block : blocks) {
+			block.offset = read<uint64_t>(in);
+			block.length = read<int32_t>(in);
+			uint8_t flags = read<uint8_t>(in);
+			block.hasNodes = flags & 1;
+			block.hasWays = flags & 2;
+			block.hasRelations = flags & 4;
+			block.minNodeId = read<uint64_t>(in);
+			block.maxNodeId = read<uint64_t>(in);
+			block.minWayId = read<uint64_t>(in);
+			block.maxWayId = read<uint64_t>(in);
+			block.minRelationId = read<uint64_t>(in);
+			block.maxRelationId = read<uint64_t>(in);
+		}
+
+		if (!readMagic(in, indexMagic)) return false;
+	} catch (std::runtime_error&) {
+		blocks.clear();
+		return false;
+	}
+	return true;
+}
+
+bool PbfIndex::save(const std::string& pbfFilename) const {
+	uint64_t size;
+	int64_t mtime;
+	if (!fileStamp(pbfFilename, size, mtime)) return false;
+
+	// Write to a temporary file first, so a partly-written index is never used
+	std::string filename = indexFilename(pbfFilename);
+	std::string tmpFilename = filename + ".tmp";
+	{
+		std::ofstream out(tmpFilename, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!out) return false;
+
+		writeMagic(out, indexMagic);
+		write<uint32_t>(out, PBF_INDEX_VERSION);
+		write<uint64_t>(out, size);
+		write<int64_t>(out, mtime);
+
+		write<uint8_t>(out, classified);
+		write<uint64_t>(out, blockBytes);
+
+		write<uint8_t>(out, header.hasBbox);
+		write<double>(out, header.bbox.minLon);
+		write<double>(out, header.bbox.maxLon);
+		write<double>(out, header.bbox.minLat);
+		write<double>(out, header.bbox.maxLat);
+		write<uint32_t>(out, header.optionalFeatures.size());
+		for (const std::string& feature : header.optionalFeatures)
+			writeString(out, feature);
+
+		write<uint64_t>(out, blocks.size());
+		for (const Block& block : blocks) {
+			write<uint64_t>(out, block.offset);
+			write<int32_t>(out, block.length);
+			write<uint8_t>(out, (block.hasNodes ? 1 : 0) | (block.hasWays ? 2 : 0) | (block.hasRelations ? 4 : 0));
+			write<uint64_t>(out, block.minNodeId);
+			write<uint64_t>(out, block.maxNodeId);
+			write<uint64_t>(out, block.minWayId);
+			write<uint64_t>(out, block.maxWayId);
+			write<uint64_t>(out, block.minRelationId);
+			write<uint64_t>(out, block.maxRelationId);
+		}
+
+		writeMagic(out, indexMagic);
+		out.close();
+		if (!out) {
+			boost::system::error_code ec;
+			boost::filesystem::remove(tmpFilename, ec);
+			return false;
+		}
+	}
+
+	boost::system::error_code ec;
+	boost::filesystem::rename(tmpFilename, filename, ec);
+	return !ec;
+}
+
+void PbfIndex::scan(const PbfReader::MappedPbf& input) {
+	size_t offset = 0;
+	PbfReader::BlobHeader bh = reader.readBlobHeader(input, offset);
+	if (bh.type == "eof")
+		throw std::runtime_error(input.filename() + " is empty");
+	header = reader.readHeaderBlock(reader.readBlob(input.view(offset, bh.datasize)));
+	offset += bh.datasize;
+
+	blocks.clear();
+	blockBytes = 0;
+	classified = false;
+	const uint64_t none = std::numeric_limits<uint64_t>::max();
+	while (true) {
+		bh = reader.readBlobHeader(input, offset);
+		if (bh.type == "eof") {
+			break;
+		}
+		input.view(offset, bh.datasize); // throws if the file is truncated
+		blockBytes += bh.datasize;
+
+		blocks.push_back({ offset, bh.datasize, true, true, true, none, 0, none, 0, none, 0 });
+		offset += bh.datasize;
+	}
+}
+
+void PbfIndex::classify(const PbfReader::MappedPbf& input, unsigned int threadNum) {
+	boost::asio::thread_pool pool(std::max(threadNum, 1u));
+	for (Block& block : blocks) {
+		boost::asio::post(pool, [&input, &block]() {
+			PbfReader::PrimitiveBlock& pb = reader.readPrimitiveBlock(reader.readBlob(input.view(block.offset, block.length)));
+			block.hasNodes = block.hasWays = block.hasRelations = false;
+			for (auto& pg : pb.groups()) {
+				for (auto& node : pg.nodes()) {
+					block.hasNodes = true;
+					block.minNodeId = std::min(block.minNodeId, node.id);
+					block.maxNodeId = std::max(block.maxNodeId, node.id);
+				}
+				for (auto& way : pg.ways()) {
+					block.hasWays = true;
+					block.minWayId = std::min(block.minWayId, way.id);
+					block.maxWayId = std::max(block.maxWayId, way.id);
+				}
+				for (auto& relation : pg.relations()) {
+					block.hasRelations = true;
+					block.minRelationId = std::min(block.minRelationId, relation.id);
+					block.maxRelationId = std::max(block.maxRelationId, relation.id);
+				}
+			}
+		});
+	}
+	pool.join();
+	classified = true;
+}
+
+PbfReader::HeaderBlock ReadPbfHeader(const std::string& pbfFilename) {
+	PbfIndex index;
+	if (index.load(pbfFilename))
+		return index.header;
+
+	std::ifstream infile(pbfFilename, std::ifstream::in | std::ifstream::binary);
+	if (!infile) throw std::runtime_error("Couldn't open .pbf file " + pbfFilename);
+	return reader.readHeaderFromFile(infile);
+}
@@ -1,15 +1,20 @@
 #include <iostream>
 #include "pbf_processor.h"
 #include "pbf_reader.h"
+#include "pbf_index.h"
 
 #include <boost/asio/thread_pool.hpp>
 #include <boost/asio/post.hpp>
+#include <chrono>
+#include <set>
 #include <unordered_set>
 
 #include "node_store.h"
 #include "way_store.h"
 #include "osm_lua_processing.h"
+#include "memory_placement.h"
 #include "mmap_allocator.h"
+#include "output_queue.h"
 
 using namespace std;
 
@@ -25,8 +30,17 @@ uint64_t phaseProgress = 0;
 // Thread-local so that we can re-use buffers during parsing.
 thread_local PbfReader::PbfReader reader;
 
+// How many inflated blocks a decode thread can get ahead of the worker
+// processing the same batch
+const size_t PIPELINE_DEPTH = 4;
+
+// The scans' sets of used objects are allocated up front for a block's IDs if
+// they fall in at most this many chunks, i.e. the block's IDs are dense
+const size_t RESERVE_CHUNKS_PER_BLOCK = 4;
+
 PbfProcessor::PbfProcessor(OSMStore &osmStore)
-	: osmStore(osmStore), compactWarningIssued(false)
+	: osmStore(osmStore), compactWarningIssued(false), blockCacheBudget(0), decodeThreads(0),
+	  nodesLoaded(false), waysLoaded(false), storeAll(false), waysSpilling(false)
 { }
 
 bool PbfProcessor::ReadNodes(OsmLuaProcessing& output, PbfReader::PrimitiveGroup& pg, const PbfReader::PrimitiveBlock& pb, const SignificantTags& nodeKeys)
@@ -65,7 +79,7 @@ bool PbfProcessor::ReadNodes(OsmLuaProcessing& output, PbfReader::PrimitiveGroup
 			emitted = output.setNode(static_cast<NodeID>(nodeId), latplon, tags);
 		}
 
-		if (emitted || osmStore.usedNodes.test(nodeId))
+		if (!nodesLoaded && (emitted || osmStore.usedNodes.test(nodeId)))
 			nodes.push_back(std::make_pair(static_cast<NodeID>(nodeId), latplon));
 	}
 
@@ -76,12 +90,72 @@ bool PbfProcessor::ReadNodes(OsmLuaProcessing& output, PbfReader::PrimitiveGroup
 	return !pg.nodes().empty();
 }
 
+// Find the locations of a way's nodes. A missing node is skipped, unless
+// integrity is enforced.
+void PbfProcessor::lookupWayNodes(const std::vector<NodeID>& refs, LatpLonVec& llVec, std::vector<NodeID>& nodeVec) {
+	llVec.reserve(refs.size());
+	nodeVec.reserve(refs.size());
+
+	for (NodeID nodeId : refs) {
+		try {
+			llVec.push_back(osmStore.nodes.at(nodeId));
+			nodeVec.push_back(nodeId);
+		} catch (std::out_of_range &err) {
+			if (osmStore.integrity_enforced()) throw err;
+		}
+	}
+}
+
+// Pass a way to the output if the profile wants it, and queue it for the way
+// store if it's needed later
+void PbfProcessor::emitWay(
+	OsmLuaProcessing& output,
+	bool wanted,
+	WayID wayId,
+	const LatpLonVec& llVec,
+	const std::vector<NodeID>& nodeVec,
+	const TagMap& tags,
+	std::vector<WayStore::ll_element_t>& llWays,
+	std::vector<std::pair<WayID, std::vector<NodeID>>>& nodeWays
+) {
+	if (llVec.empty()) return;
+
+	try {
+		bool emitted = wanted && output.canWriteWays() && output.setWay(wayId, llVec, tags);
+
+		// If we need it for later, store the way's coordinates in the global way store
+		if (!waysLoaded && (emitted || storeAll || osmStore.usedWays.test(wayId))) {
+			if (osmStore.ways.requiresNodes())
+				nodeWays.push_back(std::make_pair(wayId, nodeVec));
+			else
+				llWays.push_back(std::make_pair(wayId, WayStore::latplon_vector_t(llVec.begin(), llVec.end())));
+		}
+
+	} catch (std::out_of_range &err) {
+		// Way is missing a node?
+		cerr << endl << err.what() << endl;
+	}
+}
+
+void PbfProcessor::storeWays(
+	uint shard,
+	std::vector<WayStore::ll_element_t>& llWays,
+	std::vector<std::pair<WayID, std::vector<NodeID>>>& nodeWays
+) {
+	if (osmStore.ways.requiresNodes()) {
+		osmStore.ways.shard(shard).insertNodes(nodeWays);
+	} else {
+		osmStore.ways.shard(shard).insertLatpLons(llWays);
+	}
+}
+
 bool PbfProcessor::ReadWays(
 	OsmLuaProcessing &output,
 	PbfReader::PrimitiveGroup& pg,
 	const PbfReader::PrimitiveBlock& pb,
 	const SignificantTags& wayKeys,
 	bool locationsOnWays,
+	uint32_t inputIndex,
 	uint shard,
 	uint effectiveShards
 ) {
@@ -89,8 +163,6 @@ bool PbfProcessor::ReadWays(
 	if (pg.ways().empty())
 		return false;
 
-	const bool wayStoreRequiresNodes = osmStore.ways.requiresNodes();
-
 	std::vector<WayStore::ll_element_t> llWays;
 	std::vector<std::pair<WayID, std::vector<NodeID>>> nodeWays;
 	TagMap tags;
@@ -101,7 +173,10 @@ bool PbfProcessor::ReadWays(
 		tags.reset();
 		readTags(pbfWay, pb, tags);
 
-		if (!osmStore.way_is_used(pbfWay.id) && !wayKeys.filter(tags))
+		// Ways the profile doesn't want are still stored if every way is kept
+		// (--reuse-stores), so the saved store suits any later profile
+		const bool wanted = osmStore.usedWays.test(pbfWay.id) || wayKeys.filter(tags);
+		if (!wanted && (!storeAll || waysLoaded))
 			continue;
 
 		llVec.clear();
@@ -120,56 +195,32 @@ bool PbfProcessor::ReadWays(
 				llVec.push_back(ll);
 			}
 		} else {
-			llVec.reserve(pbfWay.refs.size());
-			nodeVec.reserve(pbfWay.refs.size());
-
-			bool skipToNext = false;
-
-			for (int k=0; k<pbfWay.refs.size(); k++) {
-				NodeID nodeId = pbfWay.refs[k];
-
-				if (k == 0 && effectiveShards > 1 && !osmStore.nodes.contains(shard, nodeId)) {
-					skipToNext = true;
-					break;
-				}
+			if (pbfWay.refs.empty())
+				continue;
 
-				try {
-					llVec.push_back(osmStore.nodes.at(static_cast<NodeID>(nodeId)));
-					nodeVec.push_back(nodeId);
-				} catch (std::out_of_range &err) {
-					if (osmStore.integrity_enforced()) throw err;
+			if (effectiveShards > 1 && !osmStore.nodes.contains(shard, pbfWay.refs[0])) {
+				// Spill the way to the later shard that owns it, so that shard
+				// needn't read the blocks again
+				// (only wanted ways get here: --reuse-stores, which keeps the
+				// others too, doesn't shard)
+				if (waysSpilling) {
+					for (uint later = shard + 1; later < effectiveShards; later++) {
+						if (osmStore.nodes.contains(later, pbfWay.refs[0])) {
+							waySpill->add(later, inputIndex, wayId, pbfWay.refs, tags);
+							break;
+						}
+					}
 				}
-			}
-
-			if (skipToNext)
 				continue;
-		}
-		if (llVec.empty()) continue;
-
-		try {
-			bool emitted = output.canWriteWays() && output.setWay(static_cast<WayID>(pbfWay.id), llVec, tags);
-
-			// If we need it for later, store the way's coordinates in the global way store
-			if (emitted || osmStore.way_is_used(wayId)) {
-				if (wayStoreRequiresNodes)
-					nodeWays.push_back(std::make_pair(wayId, nodeVec));
-				else
-					llWays.push_back(std::make_pair(wayId, WayStore::latplon_vector_t(llVec.begin(), llVec.end())));
 			}
 
-		} catch (std::out_of_range &err) {
-			// Way is missing a node?
-			cerr << endl << err.what() << endl;
+			lookupWayNodes(pbfWay.refs, llVec, nodeVec);
 		}
 
+		emitWay(output, wanted, wayId, llVec, nodeVec, tags, llWays, nodeWays);
 	}
 
-	if (wayStoreRequiresNodes) {
-		osmStore.ways.shard(shard).insertNodes(nodeWays);
-	} else {
-		osmStore.ways.shard(shard).insertLatpLons(llWays);
-	}
-
+	storeWays(shard, llWays, nodeWays);
 	return true;
 }
 
@@ -188,7 +239,7 @@ bool PbfProcessor::ScanWays(OsmLuaProcessing& output, PbfReader::PrimitiveGroup&
 		tags.reset();
 		readTags(way, pb, tags);
 
-		if (osmStore.way_is_used(way.id) || wayKeys.filter(tags)) {
+		if (osmStore.usedWays.test(way.id) || wayKeys.filter(tags)) {
 			for (const auto id : way.refs) {
 				osmStore.usedNodes.set(id);
 			}
@@ -246,7 +297,7 @@ bool PbfProcessor::ScanRelations(OsmLuaProcessing& output, PbfReader::PrimitiveG
 				}
 			} else if (pbfRelation.types[n] == PbfReader::Relation::MemberType::WAY) {
 				if (lastID >= pow(2,42)) throw std::runtime_error("Way ID in relation "+std::to_string(relid)+" negative or too large: "+std::to_string(lastID));
-				osmStore.mark_way_used(static_cast<WayID>(lastID));
+				osmStore.usedWays.set(static_cast<WayID>(lastID));
 				if (isAccepted) {
 					const auto& roleView = pb.stringTable[pbfRelation.roles_sid[n]];
 					std::string role(roleView.data(), roleView.size());
@@ -344,26 +395,37 @@ bool PbfProcessor::ReadRelations(
 	return true;
 }
 
+protozero::data_view PbfProcessor::readBlockData(
+	const PbfReader::MappedPbf& input,
+	const BlockMetadata& blockMetadata,
+	ReadPhase phase,
+	uint shard,
+	uint effectiveShards
+) {
+	if (!blockCache)
+		return reader.readBlob(input.view(blockMetadata.offset, blockMetadata.length));
+
+	// Way and relation blocks are read again by later phases, unless this is the last
+	bool keep = (blockMetadata.hasWays || blockMetadata.hasRelations) &&
+		!(phase == ReadPhase::Relations && shard + 1 == effectiveShards);
+	return blockCache->read(reader, input, blockMetadata.offset, blockMetadata.length, keep);
+}
+
 // Returns true when block was completely handled, thus could be omited by another phases.
 bool PbfProcessor::ReadBlock(
-	std::istream& infile,
+	protozero::data_view blob,
 	OsmLuaProcessing& output,
 	const BlockMetadata& blockMetadata,
 	const SignificantTags& nodeKeys,
 	const SignificantTags& wayKeys,
 	bool locationsOnWays,
+	uint32_t inputIndex,
 	ReadPhase phase,
 	uint shard,
 	uint effectiveShards
 ) 
 {
-	infile.seekg(blockMetadata.offset);
-
-	protozero::data_view blob = reader.readBlob(blockMetadata.length, infile);
 	PbfReader::PrimitiveBlock& pb = reader.readPrimitiveBlock(blob);
-	if (infile.eof()) {
-		return true;
-	}
 
 	// Keep count of groups read during this phase.
 	std::size_t read_groups = 0;
@@ -427,7 +489,6 @@ bool PbfProcessor::ReadBlock(
 		}
 
 		if(phase == ReadPhase::RelationScan) {
-			osmStore.ensureUsedWaysInited();
 			bool done = ScanRelations(output, pg, pb, wayKeys);
 			if(done) { 
 				if (ioMutex.try_lock()) {
@@ -445,7 +506,7 @@ bool PbfProcessor::ReadBlock(
 		}
 	
 		if(phase == ReadPhase::Ways) {
-			bool done = ReadWays(output, pg, pb, wayKeys, locationsOnWays, shard, effectiveShards);
+			bool done = ReadWays(output, pg, pb, wayKeys, locationsOnWays, inputIndex, shard, effectiveShards);
 			if(done) { 
 				output_progress();
 				++read_groups;
@@ -476,25 +537,20 @@ bool PbfProcessor::ReadBlock(
 	}
 
 	// We can only delete blocks if we're confident we've processed everything,
-	// which is not possible in the case of subdivided blocks.
-	return (shard + 1 == effectiveShards) && blockMetadata.chunks == 1;
+	// which is not possible in the case of subdivided blocks. A pass that
+	// spills ways is the only one to read the way blocks, so it's as good as
+	// the last.
+	return (shard + 1 == effectiveShards || waysSpilling) && blockMetadata.chunks == 1;
 }
 
 bool blockHasPrimitiveGroupSatisfying(
-	std::istream& infile,
+	const PbfReader::MappedPbf& input,
 	const BlockMetadata block,
 	std::function<bool(const PbfReader::PrimitiveGroup&)> test
 ) {
-	// We may have previously read to EOF, so clear the internal error state
-	infile.clear();
-	infile.seekg(block.offset);
-	protozero::data_view blob = reader.readBlob(block.length, infile);
+	protozero::data_view blob = reader.readBlob(input.view(block.offset, block.length));
 	PbfReader::PrimitiveBlock pb = reader.readPrimitiveBlock(blob);
 
-	if (infile.eof()) {
-		throw std::runtime_error("blockHasPrimitiveGroupSatisfying got unexpected eof");
-	}
-
 	for (auto& pg : pb.groups()) {
 		if (test(pg))
 			return false;
@@ -503,46 +559,53 @@ bool blockHasPrimitiveGroupSatisfying(
 	return true;
 }
 
-int PbfProcessor::ReadPbfFile(
-	uint shards,
-	bool hasSortTypeThenID,
-	const SignificantTags& nodeKeys,
-	const SignificantTags& wayKeys,
+// Find the blocks of one input, and what each contains
+static std::map<std::size_t, BlockMetadata> readBlockIndex(
+	const PbfReader::MappedPbf& input,
 	unsigned int threadNum,
-	const pbfreader_generate_stream& generate_stream,
-	const pbfreader_generate_output& generate_output,
-	const NodeStore& nodeStore,
-	const WayStore& wayStore
-)
-{
-	auto infile = generate_stream();
-
-	// ----	Read PBF
-	osmStore.clear();
+	bool writeIndex,
+	bool& locationsOnWays,
+	ObjectIdRanges& idRanges
+) {
+	// Find the blocks, from the index beside the .pbf if there is one
+	PbfIndex index;
+	if (index.load(input.filename())) {
+		std::cout << "Using block index " << PbfIndex::indexFilename(input.filename()) << std::endl;
+	} else {
+		// Finding the blocks only touches their headers, so don't read ahead
+		input.advise(PbfReader::MappedPbf::Access::Random);
+		index.scan(input);
+
+		if (writeIndex) {
+			index.classify(input, threadNum);
+			if (index.save(input.filename()))
+				std::cout << "Saved block index " << PbfIndex::indexFilename(input.filename()) << std::endl;
+			else
+				std::cerr << "Couldn't save block index " << PbfIndex::indexFilename(input.filename()) << std::endl;
+		}
+	}
 
-	PbfReader::HeaderBlock block = reader.readHeaderFromFile(*infile);
-	bool locationsOnWays = block.optionalFeatures.find(OptionLocationsOnWays) != block.optionalFeatures.end();
+	locationsOnWays = index.header.optionalFeatures.find(OptionLocationsOnWays) != index.header.optionalFeatures.end();
 	if (locationsOnWays) {
 		std::cout << ".osm.pbf file has locations on ways" << std::endl;
 	}
+	const bool hasSortTypeThenID = index.header.optionalFeatures.find(OptionSortTypeThenID) != index.header.optionalFeatures.end();
 
 	std::map<std::size_t, BlockMetadata> blocks;
-
-	// Track the filesize - note that we can't rely on tellg(), as
-	// its meant to be an opaque token useful only for seeking.
-	size_t filesize = 0;
-	while (true) {
-		PbfReader::BlobHeader bh = reader.readBlobHeader(*infile);
-		filesize += bh.datasize;
-		if (infile->eof()) {
-			break;
+	for (const PbfIndex::Block& block : index.blocks)
+		blocks[blocks.size()] = { (long int)block.offset, block.length, block.hasNodes, block.hasWays, block.hasRelations, 0, 1 };
+
+	// Classified blocks know their ID ranges, so the scan phases can allocate
+	// their sets of used objects up front
+	if (index.classified) {
+		for (const PbfIndex::Block& block : index.blocks) {
+			if (block.minNodeId <= block.maxNodeId) idRanges.nodes.push_back({ block.minNodeId, block.maxNodeId });
+			if (block.minWayId <= block.maxWayId) idRanges.ways.push_back({ block.minWayId, block.maxWayId });
+			if (block.minRelationId <= block.maxRelationId) idRanges.relations.push_back({ block.minRelationId, block.maxRelationId });
 		}
-
-		blocks[blocks.size()] = { (long int)infile->tellg(), bh.datasize, true, true, true, 0, 1 };
-		infile->seekg(bh.datasize, std::ios_base::cur);
 	}
-
-	if (hasSortTypeThenID) {
+	size_t filesize = index.blockBytes;
+	if (hasSortTypeThenID && !index.classified) {
 		// The PBF's blocks are sorted by type, then ID. We can do a binary search
 		// to learn where the blocks transition between object types, which
 		// enables a more efficient partitioning of work for reading.
@@ -554,9 +617,9 @@ int PbfProcessor::ReadPbfFile(
 			indexes.begin(),
 			indexes.end(),
 			0,
-			[&blocks, &infile](const auto &i, const auto &ignored) {
+			[&blocks, &input](const auto &i, const auto &ignored) {
 				return blockHasPrimitiveGroupSatisfying(
-					*infile,
+					input,
 					blocks[i],
 					[](const PbfReader::PrimitiveGroup& pg) {
 						for(auto w : pg.ways()) return true;
@@ -571,9 +634,9 @@ int PbfProcessor::ReadPbfFile(
 			indexes.begin(),
 			indexes.end(),
 			0,
-			[&blocks, &infile](const auto &i, const auto &ignored) {
+			[&blocks, &input](const auto &i, const auto &ignored) {
 				return blockHasPrimitiveGroupSatisfying(
-					*infile,
+					input,
 					blocks[i],
 					[](const PbfReader::PrimitiveGroup& pg) {
 						for (auto r : pg.relations()) return true;
@@ -605,9 +668,38 @@ int PbfProcessor::ReadPbfFile(
 		std::cout << "         to fix: osmium cat -f pbf your-file.osm.pbf -o optimized.osm.pbf" << std::endl;
 	}
 
+	return blocks;
+}
+
+int PbfProcessor::ReadPbfFiles(
+	uint shards,
+	const SignificantTags& nodeKeys,
+	const SignificantTags& wayKeys,
+	unsigned int threadNum,
+	const std::vector<const PbfReader::MappedPbf*>& inputs,
+	bool writeIndex,
+	const pbfreader_generate_output& generate_output,
+	const NodeStore& nodeStore,
+	const WayStore& wayStore
+)
+{
+	// ----	Read PBF
+	// (stores loaded from an earlier run are already complete)
+	if (!nodesLoaded && !waysLoaded)
+		osmStore.clear();
+
+	std::vector<InputBlocks> allBlocks;
+	for (const PbfReader::MappedPbf* input : inputs) {
+		InputBlocks inputBlocks;
+		inputBlocks.input = input;
+		inputBlocks.blocks = readBlockIndex(*input, threadNum, writeIndex, inputBlocks.locationsOnWays, inputBlocks.idRanges);
+		allBlocks.push_back(std::move(inputBlocks));
+	}
 
 	std::vector<ReadPhase> all_phases = { ReadPhase::RelationScan };
-	if (wayKeys.enabled()) {
+	// WayScan finds the nodes to store, so it's not needed if every node is
+	// stored, or the nodes are already stored
+	if (wayKeys.enabled() && !storeAll && !nodesLoaded) {
 		osmStore.usedNodes.enable();
 		all_phases.push_back(ReadPhase::WayScan);
 	}
@@ -616,15 +708,58 @@ int PbfProcessor::ReadPbfFile(
 	all_phases.push_back(ReadPhase::Ways);
 	all_phases.push_back(ReadPhase::Relations);
 
+	// Each phase reads its blocks in file order
+	for (const PbfReader::MappedPbf* input : inputs)
+		input->advise(PbfReader::MappedPbf::Access::Sequential);
+
+	std::set<std::pair<const PbfReader::MappedPbf*, uint64_t>> relationBlocks;
+	if (blockCacheBudget > 0) {
+		blockCache.reset(new PbfBlockCache(blockCacheBudget, blockCacheCompression));
+		for (const InputBlocks& inputBlocks : allBlocks)
+			for (const auto& entry : inputBlocks.blocks)
+				if (entry.second.hasRelations)
+					relationBlocks.insert({ inputBlocks.input, entry.second.offset });
+	}
+
+	if (!waySpillDirectory.empty() && shards > 1)
+		waySpill.reset(new WaySpill(shards));
+
 	for(auto phase: all_phases) {
 		phaseProgress = 0;
 		uint effectiveShards = 1;
 
+		// Each phase allocates from its own arena, so scratch data from
+		// earlier phases can be released
+		void_mmap_allocator::beginPhase(phaseName(phase));
+
+		// Allocate the sets the scans fill in this phase's arena, and before the
+		// threads start, so they needn't race to allocate them
+		if (phase == ReadPhase::RelationScan) {
+			// Only for blocks whose IDs are dense: an extract's blocks can span
+			// most of the ID space, and are left to allocate what they touch
+			auto reserve = [](UsedObjects& used, const std::vector<std::pair<uint64_t, uint64_t>>& ranges) {
+				for (const auto& range : ranges)
+					if (range.second / AtomicBitset::ChunkBits - range.first / AtomicBitset::ChunkBits < RESERVE_CHUNKS_PER_BLOCK)
+						used.reserve(range.first, range.second);
+			};
+			for (const InputBlocks& inputBlocks : allBlocks) {
+				if (osmStore.usedNodes.enabled())
+					reserve(osmStore.usedNodes, inputBlocks.idRanges.nodes);
+				reserve(osmStore.usedWays, inputBlocks.idRanges.ways);
+				reserve(osmStore.usedRelations, inputBlocks.idRanges.relations);
+			}
+		}
+
 		// On memory-constrained machines, we might read ways/relations
 		// multiple times in order to keep the working set of nodes limited.
 		if (phase == ReadPhase::Ways || phase == ReadPhase::Relations)
 			effectiveShards = shards;
 
+		// With a way spill, only the first Ways pass reads the blocks
+		bool waysSpilled = false;
+		if (phase == ReadPhase::Ways && waySpill)
+			waySpill->open(waySpillDirectory);
+
 		for (int shard = 0; shard < effectiveShards; shard++) {
 			// If we're in ReadPhase::Ways, only do a pass if there is at least one
 			// entry in the pass's shard.
@@ -635,118 +770,338 @@ int PbfProcessor::ReadPbfFile(
 			if (phase == ReadPhase::Relations && wayStore.shard(shard).size() == 0)
 				continue;
 
+			if (phase == ReadPhase::Ways && waysSpilled) {
+				readSpilledWays(shard, effectiveShards, threadNum, inputs, generate_output);
+				continue;
+			}
+			waysSpilling = phase == ReadPhase::Ways && waySpill;
+
+			// Every input is read for a phase before the next phase starts, so
+			// the stores see all the inputs' nodes before any ways, and so on
+			for (uint32_t inputIndex = 0; inputIndex < allBlocks.size(); inputIndex++) {
+				InputBlocks& inputBlocks = allBlocks[inputIndex];
+				const PbfReader::MappedPbf& input = *inputBlocks.input;
+				std::map<std::size_t, BlockMetadata>& blocks = inputBlocks.blocks;
+				const bool locationsOnWays = inputBlocks.locationsOnWays;
+
 #ifdef CLOCK_MONOTONIC
-			timespec start, end;
-			clock_gettime(CLOCK_MONOTONIC, &start);
+				timespec start, end;
+				clock_gettime(CLOCK_MONOTONIC, &start);
 #endif
 
-			// Launch the pool with threadNum threads
-			boost::asio::thread_pool pool(threadNum);
-			std::mutex block_mutex;
-
-			// If we're in ReadPhase::Relations and there aren't many blocks left
-			// to read, increase parallelism by letting each thread only process
-			// a portion of the block.
-			if (phase == ReadPhase::Relations && blocks.size() < threadNum * 2) {
-				std::cout << "only " << blocks.size() << " relation blocks; subdividing for better parallelism" << std::endl;
-				std::map<std::size_t, BlockMetadata> moreBlocks;
-				for (const auto& block : blocks) {
-					BlockMetadata newBlock = block.second;
-					newBlock.chunks = threadNum;
-					for (size_t i = 0; i < threadNum; i++) {
-						newBlock.chunk = i;
-						moreBlocks[moreBlocks.size()] = newBlock;
+				// Launch the pool with threadNum threads
+				boost::asio::thread_pool pool(threadNum);
+				std::mutex block_mutex;
+
+				// If we're in ReadPhase::Relations and there aren't many blocks left
+				// to read, increase parallelism by letting each thread only process
+				// a portion of the block.
+				if (phase == ReadPhase::Relations && blocks.size() < threadNum * 2) {
+					std::cout << "only " << blocks.size() << " relation blocks; subdividing for better parallelism" << std::endl;
+					std::map<std::size_t, BlockMetadata> moreBlocks;
+					for (const auto& block : blocks) {
+						BlockMetadata newBlock = block.second;
+						newBlock.chunks = threadNum;
+						for (size_t i = 0; i < threadNum; i++) {
+							newBlock.chunk = i;
+							moreBlocks[moreBlocks.size()] = newBlock;
+						}
 					}
+					blocks = moreBlocks;
 				}
-				blocks = moreBlocks;
-			}
 
-			std::deque<std::vector<IndexedBlockMetadata>> blockRanges;
-			std::map<std::size_t, BlockMetadata> filteredBlocks;
-			for (const auto& entry : blocks) {
-				if ((phase == ReadPhase::Nodes && entry.second.hasNodes) ||
-						(phase == ReadPhase::RelationScan && entry.second.hasRelations) ||
-						(phase == ReadPhase::WayScan && entry.second.hasWays) ||
-						(phase == ReadPhase::Ways && entry.second.hasWays) ||
-						(phase == ReadPhase::Relations && entry.second.hasRelations))
-					filteredBlocks[entry.first] = entry.second;
-			}
+				std::deque<std::vector<IndexedBlockMetadata>> blockRanges;
+				std::map<std::size_t, BlockMetadata> filteredBlocks;
+				for (const auto& entry : blocks) {
+					if ((phase == ReadPhase::Nodes && entry.second.hasNodes) ||
+							(phase == ReadPhase::RelationScan && entry.second.hasRelations) ||
+							(phase == ReadPhase::WayScan && entry.second.hasWays) ||
+							(phase == ReadPhase::Ways && entry.second.hasWays) ||
+							(phase == ReadPhase::Relations && entry.second.hasRelations))
+						filteredBlocks[entry.first] = entry.second;
+				}
 
-			blocksToProcess = filteredBlocks.size();
-			blocksProcessed = 0;
-
-			// Relations have very non-uniform processing times, so prefer
-			// to process them as granularly as possible.
-			size_t batchSize = 1;
-
-			// When creating NodeStore/WayStore, we try to give each worker
-			// large batches of contiguous blocks, so that they might benefit from
-			// long runs of sorted indexes, and locality of nearby IDs.
-			if (phase == ReadPhase::Nodes || phase == ReadPhase::Ways)
-				batchSize = (filteredBlocks.size() / (threadNum * 8)) + 1;
-
-			size_t consumed = 0;
-			auto it = filteredBlocks.begin();
-			while(it != filteredBlocks.end()) {
-				std::vector<IndexedBlockMetadata> blockRange;
-				blockRange.reserve(batchSize);
-				size_t max = consumed + batchSize;
-				for (; consumed < max && it != filteredBlocks.end(); consumed++) {
-					IndexedBlockMetadata ibm;
-					memcpy(&ibm, &it->second, sizeof(BlockMetadata));
-					ibm.index = it->first;
-					blockRange.push_back(ibm);
-					it++;
+				blocksToProcess = filteredBlocks.size();
+				blocksProcessed = 0;
+
+				// Relations have very non-uniform processing times, so prefer
+				// to process them as granularly as possible.
+				size_t batchSize = 1;
+
+				// When creating NodeStore/WayStore, we try to give each worker
+				// large batches of contiguous blocks, so that they might benefit from
+				// long runs of sorted indexes, and locality of nearby IDs.
+				if (phase == ReadPhase::Nodes || phase == ReadPhase::Ways)
+					batchSize = (filteredBlocks.size() / (threadNum * 8)) + 1;
+
+				size_t consumed = 0;
+				auto it = filteredBlocks.begin();
+				while(it != filteredBlocks.end()) {
+					std::vector<IndexedBlockMetadata> blockRange;
+					blockRange.reserve(batchSize);
+					size_t max = consumed + batchSize;
+					for (; consumed < max && it != filteredBlocks.end(); consumed++) {
+						IndexedBlockMetadata ibm;
+						memcpy(&ibm, &it->second, sizeof(BlockMetadata));
+						ibm.index = it->first;
+						blockRange.push_back(ibm);
+						it++;
+					}
+					blockRanges.push_back(blockRange);
 				}
-				blockRanges.push_back(blockRange);
-			}
 
-			{
-				for(const std::vector<IndexedBlockMetadata>& blockRange: blockRanges) {
-					boost::asio::post(pool, [=, &blockRange, &blocks, &block_mutex, &nodeKeys, &wayKeys]() {
-						if (phase == ReadPhase::Nodes)
-							osmStore.nodes.batchStart();
-						if (phase == ReadPhase::Ways)
-							osmStore.ways.batchStart();
-
-						for (const IndexedBlockMetadata& indexedBlockMetadata: blockRange) {
-							auto infile = generate_stream();
-							auto output = generate_output();
-
-							if(ReadBlock(*infile, *output, indexedBlockMetadata, nodeKeys, wayKeys, locationsOnWays, phase, shard, effectiveShards)) {
-								const std::lock_guard<std::mutex> lock(block_mutex);
-								blocks.erase(indexedBlockMetadata.index);	
+				auto batchStart = [&]() {
+					MemoryPlacement::pinThread();
+					if (phase == ReadPhase::Nodes)
+						osmStore.nodes.batchStart();
+					if (phase == ReadPhase::Ways)
+						osmStore.ways.batchStart();
+				};
+
+				auto processBlock = [&](protozero::data_view blob, const IndexedBlockMetadata& indexedBlockMetadata) {
+					auto output = generate_output(input.filename());
+
+					if(ReadBlock(blob, *output, indexedBlockMetadata, nodeKeys, wayKeys, locationsOnWays, inputIndex, phase, shard, effectiveShards)) {
+						const std::lock_guard<std::mutex> lock(block_mutex);
+						blocks.erase(indexedBlockMetadata.index);	
+					}
+					blocksProcessed++;
+				};
+
+				if (decodeThreads == 0) {
+					for(const std::vector<IndexedBlockMetadata>& blockRange: blockRanges) {
+						boost::asio::post(pool, [=, &input, &blockRange]() {
+							batchStart();
+
+							for (size_t i = 0; i < blockRange.size(); i++) {
+								const IndexedBlockMetadata& indexedBlockMetadata = blockRange[i];
+								// Blocks in a batch needn't be contiguous, so fetch the next while we read this one
+								if (i + 1 < blockRange.size())
+									input.willNeed(blockRange[i + 1].offset, blockRange[i + 1].length);
+
+								processBlock(readBlockData(input, indexedBlockMetadata, phase, shard, effectiveShards), indexedBlockMetadata);
 							}
-							blocksProcessed++;
-						}
-					});
+
+							// Spilled ways are written a batch at a time, to keep them in ID order
+							if (waysSpilling)
+								waySpill->flush();
+						});
+					}
+					pool.join();
+
+				} else {
+					// Decode threads and workers both take batches in order. Each
+					// batch has its own small queue, from the thread inflating it to
+					// the worker processing it, so a worker still sees a whole batch.
+					// A worker only waits on a batch that a decode thread has taken
+					// or will take next, so the two stages can't deadlock.
+					using Clock = std::chrono::steady_clock;
+					auto nanoseconds = [](Clock::duration d) { return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(); };
+					std::vector<std::unique_ptr<OutputQueue<std::string>>> queues;
+					for (size_t i = 0; i < blockRanges.size(); i++)
+						queues.emplace_back(new OutputQueue<std::string>(PIPELINE_DEPTH));
+					std::atomic<size_t> nextDecode(0), nextProcess(0);
+					std::atomic<uint64_t> decodeNs(0), decodeStallNs(0), processNs(0), processIdleNs(0);
+
+					boost::asio::thread_pool decodePool(decodeThreads);
+					for (unsigned int t = 0; t < decodeThreads; t++) {
+						boost::asio::post(decodePool, [&]() {
+							for (size_t b; (b = nextDecode++) < blockRanges.size(); ) {
+								for (const IndexedBlockMetadata& indexedBlockMetadata : blockRanges[b]) {
+									auto start = Clock::now();
+									protozero::data_view blob = readBlockData(input, indexedBlockMetadata, phase, shard, effectiveShards);
+									std::string data(blob.data(), blob.size());
+									auto decoded = Clock::now();
+									queues[b]->push(std::move(data));
+									decodeNs += nanoseconds(decoded - start);
+									decodeStallNs += nanoseconds(Clock::now() - decoded);
+								}
+								queues[b]->finish();
+							}
+						});
+					}
+
+					for (unsigned int t = 0; t < threadNum; t++) {
+						boost::asio::post(pool, [&]() {
+							std::deque<std::string> ready;
+							for (size_t b; (b = nextProcess++) < blockRanges.size(); ) {
+								batchStart();
+								size_t i = 0;
+								while (true) {
+									auto start = Clock::now();
+									bool more = queues[b]->popAll(ready);
+									auto popped = Clock::now();
+									processIdleNs += nanoseconds(popped - start);
+									if (!more) break;
+
+									for (const std::string& data : ready)
+										processBlock({ data.data(), data.size() }, blockRanges[b][i++]);
+									ready.clear();
+									processNs += nanoseconds(Clock::now() - popped);
+								}
+
+								if (waysSpilling)
+									waySpill->flush();
+							}
+						});
+					}
+
+					decodePool.join();
+					pool.join();
+
+					std::cout << "\r(decode: " << decodeThreads << " threads, " << (decodeNs / 1000000) << " ms busy, " << (decodeStallNs / 1000000) << " ms waiting"
+						<< "; process: " << threadNum << " threads, " << (processNs / 1000000) << " ms busy, " << (processIdleNs / 1000000) << " ms waiting) ";
 				}
-			}
-		
-			pool.join();
 
 #ifdef CLOCK_MONOTONIC
-			clock_gettime(CLOCK_MONOTONIC, &end);
-			uint64_t elapsedNs = 1e9 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
-			std::cout << "(" << std::to_string((uint32_t)(elapsedNs / 1e6)) << " ms)" << std::endl;
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				uint64_t elapsedNs = 1e9 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
+				std::cout << "(" << std::to_string((uint32_t)(elapsedNs / 1e6)) << " ms)" << std::endl;
 #endif
+			}
+
+			if (waysSpilling) {
+				waySpill->finish();
+				waysSpilling = false;
+				waysSpilled = true;
+				std::cout << "Spilled " << (waySpill->bytes() / 1000000) << " MB of ways for later shards" << std::endl;
+			}
 		}
 
 		if(phase == ReadPhase::RelationScan) {
-			auto output = generate_output();
+			// Relations scanned from every input are in osmStore, so any output will do
+			auto output = generate_output(inputs.back()->filename());
 			output->postScanRelations();
 		}
 		if(phase == ReadPhase::Nodes) {
-			osmStore.nodes.finalize(threadNum);
+			if (!nodesLoaded)
+				osmStore.nodes.finalize(threadNum);
 			osmStore.usedNodes.clear();
 		}
 		if(phase == ReadPhase::Ways) {
-			osmStore.ways.finalize(threadNum);
+			if (!waysLoaded)
+				osmStore.ways.finalize(threadNum);
+			if (waySpill)
+				waySpill->clear();
+			// Only relation blocks will be read again
+			if (blockCache)
+				blockCache->retain([&](const PbfReader::MappedPbf& input, uint64_t offset) { return relationBlocks.count({ &input, offset }) > 0; });
 		}
 	}
+
+	if (blockCache) {
+		std::cout << blockCache->stats() << std::endl;
+		blockCache.reset();
+	}
+	waySpill.reset();
 	return 0;
 }
 
+void PbfProcessor::readSpilledWays(
+	uint shard,
+	uint effectiveShards,
+	unsigned int threadNum,
+	const std::vector<const PbfReader::MappedPbf*>& inputs,
+	const pbfreader_generate_output& generate_output
+) {
+#ifdef CLOCK_MONOTONIC
+	timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+
+	blocksToProcess = waySpill->chunks(shard);
+	blocksProcessed = 0;
+	phaseProgress = 0;
+
+	waySpill->read(shard, threadNum, [&](WaySpill::Chunk& chunk) {
+		// A chunk is one thread's ways from a batch, so it's in ID order
+		MemoryPlacement::pinThread();
+		osmStore.ways.batchStart();
+
+		std::vector<std::shared_ptr<OsmLuaProcessing>> outputs(inputs.size());
+		std::vector<WayStore::ll_element_t> llWays;
+		std::vector<std::pair<WayID, std::vector<NodeID>>> nodeWays;
+		TagMap tags;
+		LatpLonVec llVec;
+		std::vector<NodeID> nodeVec;
+		WaySpill::Way way;
+
+		while (chunk.next(way)) {
+			if (!outputs[way.input])
+				outputs[way.input] = generate_output(inputs[way.input]->filename());
+
+			tags.reset();
+			for (const Tag& tag : way.tags)
+				tags.addTag(tag.key, tag.value);
+
+			llVec.clear();
+			nodeVec.clear();
+			lookupWayNodes(way.refs, llVec, nodeVec);
+			emitWay(*outputs[way.input], true, way.id, llVec, nodeVec, tags, llWays, nodeWays);
+		}
+		storeWays(shard, llWays, nodeWays);
+		blocksProcessed++;
+
+		if (ioMutex.try_lock()) {
+			uint64_t minimumIncrement = blocksToProcess.load() / 100;
+			if (minimumIncrement < 1 || ISATTY)
+				minimumIncrement = 1;
+
+			if (phaseProgress == 0 || phaseProgress + minimumIncrement <= blocksProcessed.load()) {
+				phaseProgress = blocksProcessed.load();
+
+				std::ostringstream str;
+				str << "\r";
+				void_mmap_allocator::reportStoreSize(str);
+				str << std::to_string(shard + 1) << "/" << std::to_string(effectiveShards) << " ";
+				str << "Spilled chunk " << blocksProcessed.load() << "/" << blocksToProcess.load() << " ";
+				std::cout << str.str();
+				std::cout.flush();
+			}
+			ioMutex.unlock();
+		}
+	});
+
+#ifdef CLOCK_MONOTONIC
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint64_t elapsedNs = 1e9 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
+	std::cout << "(" << std::to_string((uint32_t)(elapsedNs / 1e6)) << " ms)" << std::endl;
+#endif
+}
+
+void PbfProcessor::enableBlockCache(size_t budget, const Compression& compression) {
+	blockCacheBudget = budget;
+	blockCacheCompression = compression;
+}
+
+void PbfProcessor::enablePipeline(unsigned int decodeThreads) {
+	this->decodeThreads = decodeThreads;
+}
+
+void PbfProcessor::useLoadedStores(bool nodes, bool ways) {
+	nodesLoaded = nodes;
+	waysLoaded = ways;
+}
+
+void PbfProcessor::storeAllObjects() {
+	storeAll = true;
+}
+
+void PbfProcessor::enableWaySpill(const std::string& directory) {
+	waySpillDirectory = directory;
+}
+
+const char* PbfProcessor::phaseName(ReadPhase phase) {
+	switch (phase) {
+		case ReadPhase::Nodes: return "nodes";
+		case ReadPhase::Ways: return "ways";
+		case ReadPhase::Relations: return "relations";
+		case ReadPhase::RelationScan: return "relation scan";
+		case ReadPhase::WayScan: return "way scan";
+	}
+	return "";
+}
+
 // Find a string in the dictionary
 int PbfProcessor::findStringPosition(const PbfReader::PrimitiveBlock& pb, const std::string& str) {
 	for (int i = 0; i < pb.stringTable.size(); i++) {
@@ -762,9 +1117,13 @@ int PbfProcessor::findStringPosition(const PbfReader::PrimitiveBlock& pb, const
 int ReadPbfBoundingBox(const std::string &inputFile, double &minLon, double &maxLon, 
 	double &minLat, double &maxLat, bool &hasClippingBox)
 {
-	fstream infile(inputFile, ios::in | ios::binary);
-	if (!infile) { cerr << "Couldn't open .pbf file " << inputFile << endl; return -1; }
-	auto header = reader.readHeaderFromFile(infile);
+	PbfReader::HeaderBlock header;
+	try {
+		header = ReadPbfHeader(inputFile);
+	} catch (std::runtime_error &e) {
+		cerr << e.what() << endl;
+		return -1;
+	}
 	if (header.hasBbox) {
 		hasClippingBox = true;
 		minLon = header.bbox.minLon;
@@ -772,13 +1131,10 @@ int ReadPbfBoundingBox(const std::string &inputFile, double &minLon, double &max
 		minLat = header.bbox.minLat;
 		maxLat = header.bbox.maxLat;
 	}
-	infile.close();
 	return 0;
 }
 
 bool PbfHasOptionalFeature(const std::string& inputFile, const std::string& feature) {
-	std::ifstream infile(inputFile, std::ifstream::in | std::ifstream::binary);
-	auto header = reader.readHeaderFromFile(infile);
-	infile.close();
+	auto header = ReadPbfHeader(inputFile);
 	return header.optionalFeatures.find(feature) != header.optionalFeatures.end();
 }
@@ -1,9 +1,19 @@
 #include <protozero/pbf_message.hpp>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include "pbf_reader.h"
+#include "pbf_varint.h"
 #include "helpers.h"
 
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 // Where pbf_processor.cpp has higher-level routines that populate our structures,
 // pbf_reader.cpp has low-level tools that interact with the protobuf.
 //
@@ -33,7 +43,29 @@ PbfReader::BlobHeader PbfReader::PbfReader::readBlobHeader(std::istream& input)
 	if (input.eof())
 		throw std::runtime_error("readBlobHeader: unexpected eof");
 
-	protozero::pbf_message<Schema::BlobHeader> message{&data[0], data.size()};
+	return parseBlobHeader({ &data[0], data.size() });
+}
+
+PbfReader::BlobHeader PbfReader::PbfReader::readBlobHeader(const MappedPbf& input, size_t& offset) {
+	if (offset + sizeof(unsigned int) > input.size()) {
+		return {"eof", -1};
+	}
+
+	unsigned int size;
+	memcpy(&size, input.view(offset, sizeof(size)).data(), sizeof(size));
+	endian_swap(size);
+	offset += sizeof(size);
+
+	if (offset + size > input.size())
+		throw std::runtime_error("readBlobHeader: unexpected eof");
+
+	BlobHeader bh = parseBlobHeader(input.view(offset, size));
+	offset += size;
+	return bh;
+}
+
+PbfReader::BlobHeader PbfReader::PbfReader::parseBlobHeader(protozero::data_view data) {
+	protozero::pbf_message<Schema::BlobHeader> message{data};
 
 	std::string type;
 	int32_t datasize = -1;
@@ -68,18 +100,24 @@ protozero::data_view PbfReader::PbfReader::readBlob(int32_t datasize, std::istre
 	if (input.eof())
 		throw std::runtime_error("readBlob: unexpected eof");
 
+	return readBlob({ &blobStorage[0], blobStorage.size() });
+}
+
+protozero::data_view PbfReader::PbfReader::readBlob(protozero::data_view blob) {
 	int32_t rawSize = -1;
 	protozero::data_view view;
-	protozero::pbf_message<Schema::Blob> message{&blobStorage[0], blobStorage.size()};
+	Schema::Blob codec = Schema::Blob::oneof_data_bytes_raw;
+	protozero::pbf_message<Schema::Blob> message{blob};
 	while (message.next()) {
 		switch (message.tag()) {
 			case Schema::Blob::optional_int32_raw_size:
 				rawSize = message.get_int32();
 				break;
 			case Schema::Blob::oneof_data_bytes_raw:
-				view = message.get_view();
-				break;
 			case Schema::Blob::oneof_data_bytes_zlib_data:
+			case Schema::Blob::oneof_data_bytes_lz4_data:
+			case Schema::Blob::oneof_data_bytes_zstd_data:
+				codec = message.tag();
 				view = message.get_view();
 				break;
 			default:
@@ -87,12 +125,24 @@ protozero::data_view PbfReader::PbfReader::readBlob(int32_t datasize, std::istre
 		}
 	}
 
-	if (rawSize == -1)
+	if (codec == Schema::Blob::oneof_data_bytes_raw)
 		// Data is not compressed, can return it directly.
 		return view;
 
-	blobStorage2.resize(rawSize);
-	decompress_string(blobStorage2, view.data(), view.size(), false);
+	if (rawSize == -1)
+		throw std::runtime_error("Blob: compressed data without raw_size");
+
+	switch (codec) {
+		case Schema::Blob::oneof_data_bytes_lz4_data:
+			decompress_lz4(blobStorage2, view.data(), view.size(), rawSize);
+			break;
+		case Schema::Blob::oneof_data_bytes_zstd_data:
+			decompress_zstd(blobStorage2, view.data(), view.size(), rawSize);
+			break;
+		default:
+			blobStorage2.resize(rawSize);
+			decompress_string(blobStorage2, view.data(), view.size(), false);
+	}
 	return { &blobStorage2[0], blobStorage2.size() };
 }
 
@@ -196,34 +246,19 @@ PbfReader::PrimitiveBlock& PbfReader::PbfReader::readPrimitiveBlock(protozero::d
 void PbfReader::DenseNodes::readDenseNodes(protozero::data_view data) {
 	protozero::pbf_message<Schema::DenseNodes> message{data};
 
-	uint64_t id = 0;
-	int32_t lon = 0, lat = 0;
+	uint64_t id = 0, lon = 0, lat = 0;
 	
 	while (message.next()) {
 		switch (message.tag()) {
-			case Schema::DenseNodes::repeated_sint64_id: {
-				auto pi = message.get_packed_sint64();
-				for (auto i : pi) {
-					id += i;
-					ids.push_back(id);
-				}
+			case Schema::DenseNodes::repeated_sint64_id:
+				decodeDeltas(message.get_view(), id, ids);
 				break;
-			} case Schema::DenseNodes::repeated_sint64_lat: {
-				auto pi = message.get_packed_sint64();
-				for (auto i : pi) {
-					lat += i;
-					lats.push_back(lat);
-				}
+			case Schema::DenseNodes::repeated_sint64_lat:
+				decodeDeltas(message.get_view(), lat, lats);
 				break;
-			}
-			case Schema::DenseNodes::repeated_sint64_lon: {
-				auto pi = message.get_packed_sint64();
-				for (auto i : pi) {
-					lon += i;
-					lons.push_back(lon);
-				}
+			case Schema::DenseNodes::repeated_sint64_lon:
+				decodeDeltas(message.get_view(), lon, lons);
 				break;
-			}
 			case Schema::DenseNodes::repeated_int32_keys_vals: {
 				auto pi = message.get_packed_int32();
 				for (auto kv : pi) {
@@ -387,8 +422,7 @@ void PbfReader::Ways::Iterator::readWay(protozero::data_view data) {
 	way.lats.clear();
 	way.lons.clear();
 
-	uint64_t ref = 0;
-	uint32_t lat = 0, lon = 0;
+	uint64_t ref = 0, lat = 0, lon = 0;
 	
 	while (message.next()) {
 		switch (message.tag()) {
@@ -409,30 +443,15 @@ void PbfReader::Ways::Iterator::readWay(protozero::data_view data) {
 				}
 				break;
 			}
-			case Schema::Way::repeated_sint64_refs: {
-				auto pi = message.get_packed_sint64();
-				for (auto i : pi) {
-					ref += i;
-					way.refs.push_back(ref);
-				}
+			case Schema::Way::repeated_sint64_refs:
+				decodeDeltas(message.get_view(), ref, way.refs);
 				break;
-			}
-			case Schema::Way::repeated_sint64_lats: {
-				auto pi = message.get_packed_sint64();
-				for (auto i : pi) {
-					lat += i;
-					way.lats.push_back(lat);
-				}
+			case Schema::Way::repeated_sint64_lats:
+				decodeDeltas(message.get_view(), lat, way.lats);
 				break;
-			}
-			case Schema::Way::repeated_sint64_lons: {
-				auto pi = message.get_packed_sint64();
-				for (auto i : pi) {
-					lon += i;
-					way.lons.push_back(lon);
-				}
+			case Schema::Way::repeated_sint64_lons:
+				decodeDeltas(message.get_view(), lon, way.lons);
 				break;
-			}
 
 			default:
 				// ignore data for unknown tags to allow for future extensions
@@ -580,6 +599,58 @@ PbfReader::Relations::Iterator PbfReader::Relations::end() {
 	return Relations::Iterator{protozero::pbf_message<Schema::PrimitiveGroup>{nullptr, 0ul}, -1, relation};
 }
 
+// ----	MappedPbf
+
+struct PbfReader::MappedPbf::Mapping {
+	boost::interprocess::file_mapping file;
+	boost::interprocess::mapped_region region;
+};
+
+PbfReader::MappedPbf::MappedPbf(const std::string& filename): path(filename), data(nullptr), length(0) {
+	// mapped_region can't map an empty file
+	if (boost::filesystem::file_size(filename) == 0) return;
+
+	mapping.reset(new Mapping());
+	mapping->file = boost::interprocess::file_mapping(filename.c_str(), boost::interprocess::read_only);
+	mapping->region = boost::interprocess::mapped_region(mapping->file, boost::interprocess::read_only);
+	data = static_cast<const char*>(mapping->region.get_address());
+	length = mapping->region.get_size();
+}
+
+PbfReader::MappedPbf::~MappedPbf() { }
+
+protozero::data_view PbfReader::MappedPbf::view(size_t offset, size_t size) const {
+	if (offset > length || size > length - offset)
+		throw std::runtime_error(path + ": unexpected eof");
+	return { data + offset, size };
+}
+
+void PbfReader::MappedPbf::advise(Access access) const {
+	if (!mapping) return;
+	switch (access) {
+		case Access::Normal:
+			mapping->region.advise(boost::interprocess::mapped_region::advice_normal);
+			break;
+		case Access::Sequential:
+			mapping->region.advise(boost::interprocess::mapped_region::advice_sequential);
+			break;
+		case Access::Random:
+			mapping->region.advise(boost::interprocess::mapped_region::advice_random);
+			break;
+	}
+}
+
+void PbfReader::MappedPbf::willNeed(size_t offset, size_t size) const {
+#ifndef _WIN32
+	if (!mapping || offset >= length) return;
+	size = std::min(size, length - offset);
+	// madvise needs a page-aligned start
+	size_t pageSize = boost::interprocess::mapped_region::get_page_size();
+	size_t aligned = offset - offset % pageSize;
+	madvise(const_cast<char*>(data) + aligned, size + (offset - aligned), MADV_WILLNEED);
+#endif
+}
+
 PbfReader::HeaderBlock PbfReader::PbfReader::readHeaderFromFile(std::istream& input) {
 	BlobHeader bh = readBlobHeader(input);
 	protozero::data_view blob = readBlob(bh.datasize, input);
@@ -0,0 +1,135 @@
+#include "pbf_varint.h"
+#include <cstring>
+#include <protozero/varint.hpp>
+
+// The word-at-a-time decoder needs BMI2, and a little-endian CPU so that the
+// first byte of a word is the least significant
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define TM_VARINT_BMI2
+#include <immintrin.h>
+#endif
+
+namespace {
+	inline uint64_t unzigzag(uint64_t v) {
+		return (v >> 1) ^ (~(v & 1) + 1);
+	}
+
+	// One varint at a time; also used for the end of a field, and any varint
+	// longer than 8 bytes
+	template<typename T>
+	T* decodeScalar(const char*& p, const char* end, uint64_t& sum, T* out) {
+		while (p < end) {
+			sum += unzigzag(protozero::decode_varint(&p, end));
+			*out++ = static_cast<T>(sum);
+		}
+		return out;
+	}
+
+	template<typename T>
+	using Decoder = T* (*)(const char*& p, const char* end, uint64_t& sum, T* out);
+}
+
+#ifdef TM_VARINT_BMI2
+// Everything in this region may use BMI2, so it's only called after checking
+// the CPU has it
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("bmi2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("bmi2")
+#endif
+
+namespace {
+	const uint64_t continuationBits = 0x8080808080808080ull;
+	const uint64_t groupBits = 0x7f7f7f7f7f7f7f7full;
+
+	template<typename T>
+	T* decodeWords(const char*& p, const char* end, uint64_t& sum, T* out) {
+		while (end - p >= 8) {
+			uint64_t word;
+			memcpy(&word, p, sizeof(word));
+
+			// The high bit of each byte that ends a varint
+			uint64_t ends = ~word & continuationBits;
+			if (ends == 0) {
+				// Longer than 8 bytes
+				sum += unzigzag(protozero::decode_varint(&p, end));
+				*out++ = static_cast<T>(sum);
+				continue;
+			}
+
+			if (ends == continuationBits) {
+				// Eight one-byte varints, as is usual for node IDs
+				for (unsigned i = 0; i < 64; i += 8) {
+					sum += unzigzag((word >> i) & 0x7f);
+					*out++ = static_cast<T>(sum);
+				}
+				p += 8;
+				continue;
+			}
+
+			// Decode every varint that ends in this word; a partial one at the
+			// end is read again with the next word
+			unsigned consumed = 0;
+			do {
+				unsigned bits = __builtin_ctzll(ends) + 1;
+				uint64_t varint = (word << (64 - bits)) >> (64 - bits + consumed);
+				sum += unzigzag(_pext_u64(varint, groupBits));
+				*out++ = static_cast<T>(sum);
+				consumed = bits;
+				ends &= ends - 1;
+			} while (ends);
+			p += consumed / 8;
+		}
+		return decodeScalar(p, end, sum, out);
+	}
+}
+
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif
+
+PbfReader::DeltaDecoder PbfReader::bestDeltaDecoder() {
+	static const DeltaDecoder best = []() {
+#ifdef TM_VARINT_BMI2
+		// pext is microcoded, and slower than decoding a byte at a time, on
+		// AMD CPUs before Zen 3
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("bmi2") &&
+			!__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2") && !__builtin_cpu_is("bdver4"))
+			return DeltaDecoder::Bmi2;
+#endif
+		return DeltaDecoder::Scalar;
+	}();
+	return best;
+}
+
+const char* PbfReader::deltaDecoderName(DeltaDecoder decoder) {
+	switch (decoder) {
+		case DeltaDecoder::Scalar: return "scalar";
+		case DeltaDecoder::Bmi2: return "bmi2";
+	}
+	return "unknown";
+}
+
+template<typename T>
+void PbfReader::decodeDeltas(protozero::data_view data, uint64_t& sum, std::vector<T>& output, DeltaDecoder decoder) {
+	Decoder<T> decode = decodeScalar<T>;
+#ifdef TM_VARINT_BMI2
+	if (decoder == DeltaDecoder::Bmi2)
+		decode = decodeWords<T>;
+#endif
+
+	// Every varint is at least one byte, so this is room for all of them
+	size_t start = output.size();
+	output.resize(start + data.size());
+	const char* p = data.data();
+	T* end = decode(p, p + data.size(), sum, output.data() + start);
+	output.resize(end - output.data());
+}
+
+template void PbfReader::decodeDeltas<uint64_t>(protozero::data_view, uint64_t&, std::vector<uint64_t>&, DeltaDecoder);
+template void PbfReader::decodeDeltas<int32_t>(protozero::data_view, uint64_t&, std::vector<int32_t>&, DeltaDecoder);
@@ -5,55 +5,78 @@
 #include <map>
 #include <unordered_map>
 #include <mutex>
+#include <algorithm>
+#include <cstdio>
+#include <limits>
 
 #include "pmtiles.h"
 #include "helpers.h"
 
 TileOffset::TileOffset() { }
-PMTiles::PMTiles() { }
-PMTiles::~PMTiles() { }
+PMTiles::PMTiles(): writeQueue(WRITE_QUEUE_SIZE), spareBuffers(WRITE_QUEUE_SIZE) { }
+PMTiles::~PMTiles() {
+	stopWriter();
+}
 
 void PMTiles::open(std::string &filename) {
 	std::cout << "Creating pmtiles at " << filename << std::endl;
-	outputStream.open(filename);
+	outputBuffer.resize(WRITE_BUFFER_SIZE);
+	outputStream.rdbuf()->pubsetbuf(outputBuffer.data(), outputBuffer.size());
+	outputStream.open(filename, std::ios::out | std::ios::trunc | std::ios::binary);
 	// dummy header/root directory for now - we'll write it all later
 	char header[HEADER_ROOT] = "PMTiles";
 	outputStream.write(header, HEADER_ROOT);
+	if (isClustered) {
+		// leaf directories are built as tiles are written, so need somewhere to go until the tile data is complete
+		leafFilename = filename + ".leaves";
+		leafStream.open(leafFilename, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+		if (!leafStream) throw std::runtime_error("Couldn't create temporary file " + leafFilename);
+	}
+	writerThread = std::thread(&PMTiles::writeQueuedTiles, this);
 }
 
 // Finish writing the .pmtiles file
 void PMTiles::close(std::string &metadata) {
 	std::cout << "\nClosing pmtiles file" << std::flush;
+	if (isClustered) {
+		std::lock_guard<std::mutex> lock(reorderMutex);
+		writeClusteredTiles(std::numeric_limits<uint64_t>::max());
+	}
+	stopWriter();
+	reportWriterStats();
 
 	// add all tiles to directories, writing leaf directories as we go
-	std::vector<pmtiles::entryv3> rootEntries;
-	std::vector<pmtiles::entryv3> entries;
-	if (isSparse) {
+	// (clustered output has already done this as tiles were written)
+	if (isClustered) {
+		// nothing to do
+	} else if (isSparse) {
 		for (auto it : sparseIndex) {
-			appendTileEntry(it.first, it.second, rootEntries, entries);
+			appendTileEntry(it.first, it.second, rootEntries, leafEntries);
 		}
 	} else {
 		for (size_t tileId=0; tileId<denseIndex.size(); tileId++) {
-			if (denseIndex[tileId].length != 0xffffff) appendTileEntry(tileId, denseIndex[tileId], rootEntries, entries);
+			if (denseIndex[tileId].length != 0xffffff) appendTileEntry(tileId, denseIndex[tileId], rootEntries, leafEntries);
 		}
 	}
 	if (numTileEntries < ROOT_ONLY) {
-		rootEntries.insert(rootEntries.end(), entries.begin(), entries.end());
-		entries.clear();
+		rootEntries.insert(rootEntries.end(), leafEntries.begin(), leafEntries.end());
+		leafEntries.clear();
 	} else {
-		flushEntries(rootEntries,entries);
+		flushEntries(rootEntries,leafEntries);
 	}
+	if (isClustered) appendLeafDirectories();
 	uint64_t leafLength = static_cast<uint64_t>(outputStream.tellp()) - leafStart;
 
 	// create JSON metadata
-	std::string compressed = compress_string(metadata, Z_DEFAULT_COMPRESSION, true);
+	std::string compressed;
+	compress_string(compressed, metadata, internalCompression());
 	uint64_t jsonStart = static_cast<uint64_t>(outputStream.tellp());
 	int jsonLength = compressed.size();
 	outputStream.write(compressed.c_str(), jsonLength);
 	
 	// write root directory
 	std::string directory = pmtiles::serialize_directory(rootEntries);
-	compressed = compress_string(directory, Z_DEFAULT_COMPRESSION, true);
+	compress_string(compressed, directory, internalCompression());
 	int rootLength = compressed.size();
 	if (rootLength > (HEADER_ROOT-127)) { throw std::runtime_error(".pmtiles root directory was too large - please file an issue"); }
 	outputStream.seekp(127);
@@ -71,9 +94,9 @@ void PMTiles::close(std::string &metadata) {
 	header.addressed_tiles_count = numTilesAddressed;
 	header.tile_entries_count = numTileEntries;
 	header.tile_contents_count = numTilesWritten;
-	header.clustered = false;
-	header.internal_compression = pmtiles::COMPRESSION_GZIP;
-	header.tile_compression = pmtiles::COMPRESSION_GZIP;
+	header.clustered = isClustered;
+	header.internal_compression = headerCompression(internalCompression());
+	header.tile_compression = headerCompression(compression);
 	header.tile_type = pmtiles::TILETYPE_MVT;
 
 	// write header
@@ -114,44 +137,83 @@ void PMTiles::flushEntries(std::vector<pmtiles::entryv3> &rootEntries, std::vect
 	if (entries.size()==0) return;
 	uint64_t startId = entries[0].tile_id;
 	std::string directory = pmtiles::serialize_directory(entries);
-	std::string compressed = compress_string(directory, Z_DEFAULT_COMPRESSION, true);
+	std::string compressed;
+	compress_string(compressed, directory, internalCompression());
 	entries.clear();
 
 	// write the leaf directory to disk
-	std::lock_guard<std::mutex> lock(fileMutex);
-	uint64_t location = outputStream.tellp();
-	if (leafStart==0) leafStart=location;
+	// (clustered output writes to a temporary file, appended on close)
+	uint64_t location;
 	uint64_t length = compressed.size();
-	outputStream << compressed;
+	if (isClustered) {
+		location = leafStream.tellp();
+		leafStream << compressed;
+	} else {
+		std::lock_guard<std::mutex> lock(fileMutex);
+		location = outputStream.tellp();
+		if (leafStart==0) leafStart=location;
+		location -= leafStart;
+		outputStream << compressed;
+	}
 
 	// append reference to the root directory
-	pmtiles::entryv3 rootEntry = pmtiles::entryv3(startId, location-leafStart, length, 0);
+	pmtiles::entryv3 rootEntry = pmtiles::entryv3(startId, location, length, 0);
 	rootEntries.emplace_back(rootEntry);
 }
 
+// Clustered output: copy the leaf directories from the temporary file to follow the tile data
+void PMTiles::appendLeafDirectories() {
+	leafStart = outputStream.tellp();
+	if (leafStream.tellp() > 0) {
+		leafStream.flush();
+		leafStream.seekg(0);
+		outputStream << leafStream.rdbuf();
+	}
+	leafStream.close();
+	std::remove(leafFilename.c_str());
+}
+
 // Write a tile to file and store it in the index
-// - if the tile is small and has already been written, reuse that instead
+// - if an identical tile has already been written, reuse that instead
 // - we're a bit fussy about mutexs because compress_string is expensive
-void PMTiles::saveTile(int zoom, int x, int y, std::string &data) {
+void PMTiles::saveTile(int zoom, int x, int y, const std::string &data) {
 	TileOffset offset;
 	bool isNew = false;
 	uint64_t tileId = pmtiles::zxy_to_tileid(zoom,x,y);
+	Hash128 hash = hash128(data);
 
-	// if it's a tiny tile (e.g. sea), see if we've written it already
+	// if we're writing in tile ID order, compress and hold until all earlier tiles are done
+	if (isClustered) {
+		ClusteredTile tile;
+		tile.hash = hash;
+		std::unique_lock<std::mutex> lock(reorderMutex);
+		bool isDuplicate = dedupIndex.find(hash) != dedupIndex.end();
+		lock.unlock();
+		if (!isDuplicate) {
+			tile.compressed = spareBuffers.take();
+			compress_string(tile.compressed, data, compression);
+		}
+		lock.lock();
+		reorderBytes += tile.compressed.size();
+		reorderBuffer.emplace(tileId, std::move(tile));
+		return;
+	}
+
+	// see if we've written an identical tile (e.g. sea) already
 	std::unique_lock<std::mutex> indexLock1(indexMutex);
-	if (data.size()<TINY_LENGTH && tinyCache.find(data) != tinyCache.end()) {
-		offset = tinyCache[data];
+	auto cached = dedupIndex.find(hash);
+	if (cached != dedupIndex.end()) {
+		offset = cached->second;
+		numDuplicates++;
 		indexLock1.unlock();
 
-	// otherwise, compress it and write
+	// otherwise, compress it and hand it to the writer thread
 	} else {
 		indexLock1.unlock();
-		std::string compressed = compress_string(data, Z_DEFAULT_COMPRESSION, true);
-		std::lock_guard<std::mutex> lock(fileMutex);
-		// write to file
-		offset = TileOffset(static_cast<uint64_t>(outputStream.tellp()) - HEADER_ROOT, compressed.size());
-		outputStream << compressed;
-		numTilesWritten++;
+		std::string compressed = spareBuffers.take();
+		compress_string(compressed, data, compression);
+		size_t length = compressed.size();
+		offset = TileOffset(queueTile(std::move(compressed)), length);
 		isNew = true;
 	}
 	
@@ -165,9 +227,110 @@ void PMTiles::saveTile(int zoom, int x, int y, std::string &data) {
 		denseIndex[tileId] = offset;
 	}
 
-	// add to cache if tiny
-	if (isNew && data.size()<TINY_LENGTH) {
-		if (tinyCache.size()>TINY_MAX_SIZE) tinyCache.clear();
-		tinyCache.insert({ data, offset });
+	// remember where it went, so identical tiles can point to it
+	if (isNew) dedupIndex.insert({ hash, offset });
+}
+
+// Clustered output: register a batch of tiles, starting at firstTileId,
+// that will be processed. Batches must be queued in ascending order.
+void PMTiles::queueBatch(uint64_t firstTileId) {
+	std::lock_guard<std::mutex> lock(reorderMutex);
+	pendingBatches.insert(firstTileId);
+}
+
+// Clustered output: wait before processing a batch if too much is already
+// waiting to be written. The earliest pending batch never waits, so the
+// reorder buffer can always be drained.
+void PMTiles::startBatch(uint64_t firstTileId) {
+	std::unique_lock<std::mutex> lock(reorderMutex);
+	reorderDrained.wait(lock, [&]() { return reorderBytes < REORDER_BUFFER_SIZE || firstTileId == *pendingBatches.begin(); });
+}
+
+// Clustered output: mark a batch as done. If it was the earliest pending
+// batch, every tile before the next pending batch can now be written.
+void PMTiles::completeBatch(uint64_t firstTileId) {
+	std::lock_guard<std::mutex> lock(reorderMutex);
+	bool wasFirst = firstTileId == *pendingBatches.begin();
+	pendingBatches.erase(firstTileId);
+	if (!wasFirst) return;
+	writeClusteredTiles(pendingBatches.empty() ? std::numeric_limits<uint64_t>::max() : *pendingBatches.begin());
+	reorderDrained.notify_all();
+}
+
+// Clustered output: write and index all buffered tiles before beforeTileId.
+// NB: assumes we have the `reorderMutex` mutex
+void PMTiles::writeClusteredTiles(uint64_t beforeTileId) {
+	auto end = reorderBuffer.lower_bound(beforeTileId);
+	for (auto it = reorderBuffer.begin(); it != end; ++it) {
+		ClusteredTile &tile = it->second;
+		reorderBytes -= tile.compressed.size();
+
+		TileOffset offset;
+		auto cached = dedupIndex.find(tile.hash);
+		if (cached != dedupIndex.end()) {
+			offset = cached->second;
+			numDuplicates++;
+		} else {
+			size_t length = tile.compressed.size();
+			offset = TileOffset(queueTile(std::move(tile.compressed)), length);
+			dedupIndex.insert({ tile.hash, offset });
+		}
+		numTilesAddressed++;
+		appendTileEntry(it->first, offset, rootEntries, leafEntries);
 	}
+	reorderBuffer.erase(reorderBuffer.begin(), end);
+}
+
+// Directories and metadata are always compressed (the root directory has to
+// fit in the header block), with zstd if the tiles use it, otherwise gzip
+Compression PMTiles::internalCompression() const {
+	return Compression(compression.codec == Compression::Codec::Zstd ? Compression::Codec::Zstd : Compression::Codec::Gzip);
+}
+
+uint8_t PMTiles::headerCompression(const Compression &c) {
+	switch (c.codec) {
+		case Compression::Codec::None: return pmtiles::COMPRESSION_NONE;
+		case Compression::Codec::Gzip: return pmtiles::COMPRESSION_GZIP;
+		case Compression::Codec::Zstd: return pmtiles::COMPRESSION_ZSTD;
+		default: throw std::runtime_error("PMTiles doesn't support " + c.name() + " compression");
+	}
+}
+
+// Allocate space for a compressed tile and queue it for the writer thread,
+// returning its offset within the tile data section.
+// Blocks if the writer has fallen WRITE_QUEUE_SIZE tiles behind.
+uint64_t PMTiles::queueTile(std::string &&compressed) {
+	uint64_t offset;
+	size_t length = compressed.size();
+	writeQueue.push(std::move(compressed), [&]() {
+		offset = nextTileOffset;
+		nextTileOffset += length;
+		numTilesWritten++;
+	});
+	return offset;
+}
+
+// Writer thread: take everything currently queued and append it to the file.
+// Tiles are queued in offset order, so writes are strictly sequential.
+void PMTiles::writeQueuedTiles() {
+	std::deque<std::string> batch;
+	while (writeQueue.popAll(batch)) {
+		for (auto &tile : batch) {
+			outputStream.write(tile.data(), tile.size());
+			spareBuffers.put(std::move(tile));
+		}
+		batch.clear();
+	}
+}
+
+// Drain the queue and wait for the writer thread to finish
+void PMTiles::stopWriter() {
+	if (!writerThread.joinable()) return;
+	writeQueue.finish();
+	writerThread.join();
+}
+
+// Report how busy the output stage was: if workers stalled for long, writing is the bottleneck
+void PMTiles::reportWriterStats() {
+	std::cout << "\nPMTiles writer: " << numTilesWritten << " tiles (" << numDuplicates << " duplicates reused), " << writeQueue.stats() << std::flush;
 }
@@ -12,6 +12,7 @@ ShardedNodeStore::~ShardedNodeStore() {
 }
 
 void ShardedNodeStore::reopen() {
+	router.clear();
 	for (auto& store : stores)
 		store->reopen();
 }
@@ -22,8 +23,11 @@ void ShardedNodeStore::finalize(size_t threadNum) {
 }
 
 LatpLon ShardedNodeStore::at(NodeID id) const {
+	const uint8_t candidates = router.shards(id);
 	for (int i = 0; i < shards(); i++) {
 		size_t index = (lastNodeShard + i) % shards();
+		if (!(candidates & (1 << index)))
+			continue;
 
 		if (stores[index]->contains(0, id)) {
 			lastNodeShard = index;
@@ -85,7 +89,9 @@ void ShardedNodeStore::insert(const std::vector<element_t>& elements) {
 	std::vector<std::vector<element_t>> perStore(shards());
 
 	for (const auto& el : elements) {
-		perStore[pickStore(el.second)].push_back(el);
+		const size_t store = pickStore(el.second);
+		perStore[store].push_back(el);
+		router.mark(store, el.first);
 	}
 
 	for (int i = 0; i < shards(); i++) {
@@ -95,7 +101,7 @@ void ShardedNodeStore::insert(const std::vector<element_t>& elements) {
 }
 
 bool ShardedNodeStore::contains(size_t shard, NodeID id) const {
-	return stores[shard]->contains(0, id);
+	return router.mayContain(shard, id) && stores[shard]->contains(0, id);
 }
 
 size_t ShardedNodeStore::shards() const {
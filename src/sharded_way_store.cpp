@@ -3,17 +3,59 @@
 
 thread_local size_t lastWayShard = 0;
 
+namespace {
+	// Ways are inserted into a shard directly, so ShardedWayStore hands out
+	// this wrapper to see which IDs go where.
+	class RoutedWayStore : public WayStore {
+	public:
+		RoutedWayStore(std::shared_ptr<WayStore> store, ShardRouter& router, size_t shardIndex):
+			store(store), router(router), shardIndex(shardIndex) {}
+
+		void reopen() override { store->reopen(); }
+		void batchStart() override { store->batchStart(); }
+		using WayStore::at;
+		void at(WayID wayid, std::vector<LatpLon>& out) const override { store->at(wayid, out); }
+		bool requiresNodes() const override { return store->requiresNodes(); }
+		void insertLatpLons(std::vector<WayStore::ll_element_t>& newWays) override {
+			for (const auto& way : newWays)
+				router.mark(shardIndex, way.first);
+			store->insertLatpLons(newWays);
+		}
+		void insertNodes(const std::vector<std::pair<WayID, std::vector<NodeID>>>& newWays) override {
+			for (const auto& way : newWays)
+				router.mark(shardIndex, way.first);
+			store->insertNodes(newWays);
+		}
+		void clear() override { store->clear(); }
+		std::size_t size() const override { return store->size(); }
+		void finalize(unsigned int threadNum) override { store->finalize(threadNum); }
+
+		bool contains(size_t shard, WayID id) const override { return store->contains(0, id); }
+		WayStore& shard(size_t shard) override { return *this; }
+		const WayStore& shard(size_t shard) const override { return *this; }
+		size_t shards() const override { return 1; }
+
+	private:
+		std::shared_ptr<WayStore> store;
+		ShardRouter& router;
+		const size_t shardIndex;
+	};
+}
+
 ShardedWayStore::ShardedWayStore(std::function<std::shared_ptr<WayStore>()> createWayStore, const NodeStore& nodeStore):
 	createWayStore(createWayStore),
 	nodeStore(nodeStore) {
-	for (int i = 0; i < shards(); i++)
+	for (int i = 0; i < shards(); i++) {
 		stores.push_back(createWayStore());
+		routedStores.push_back(std::make_shared<RoutedWayStore>(stores.back(), router, i));
+	}
 }
 
 ShardedWayStore::~ShardedWayStore() {
 }
 
 void ShardedWayStore::reopen() {
+	router.clear();
 	for (auto& store : stores)
 		store->reopen();
 }
@@ -23,17 +65,22 @@ void ShardedWayStore::batchStart() {
 		store->batchStart();
 }
 
-std::vector<LatpLon> ShardedWayStore::at(WayID wayid) const {
+void ShardedWayStore::at(WayID wayid, std::vector<LatpLon>& out) const {
+	const uint8_t candidates = router.shards(wayid);
 	for (int i = 0; i < shards(); i++) {
 		size_t index = (lastWayShard + i) % shards();
+		if (!(candidates & (1 << index)))
+			continue;
+
 		if (stores[index]->contains(0, wayid)) {
 			lastWayShard = index;
-			return stores[index]->at(wayid);
+			stores[index]->at(wayid, out);
+			return;
 		}
 	}
 
-	// Superfluous return to silence a compiler warning
-	return stores[shards() - 1]->at(wayid);
+	// Not found: let the last store throw
+	stores[shards() - 1]->at(wayid, out);
 }
 
 bool ShardedWayStore::requiresNodes() const {
@@ -49,6 +96,7 @@ void ShardedWayStore::insertNodes(const std::vector<std::pair<WayID, std::vector
 }
 
 void ShardedWayStore::clear() {
+	router.clear();
 	for (auto& store : stores)
 		store->clear();
 }
@@ -66,15 +114,15 @@ void ShardedWayStore::finalize(unsigned int threadNum) {
 }
 
 bool ShardedWayStore::contains(size_t shard, WayID id) const {
-	return stores[shard]->contains(0, id);
+	return router.mayContain(shard, id) && stores[shard]->contains(0, id);
 }
 
 WayStore& ShardedWayStore::shard(size_t shard) {
-	return *stores[shard].get();
+	return *routedStores[shard].get();
 }
 
 const WayStore& ShardedWayStore::shard(size_t shard) const {
-	return *stores[shard].get();
+	return *routedStores[shard].get();
 }
 
 size_t ShardedWayStore::shards() const { return nodeStore.shards(); }
@@ -68,8 +68,8 @@ void SharedData::writeMBTilesMetadata(rapidjson::Document const &jsonConfig) {
 }
 
 void SharedData::writeFileMetadata(rapidjson::Document const &jsonConfig) {
-	if(config.compress) 
-		std::cout << "When serving compressed tiles, make sure to include 'Content-Encoding: gzip' in your webserver configuration for serving pbf files"  << std::endl;
+	if(config.compression.enabled()) 
+		std::cout << "When serving compressed tiles, make sure to include 'Content-Encoding: " << config.compression.name() << "' in your webserver configuration for serving pbf files"  << std::endl;
 
 	rapidjson::Document document;
 	document.SetObject();
@@ -223,7 +223,7 @@ std::string LayerDefinition::serialiseToJSON() const {
 // *****************************************************************
 
 Config::Config() {
-	includeID = false, compress = true, gzip = true, highResolution = false;
+	includeID = false, highResolution = false;
 	clippingBoxFromJSON = false;
 	baseZoom = 0;
 	combineBelow = 0;
@@ -240,18 +240,53 @@ void Config::enlargeBbox(double cMinLon, double cMaxLon, double cMinLat, double
 	maxLat = std::max(maxLat, cMaxLat);
 }
 
+// ----	Read tile compression settings
+//		"compress" and "compress_level" are either a single value, or an object
+//		with a value for each output format ("mbtiles", "pmtiles", "directory")
+
+void Config::readCompression(const rapidjson::Value &settings, OptionsParser::OutputMode outputMode) {
+	const char *format = outputMode == OptionsParser::OutputMode::MBTiles ? "mbtiles" :
+	                     outputMode == OptionsParser::OutputMode::PMTiles ? "pmtiles" : "directory";
+	auto forFormat = [&](const char *key) -> const rapidjson::Value* {
+		if (!settings.HasMember(key)) return nullptr;
+		const rapidjson::Value &v = settings[key];
+		if (!v.IsObject()) return &v;
+		return v.HasMember(format) ? &v[format] : nullptr;
+	};
+
+	const rapidjson::Value *codec = forFormat("compress");
+	const rapidjson::Value *level = forFormat("compress_level");
+	if ((codec && !codec->IsString()) || (level && !level->IsInt())) {
+		cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"zstd\",\"none\" in JSON file, and \"compress_level\" an integer." << endl;
+		exit (EXIT_FAILURE);
+	}
+
+	try {
+		compression = Compression::parse(codec ? codec->GetString() : "gzip", level ? level->GetInt() : Z_DEFAULT_COMPRESSION);
+	} catch (std::invalid_argument &e) {
+		cerr << "\"compress\" setting for " << format << " output: " << e.what() << endl;
+		exit (EXIT_FAILURE);
+	}
+
+	// check the output format can describe the codec
+	if (outputMode == OptionsParser::OutputMode::MBTiles && compression.codec == Compression::Codec::Zstd) {
+		cerr << "MBTiles tiles can only be compressed with \"gzip\" or \"deflate\"." << endl;
+		exit (EXIT_FAILURE);
+	}
+	if (outputMode == OptionsParser::OutputMode::PMTiles && compression.codec == Compression::Codec::Deflate) {
+		cerr << "PMTiles tiles can only be compressed with \"gzip\" or \"zstd\"." << endl;
+		exit (EXIT_FAILURE);
+	}
+}
+
 // ----	Read all config details from JSON file
 
-void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, Box &clippingBox)  {
+void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, Box &clippingBox, OptionsParser::OutputMode outputMode)  {
 	baseZoom       = jsonConfig["settings"]["basezoom"].GetUint();
 	startZoom      = jsonConfig["settings"]["minzoom" ].GetUint();
 	endZoom        = jsonConfig["settings"]["maxzoom" ].GetUint();
 	includeID      = jsonConfig["settings"]["include_ids"].GetBool();
 	highResolution = jsonConfig["settings"].HasMember("high_resolution") && jsonConfig["settings"]["high_resolution"].GetBool();
-	if (! jsonConfig["settings"]["compress"].IsString()) {
-		cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"none\" in JSON file." << endl;
-		exit (EXIT_FAILURE);
-	}
 	if (endZoom>15) {
 		cout << "**** WARNING ****" << endl;
 		cout << "You're generating tiles up to z" << endZoom << ". You probably don't want to do that." << endl;
@@ -260,7 +295,6 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 		cout << "**** WARNING ****" << endl;
 	}
 
-	compressOpt    = jsonConfig["settings"]["compress"].GetString();
 	combineBelow   = jsonConfig["settings"].HasMember("combine_below") ? jsonConfig["settings"]["combine_below"].GetUint() : 0;
 	mvtVersion     = jsonConfig["settings"].HasMember("mvt_version") ? jsonConfig["settings"]["mvt_version"].GetUint() : 2;
 	projectName    = jsonConfig["settings"]["name"].GetString();
@@ -289,15 +323,7 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 
 	// Check config is valid
 	if (endZoom > baseZoom) { cerr << "maxzoom must be the same or smaller than basezoom." << endl; exit (EXIT_FAILURE); }
-	if (! compressOpt.empty()) {
-		if      (compressOpt == "gzip"   ) { gzip = true;  }
-		else if (compressOpt == "deflate") { gzip = false; }
-		else if (compressOpt == "none"   ) { compress = false; }
-		else {
-			cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"none\" in JSON file." << endl;
-			exit (EXIT_FAILURE);
-		}
-	}
+	readCompression(jsonConfig["settings"], outputMode);
 
 	// Layers
 	rapidjson::Value& layerHash = jsonConfig["layers"];
@@ -81,6 +81,9 @@ void SortedNodeStore::reopen()
 	// the number used by OSM as of November 2023.
 	groups.clear();
 	groups.resize(256 * 1024);
+	groupSizes.clear();
+	groupSizes.resize(groups.size());
+	loaded.reset();
 }
 
 SortedNodeStore::~SortedNodeStore() {
@@ -488,6 +491,7 @@ void SortedNodeStore::publishGroup(const std::vector<element_t>& nodes) {
 	if (groups[groupIndex] != nullptr)
 		throw std::runtime_error("SortedNodeStore: group already present");
 	groups[groupIndex] = groupInfo;
+	groupSizes[groupIndex] = groupSpace;
 
 	lastChunk = -1;
 	uint8_t chunkMask[32], nodeMask[32];
@@ -616,3 +620,34 @@ void SortedNodeStore::publishGroup(const std::vector<element_t>& nodes) {
 	}
 	*/
 }
+
+bool SortedNodeStore::save(const std::string& filename, const std::string& stamp) const {
+	std::vector<SortedStoreFile::Group> saved;
+	for (size_t i = 0; i < groups.size(); i++)
+		if (groups[i] != nullptr)
+			saved.push_back({ i, (const char*)groups[i], groupSizes[i] });
+
+	return SortedStoreFile::save(filename, "nodes", stamp, { totalNodes.load(), totalChunks.load() }, saved);
+}
+
+bool SortedNodeStore::load(const std::string& filename, const std::string& stamp) {
+	std::unique_ptr<SortedStoreFile> file(new SortedStoreFile());
+	if (!file->load(filename, "nodes", stamp) || file->counts().size() != 2)
+		return false;
+	for (const SortedStoreFile::Group& group : file->groups())
+		if (group.index >= groups.size())
+			return false;
+
+	reopen();
+	// The groups are only read, so they can stay in the read-only mapping
+	for (const SortedStoreFile::Group& group : file->groups()) {
+		groups[group.index] = (GroupInfo*)group.data;
+		groupSizes[group.index] = group.size;
+	}
+	totalNodes = file->counts()[0];
+	totalChunks = file->counts()[1];
+	totalGroups = file->groups().size();
+	totalGroupSpace = file->bytes();
+	loaded = std::move(file);
+	return true;
+}
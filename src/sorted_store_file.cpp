@@ -0,0 +1,150 @@
+#include "sorted_store_file.h"
+#include "binary_file.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+
+// The file is:
+//   - "TMSTORE1", version, kind and stamp
+//   - the store's counts
+//   - each group's index, offset and size
+//   - "TMSTORE1" again
+//   - the groups, each starting on a 64-byte boundary
+
+using namespace BinaryFile;
+
+namespace {
+	const char storeMagic[] = "TMSTORE1";
+	const uint64_t GroupAlignment = 64;
+}
+
+std::string SortedStoreFile::stamp(const std::vector<std::string>& inputFiles, const std::string& options) {
+	std::ostringstream ss;
+	for (const std::string& inputFile : inputFiles) {
+		boost::system::error_code ec;
+		boost::filesystem::path path = boost::filesystem::canonical(inputFile, ec);
+		if (ec) path = inputFile;
+		uint64_t size = boost::filesystem::file_size(path, ec);
+		int64_t mtime = boost::filesystem::last_write_time(path, ec);
+		ss << path.string() << ":" << size << ":" << mtime << ";";
+	}
+	ss << options;
+	return ss.str();
+}
+
+bool SortedStoreFile::save(
+	const std::string& filename,
+	const std::string& kind,
+	const std::string& stamp,
+	const std::vector<uint64_t>& counts,
+	const std::vector<Group>& groups
+) {
+	// Write to a temporary file first, so another run never maps a partly-written store
+	std::string tmpFilename = filename + ".tmp";
+	{
+		std::ofstream out(tmpFilename, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!out) return false;
+
+		writeMagic(out, storeMagic);
+		write<uint32_t>(out, SORTED_STORE_FILE_VERSION);
+		writeString(out, kind);
+		writeString(out, stamp);
+
+		write<uint32_t>(out, counts.size());
+		for (uint64_t count : counts)
+			write<uint64_t>(out, count);
+
+		// The groups follow the table of contents
+		uint64_t offset =
+			(sizeof(storeMagic) - 1) * 2 + sizeof(uint32_t) +
+			sizeof(uint32_t) + kind.size() + sizeof(uint32_t) + stamp.size() +
+			sizeof(uint32_t) + counts.size() * sizeof(uint64_t) +
+			sizeof(uint64_t) + groups.size() * 3 * sizeof(uint64_t);
+		auto align = [](uint64_t offset) { return (offset + GroupAlignment - 1) / GroupAlignment * GroupAlignment; };
+
+		write<uint64_t>(out, groups.size());
+		uint64_t groupOffset = align(offset);
+		for (const Group& group : groups) {
+			write<uint64_t>(out, group.index);
+			write<uint64_t>(out, groupOffset);
+			write<uint64_t>(out, group.size);
+			groupOffset = align(groupOffset + group.size);
+		}
+		writeMagic(out, storeMagic);
+
+		const char padding[GroupAlignment] = {0};
+		for (const Group& group : groups) {
+			out.write(padding, align(offset) - offset);
+			offset = align(offset);
+			out.write(group.data, group.size);
+			offset += group.size;
+		}
+
+		out.close();
+		if (!out) {
+			boost::system::error_code ec;
+			boost::filesystem::remove(tmpFilename, ec);
+			return false;
+		}
+	}
+
+	boost::system::error_code ec;
+	boost::filesystem::rename(tmpFilename, filename, ec);
+	return !ec;
+}
+
+bool SortedStoreFile::load(const std::string& filename, const std::string& kind, const std::string& stamp) {
+	region.reset();
+	file.reset();
+	loadedCounts.clear();
+	loadedGroups.clear();
+
+	std::vector<uint64_t> offsets;
+	std::ifstream in(filename, std::ios::in | std::ios::binary);
+	if (!in) return false;
+
+	try {
+		if (!readMagic(in, storeMagic) || read<uint32_t>(in) != SORTED_STORE_FILE_VERSION) return false;
+		if (readString(in) != kind || readString(in) != stamp) return false;
+
+		for (uint32_t i = read<uint32_t>(in); i > 0; i--)
+			loadedCounts.push_back(read<uint64_t>(in));
+
+		uint64_t groups = read<uint64_t>(in);
+		if (groups > remaining(in) / (3 * sizeof(uint64_t))) throw std::runtime_error("corrupt");
+		for (uint64_t i = 0; i < groups; i++) {
+			Group group;
+			group.index = read<uint64_t>(in);
+			offsets.push_back(read<uint64_t>(in));
+			group.size = read<uint64_t>(in);
+			group.data = nullptr;
+			loadedGroups.push_back(group);
+		}
+		if (!readMagic(in, storeMagic)) throw std::runtime_error("corrupt");
+	} catch (std::runtime_error&) {
+		loadedCounts.clear();
+		loadedGroups.clear();
+		return false;
+	}
+	in.close();
+
+	boost::system::error_code ec;
+	uint64_t fileSize = boost::filesystem::file_size(filename, ec);
+	if (ec) return false;
+	for (size_t i = 0; i < loadedGroups.size(); i++) {
+		if (offsets[i] + loadedGroups[i].size > fileSize) {
+			loadedCounts.clear();
+			loadedGroups.clear();
+			return false;
+		}
+	}
+
+	using namespace boost::interprocess;
+	file.reset(new file_mapping(filename.c_str(), read_only));
+	region.reset(new mapped_region(*file, read_only));
+	const char* base = static_cast<const char*>(region->get_address());
+	for (size_t i = 0; i < loadedGroups.size(); i++)
+		loadedGroups[i].data = base + offsets[i];
+	return true;
+}
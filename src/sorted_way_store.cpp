@@ -54,6 +54,7 @@ namespace SortedWayStoreTypes {
 	thread_local uint32_t uint32Buffer[2000];
 	thread_local int32_t int32Buffer[2000];
 	thread_local uint8_t uint8Buffer[8192];
+	thread_local std::vector<NodeID> nodeBuffer;
 }
 
 using namespace SortedWayStoreTypes;
@@ -83,7 +84,9 @@ void SortedWayStore::reopen() {
 	// by OSM as of December 2023.
 	groups.clear();
 	groups.resize(32 * 1024);
-
+	groupSizes.clear();
+	groupSizes.resize(groups.size());
+	loaded.reset();
 }
 
 bool SortedWayStore::contains(size_t shard, WayID id) const {
@@ -135,7 +138,7 @@ bool SortedWayStore::contains(size_t shard, WayID id) const {
 	return true;
 }
 
-std::vector<LatpLon> SortedWayStore::at(WayID id) const {
+void SortedWayStore::at(WayID id, std::vector<LatpLon>& out) const {
 	const size_t groupIndex = id / (GroupSize * ChunkSize);
 	const size_t chunk = (id % (GroupSize * ChunkSize)) / ChunkSize;
 	const uint64_t chunkMaskByte = chunk / 8;
@@ -192,11 +195,11 @@ std::vector<LatpLon> SortedWayStore::at(WayID id) const {
 		wayPtr = (EncodedWay*)(endOfWayOffsetPtr + chunkPtr->wayOffsets[wayOffset] * LargeWayAlignment);
 	}
 
-	std::vector<NodeID> nodes = SortedWayStore::decodeWay(wayPtr->flags, wayPtr->data);
-	std::vector<LatpLon> rv;
-	for (const NodeID& node : nodes)
-		rv.push_back(nodeStore.at(node));
-	return rv;
+	SortedWayStore::decodeWay(wayPtr->flags, wayPtr->data, nodeBuffer);
+	out.clear();
+	out.reserve(nodeBuffer.size());
+	for (const NodeID& node : nodeBuffer)
+		out.push_back(nodeStore.at(node));
 }
 
 void SortedWayStore::insertLatpLons(std::vector<WayStore::ll_element_t> &newWays) {
@@ -316,6 +319,12 @@ void SortedWayStore::collectOrphans(const std::vector<std::pair<WayID, std::vect
 
 std::vector<NodeID> SortedWayStore::decodeWay(uint16_t flags, const uint8_t* input) {
 	std::vector<NodeID> rv;
+	decodeWay(flags, input, rv);
+	return rv;
+}
+
+void SortedWayStore::decodeWay(uint16_t flags, const uint8_t* input, std::vector<NodeID>& rv) {
+	rv.clear();
 
 	bool isCompressed = flags & CompressedWay;
 	bool isClosed = flags & ClosedWay;
@@ -366,7 +375,6 @@ std::vector<NodeID> SortedWayStore::decodeWay(uint16_t flags, const uint8_t* inp
 
 	if (isClosed)
 		rv.push_back(rv[0]);
-	return rv;
 };
 
 uint16_t SortedWayStore::encodeWay(const std::vector<NodeID>& way, std::vector<uint8_t>& output, bool compress) {
@@ -577,6 +585,7 @@ void SortedWayStore::publishGroup(const std::vector<std::pair<WayID, std::vector
 	if (groups[groupIndex] != nullptr)
 		throw std::runtime_error("SortedNodeStore: group already present");
 	groups[groupIndex] = groupInfo;
+	groupSizes[groupIndex] = groupSpace;
 
 	// 3. populate the masks and offsets
 	std::vector<uint8_t> chunkIds;
@@ -651,3 +660,35 @@ void SortedWayStore::publishGroup(const std::vector<std::pair<WayID, std::vector
 		chunkPtr = (ChunkInfo*)wayStartPtr;
 	}
 }
+
+bool SortedWayStore::save(const std::string& filename, const std::string& stamp) const {
+	std::vector<SortedStoreFile::Group> saved;
+	for (size_t i = 0; i < groups.size(); i++)
+		if (groups[i] != nullptr)
+			saved.push_back({ i, (const char*)groups[i], groupSizes[i] });
+
+	return SortedStoreFile::save(filename, "ways", stamp, { totalWays.load(), totalNodes.load(), totalChunks.load() }, saved);
+}
+
+bool SortedWayStore::load(const std::string& filename, const std::string& stamp) {
+	std::unique_ptr<SortedStoreFile> file(new SortedStoreFile());
+	if (!file->load(filename, "ways", stamp) || file->counts().size() != 3)
+		return false;
+	for (const SortedStoreFile::Group& group : file->groups())
+		if (group.index >= groups.size())
+			return false;
+
+	reopen();
+	// The groups are only read, so they can stay in the read-only mapping
+	for (const SortedStoreFile::Group& group : file->groups()) {
+		groups[group.index] = (GroupInfo*)group.data;
+		groupSizes[group.index] = group.size;
+	}
+	totalWays = file->counts()[0];
+	totalNodes = file->counts()[1];
+	totalChunks = file->counts()[2];
+	totalGroups = file->groups().size();
+	totalGroupSpace = file->bytes();
+	loaded = std::move(file);
+	return true;
+}
@@ -22,6 +22,8 @@ TileDataSource::TileDataSource(size_t threadNum, unsigned int indexZoom, bool in
 	lowZoomObjects(CLUSTER_ZOOM_AREA),
 	objectsWithIds(CLUSTER_ZOOM_AREA),
 	lowZoomObjectsWithIds(CLUSTER_ZOOM_AREA),
+	finalizedObjects(CLUSTER_ZOOM_AREA),
+	finalizedObjectsWithIds(CLUSTER_ZOOM_AREA),
 	indexZoom(indexZoom),
 	pointStores(threadNum),
 	linestringStores(threadNum),
@@ -55,17 +57,19 @@ thread_local std::vector<std::tuple<TileCoordinates, OutputObject, uint64_t>>* t
 
 void TileDataSource::finalize(size_t threadNum) {
 	uint64_t finalized = 0;
-	for (const auto& vec : pendingSmallIndexObjects) {
+	for (auto& vec : pendingSmallIndexObjects) {
 		for (const auto& tuple : vec) {
 			finalized++;
 			addObjectToSmallIndexUnsafe(std::get<0>(tuple), std::get<1>(tuple), std::get<2>(tuple));
 		}
+		// Free the memory, but keep the vector, as a thread may still point to it
+		std::vector<std::tuple<TileCoordinates, OutputObject, uint64_t>>().swap(vec);
 	}
 
 	std::cout << "indexed " << finalized << " contended objects" << std::endl;
 
-	finalizeObjects<OutputObjectXY>(name(), threadNum, indexZoom, objects.begin(), objects.end(), lowZoomObjects);
-	finalizeObjects<OutputObjectXYID>(name(), threadNum, indexZoom, objectsWithIds.begin(), objectsWithIds.end(), lowZoomObjectsWithIds);
+	finalizeObjects<OutputObjectXY>(name(), threadNum, indexZoom, objects.begin(), objects.end(), lowZoomObjects, finalizedObjects);
+	finalizeObjects<OutputObjectXYID>(name(), threadNum, indexZoom, objectsWithIds.begin(), objectsWithIds.end(), lowZoomObjectsWithIds, finalizedObjectsWithIds);
 }
 
 void TileDataSource::addObjectToSmallIndex(const TileCoordinates& index, const OutputObject& oo, uint64_t id) {
@@ -119,8 +123,8 @@ void TileDataSource::addObjectToSmallIndexUnsafe(const TileCoordinates& index, c
 
 void TileDataSource::collectTilesWithObjectsAtZoom(std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms) {
 	// Scan through all shards. Convert to base zoom, then convert to the requested zoom.
-	collectTilesWithObjectsAtZoomTemplate<OutputObjectXY>(indexZoom, objects.begin(), objects.size(), zooms);
-	collectTilesWithObjectsAtZoomTemplate<OutputObjectXYID>(indexZoom, objectsWithIds.begin(), objectsWithIds.size(), zooms);
+	collectTilesWithObjectsAtZoomTemplate(indexZoom, finalizedObjects, zooms);
+	collectTilesWithObjectsAtZoomTemplate(indexZoom, finalizedObjectsWithIds, zooms);
 }
 
 void addCoveredTilesToOutput(const uint indexZoom, std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms, const Box& box) {
@@ -166,7 +170,7 @@ void TileDataSource::collectObjectsForTile(
 	}
 
 	size_t iStart = 0;
-	size_t iEnd = objects.size();
+	size_t iEnd = finalizedObjects.size();
 
 	if (zoom >= CLUSTER_ZOOM) {
 		TileCoordinate z6x = dstIndex.x / (1 << (zoom - CLUSTER_ZOOM));
@@ -180,8 +184,8 @@ void TileDataSource::collectObjectsForTile(
 		iEnd = iStart + 1;
 	}
 
-	collectObjectsForTileTemplate<OutputObjectXY>(indexZoom, objects.begin(), iStart, iEnd, zoom, dstIndex, output);
-	collectObjectsForTileTemplate<OutputObjectXYID>(indexZoom, objectsWithIds.begin(), iStart, iEnd, zoom, dstIndex, output);
+	collectObjectsForTileTemplate(indexZoom, finalizedObjects, iStart, iEnd, zoom, dstIndex, output);
+	collectObjectsForTileTemplate(indexZoom, finalizedObjectsWithIds, iStart, iEnd, zoom, dstIndex, output);
 }
 
 // Copy objects from the large index into output
@@ -0,0 +1,207 @@
+#include "tile_scheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+// ----	Cost model
+
+uint64_t TileCostModel::key(unsigned int zoom, TileCoordinates index) {
+	return (static_cast<uint64_t>(zoom) << 58) | (static_cast<uint64_t>(index.x) << 29) | index.y;
+}
+
+unsigned int TileCostModel::slot(unsigned int zoom) {
+	return std::min(zoom, static_cast<unsigned int>(TILE_SCHEDULER_MAX_ZOOM));
+}
+
+// Before we've measured anything: lower-zoom tiles are more expensive
+double TileCostModel::defaultCost(unsigned int zoom) {
+	if (zoom > 12) return 1e6;
+	if (zoom > 11) return 1e7;
+	if (zoom > 10) return 1e8;
+	return 1e9;
+}
+
+bool TileCostModel::recordObjects(unsigned int zoom, TileCoordinates index, size_t objects) {
+	std::lock_guard<std::mutex> lock(mutex);
+	ZoomTotals &t = totals[slot(zoom)];
+	bool isExpensive = t.objectTiles >= TILE_SCHEDULER_MIN_SAMPLES &&
+		objects * t.objectTiles > TILE_SCHEDULER_EXPENSIVE_FACTOR * t.objects;
+	t.objectTiles++;
+	t.objects += objects;
+	if (isExpensive) expensive[key(zoom, index)].objects = objects;
+	return isExpensive;
+}
+
+bool TileCostModel::recordTime(unsigned int zoom, TileCoordinates index, uint64_t ns) {
+	std::lock_guard<std::mutex> lock(mutex);
+	ZoomTotals &t = totals[slot(zoom)];
+	bool isExpensive = ns > TILE_SCHEDULER_EXPENSIVE_NS || (t.tiles >= TILE_SCHEDULER_MIN_SAMPLES &&
+		ns * t.tiles > TILE_SCHEDULER_EXPENSIVE_FACTOR * t.ns);
+	t.tiles++;
+	t.ns += ns;
+
+	// learn how a child's time relates to its (expensive) parent's
+	if (zoom > 0) {
+		auto parent = expensive.find(key(zoom-1, TileCoordinates(index.x/2, index.y/2)));
+		if (parent != expensive.end() && parent->second.ns > 0) {
+			t.childNs += ns;
+			t.parentNs += parent->second.ns;
+		}
+	}
+
+	auto it = expensive.find(key(zoom, index));
+	if (isExpensive || it != expensive.end()) expensive[key(zoom, index)].ns = ns;
+	return isExpensive;
+}
+
+double TileCostModel::estimate(unsigned int zoom, TileCoordinates index) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	const ZoomTotals &t = totals[slot(zoom)];
+	double mean = t.tiles > 0 ? static_cast<double>(t.ns) / t.tiles : defaultCost(zoom);
+	if (zoom == 0) return mean;
+
+	auto parent = expensive.find(key(zoom-1, TileCoordinates(index.x/2, index.y/2)));
+	if (parent == expensive.end()) return mean;
+
+	// a child covers a quarter of its parent, until we've learned better
+	double estimate = 0;
+	if (parent->second.ns > 0) {
+		double ratio = t.parentNs > 0 ? static_cast<double>(t.childNs) / t.parentNs : 0.25;
+		estimate = parent->second.ns * ratio;
+	}
+	if (parent->second.objects > 0 && t.objects > 0) {
+		double nsPerObject = mean * t.objectTiles / t.objects;
+		estimate = std::max(estimate, parent->second.objects * 0.25 * nsPerObject);
+	}
+	return std::max(estimate, mean);
+}
+
+// ----	Scheduler
+
+TileScheduler::TileScheduler(
+	const std::deque<ZoomedTileCoordinates> &tiles,
+	std::function<bool(const ZoomedTileCoordinates&, const ZoomedTileCoordinates&)> order,
+	unsigned int numWorkers
+): tiles(tiles), order(order),
+	claimed(new std::atomic<bool>[tiles.size()]()),
+	childrenPromoted(new std::atomic<bool>[tiles.size()]()),
+	numSteals(0), numStolen(0), numPromoted(0) {
+
+	// give each worker an equal, contiguous share to start with
+	numWorkers = std::max(numWorkers, 1u);
+	size_t share = (tiles.size() + numWorkers - 1) / numWorkers;
+	for (unsigned int w = 0; w < numWorkers; w++) {
+		ranges.emplace_back(new Range());
+		ranges.back()->front = std::min(tiles.size(), w * share);
+		ranges.back()->back  = std::min(tiles.size(), (w + 1) * share);
+	}
+}
+
+void TileScheduler::work(unsigned int workerId, std::function<void(size_t)> process) {
+	Range &own = *ranges[workerId];
+	while (true) {
+		size_t i;
+		if (!nextPromoted(i) && !nextOwn(own, i)) {
+			if (steal(workerId)) continue;
+			return; // every tile has been claimed
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		process(i);
+		uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		if (costs.recordTime(tiles[i].first, tiles[i].second, ns)) promoteChildren(i);
+	}
+}
+
+void TileScheduler::tileObjects(size_t i, size_t objects) {
+	if (costs.recordObjects(tiles[i].first, tiles[i].second, objects)) promoteChildren(i);
+}
+
+bool TileScheduler::claim(size_t i) {
+	return !claimed[i].exchange(true);
+}
+
+bool TileScheduler::nextPromoted(size_t &i) {
+	std::lock_guard<std::mutex> lock(promotedMutex);
+	while (!promoted.empty()) {
+		std::pop_heap(promoted.begin(), promoted.end());
+		i = promoted.back().second;
+		promoted.pop_back();
+		if (claim(i)) return true;
+	}
+	return false;
+}
+
+bool TileScheduler::nextOwn(Range &range, size_t &i) {
+	std::lock_guard<std::mutex> lock(range.mutex);
+	while (range.front < range.back) {
+		i = range.front++;
+		if (claim(i)) return true;
+	}
+	return false;
+}
+
+// Take the back half of the largest remaining range.
+// Returns false if there's nothing left anywhere.
+bool TileScheduler::steal(unsigned int workerId) {
+	while (true) {
+		size_t victim = 0, largest = 0;
+		for (size_t w = 0; w < ranges.size(); w++) {
+			std::lock_guard<std::mutex> lock(ranges[w]->mutex);
+			size_t remaining = ranges[w]->back - ranges[w]->front;
+			if (remaining > largest) { largest = remaining; victim = w; }
+		}
+		if (largest == 0) return false;
+
+		size_t front, back;
+		{
+			Range &v = *ranges[victim];
+			std::lock_guard<std::mutex> lock(v.mutex);
+			if (v.back == v.front) continue; // someone got there first
+			back = v.back;
+			front = v.front + (v.back - v.front) / 2;
+			v.back = front;
+		}
+		{
+			Range &own = *ranges[workerId];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			own.front = front;
+			own.back = back;
+		}
+		numSteals++;
+		numStolen += back - front;
+		return true;
+	}
+}
+
+// Queue tile i's children ahead of everything else
+void TileScheduler::promoteChildren(size_t i) {
+	if (childrenPromoted[i].exchange(true)) return;
+	unsigned int zoom = tiles[i].first + 1;
+	TileCoordinates parent = tiles[i].second;
+
+	std::vector<std::pair<double, size_t>> children;
+	for (TileCoordinate dx = 0; dx < 2; dx++) {
+		for (TileCoordinate dy = 0; dy < 2; dy++) {
+			ZoomedTileCoordinates child(zoom, TileCoordinates(parent.x * 2 + dx, parent.y * 2 + dy));
+			auto it = std::lower_bound(tiles.begin(), tiles.end(), child, order);
+			if (it == tiles.end() || it->first != child.first || !(it->second == child.second)) continue;
+			size_t c = it - tiles.begin();
+			if (claimed[c]) continue;
+			children.emplace_back(costs.estimate(child.first, child.second), c);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(promotedMutex);
+	for (const auto &child : children) {
+		promoted.push_back(child);
+		std::push_heap(promoted.begin(), promoted.end());
+		numPromoted++;
+	}
+}
+
+std::string TileScheduler::stats() const {
+	std::ostringstream ss;
+	ss << numSteals << " steals (" << numStolen << " tiles), " << numPromoted << " tiles promoted";
+	return ss.str();
+}
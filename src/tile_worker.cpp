@@ -485,7 +485,7 @@ void outputProc(
 	// Read existing tile if merging
 	std::string rawExistingTile;
 	if (sharedData.mergeSqlite) {
-		sharedData.mbtiles.readTileAndUncompress(rawExistingTile, zoom, bbox.index.x, bbox.index.y, sharedData.config.compress, sharedData.config.gzip);
+		sharedData.mbtiles.readTileAndUncompress(rawExistingTile, zoom, bbox.index.x, bbox.index.y, sharedData.config.compression);
 	}
 	vtzero::vector_tile existingTile{rawExistingTile};
 
@@ -504,18 +504,30 @@ void outputProc(
 	}
 
 	// Write to file or sqlite
-	string outputdata, compressed;
+	// (serialize and compress into per-thread buffers, so a steady state needs no new allocations;
+	// a buffer handed to the MBTiles writer is replaced with one it has finished with, and
+	// PMTiles compresses into its writer's spent buffers in the same way)
+	thread_local std::string outputdata, compressed;
+	outputdata.clear();
+	tile.serialize(outputdata);
+
 	if (sharedData.outputMode == OptionsParser::OutputMode::MBTiles) {
 		// Write to sqlite
-		//tile.SerializeToString(&outputdata);
-		tile.serialize(outputdata);
-
-		if (sharedData.config.compress) { compressed = compress_string(outputdata, Z_DEFAULT_COMPRESSION, sharedData.config.gzip); }
-		sharedData.mbtiles.saveTile(zoom, bbox.index.x, bbox.index.y, sharedData.config.compress ? &compressed : &outputdata, sharedData.mergeSqlite);
+		// Identical tiles (e.g. sea) are only compressed and stored once
+		Hash128 hash = hash128(outputdata);
+		if (!sharedData.mbtiles.isNewTileData(hash)) {
+			sharedData.mbtiles.saveDuplicateTile(zoom, bbox.index.x, bbox.index.y, sharedData.mergeSqlite, hash);
+		} else if (sharedData.config.compression.enabled()) {
+			compress_string(compressed, outputdata, sharedData.config.compression);
+			sharedData.mbtiles.saveTile(zoom, bbox.index.x, bbox.index.y, std::move(compressed), sharedData.mergeSqlite, hash);
+			compressed = sharedData.mbtiles.spareBuffer();
+		} else {
+			sharedData.mbtiles.saveTile(zoom, bbox.index.x, bbox.index.y, std::move(outputdata), sharedData.mergeSqlite, hash);
+			outputdata = sharedData.mbtiles.spareBuffer();
+		}
 
 	} else if (sharedData.outputMode == OptionsParser::OutputMode::PMTiles) {
 		// Write to pmtiles
-		tile.serialize(outputdata);
 		sharedData.pmtiles.saveTile(zoom, bbox.index.x, bbox.index.y, outputdata);
 
 	} else {
@@ -525,13 +537,11 @@ void outputProc(
 		filename << sharedData.outputFile << "/" << zoom << "/" << bbox.index.x << "/" << bbox.index.y << ".pbf";
 		boost::filesystem::create_directories(dirname.str());
 		fstream outfile(filename.str(), ios::out | ios::trunc | ios::binary);
-		if (sharedData.config.compress) {
-			//tile.SerializeToString(&outputdata);
-			tile.serialize(outputdata);
-			outfile << compress_string(outputdata, Z_DEFAULT_COMPRESSION, sharedData.config.gzip);
+		if (sharedData.config.compression.enabled()) {
+			compress_string(compressed, outputdata, sharedData.config.compression);
+			outfile.write(compressed.data(), compressed.size());
 		} else {
-			tile.serialize(outputdata);
-			outfile << outputdata;
+			outfile.write(outputdata.data(), outputdata.size());
 		}
 		outfile.close();
 	}
@@ -37,6 +37,7 @@
 #include "geom.h"
 #include "node_stores.h"
 #include "way_stores.h"
+#include "external_sort_stores.h"
 
 // Tilemaker code
 #include "helpers.h"
@@ -48,6 +49,7 @@
 #include "output_object.h"
 #include "osm_lua_processing.h"
 #include "mbtiles.h"
+#include "memory_placement.h"
 
 #include "options_parser.h"
 #include "shared_data.h"
@@ -55,6 +57,7 @@
 #include "geojson_processor.h"
 #include "shp_processor.h"
 #include "tile_worker.h"
+#include "tile_scheduler.h"
 #include "osm_mem_tiles.h"
 #include "shp_mem_tiles.h"
 
@@ -102,6 +105,20 @@ int main(const int argc, const char* argv[]) {
 
 	verbose = options.verbose;
 
+	// ----	Choose where memory and threads go, before the stores allocate anything
+
+	try {
+		MemoryPlacement::configure(
+			MemoryPlacement::parseHugePages(options.osm.hugePages),
+			MemoryPlacement::parseNuma(options.osm.numa),
+			options.pinThreads
+		);
+	} catch (std::invalid_argument& e) {
+		cerr << e.what() << endl;
+		return -1;
+	}
+	MemoryPlacement::report(cout);
+
 	vector<string> bboxElements = parseBox(options.bbox);
 
 	// ---- Remove existing .mbtiles if it exists
@@ -117,6 +134,9 @@ int main(const int argc, const char* argv[]) {
 	} else if (options.mergeSqlite && options.outputMode != OptionsParser::OutputMode::MBTiles) {
 		cerr << "--merge only works with .mbtiles" << endl;
 		return 0;
+	} else if (options.clustered && options.outputMode != OptionsParser::OutputMode::PMTiles) {
+		cerr << "--clustered only works with .pmtiles" << endl;
+		return 0;
 	} else if (options.mergeSqlite && !static_cast<bool>(std::ifstream(options.outputFile))) {
 		cout << "--merge specified but .mbtiles file doesn't already exist, ignoring" << endl;
 		options.mergeSqlite = false;
@@ -172,7 +192,7 @@ int main(const int argc, const char* argv[]) {
 		if (jsonConfig.HasParseError()) { cerr << "Invalid JSON file." << endl; return -1; }
 		fclose(fp);
 
-		config.readConfig(jsonConfig, hasClippingBox, clippingBox);
+		config.readConfig(jsonConfig, hasClippingBox, clippingBox, options.outputMode);
 	} catch (...) {
 		cerr << "Couldn't find expected details in JSON file." << endl;
 		return -1;
@@ -193,14 +213,37 @@ int main(const int argc, const char* argv[]) {
 		}
 	}
 
-	auto createNodeStore = [allPbfsHaveSortTypeThenID, options]() {
+	// --external-sort sorts nodes and ways on the way in, so any input can
+	// use the sorted stores. Its runs, and --flat-nodes' file, go beside the
+	// --store, or in a temp directory.
+	const bool externalSort = options.osm.externalSortMB > 0;
+	const std::string storeDirectory = options.osm.storeFile.empty() ? boost::filesystem::temp_directory_path().string() : options.osm.storeFile;
+	const size_t sortBufferBytes = options.osm.externalSortMB * 1048576ull / options.threadNum;
+
+	// --reuse-stores needs the sorted stores themselves, to save and load them
+	std::shared_ptr<SortedNodeStore> sortedNodeStore;
+	std::shared_ptr<SortedWayStore> sortedWayStore;
+
+	auto createNodeStore = [allPbfsHaveSortTypeThenID, externalSort, storeDirectory, sortBufferBytes, options, &sortedNodeStore]() {
 		if (options.osm.compact) {
 			std::shared_ptr<NodeStore> rv = make_shared<CompactNodeStore>();
 			return rv;
 		}
 
+		if (options.osm.flatNodes) {
+			std::shared_ptr<NodeStore> rv = make_shared<FlatNodeStore>(storeDirectory);
+			return rv;
+		}
+
+		if (externalSort) {
+			sortedNodeStore = make_shared<SortedNodeStore>(!options.osm.uncompressedNodes);
+			std::shared_ptr<NodeStore> rv = make_shared<ExternalSortNodeStore>(sortedNodeStore, storeDirectory, sortBufferBytes);
+			return rv;
+		}
+
 		if (options.inputFiles.size() == 1 && allPbfsHaveSortTypeThenID) {
-			std::shared_ptr<NodeStore> rv = make_shared<SortedNodeStore>(!options.osm.uncompressedNodes);
+			sortedNodeStore = make_shared<SortedNodeStore>(!options.osm.uncompressedNodes);
+			std::shared_ptr<NodeStore> rv = sortedNodeStore;
 			return rv;
 		}
 		std::shared_ptr<NodeStore> rv =  make_shared<BinarySearchNodeStore>();
@@ -217,9 +260,16 @@ int main(const int argc, const char* argv[]) {
 		nodeStore = createNodeStore();
 	}
 
-	auto createWayStore = [anyPbfHasLocationsOnWays, allPbfsHaveSortTypeThenID, options, &nodeStore]() {
+	auto createWayStore = [anyPbfHasLocationsOnWays, allPbfsHaveSortTypeThenID, externalSort, storeDirectory, sortBufferBytes, options, &nodeStore, &sortedWayStore]() {
+		if (externalSort && !anyPbfHasLocationsOnWays) {
+			sortedWayStore = make_shared<SortedWayStore>(!options.osm.uncompressedWays, *nodeStore.get());
+			std::shared_ptr<WayStore> rv = make_shared<ExternalSortWayStore>(sortedWayStore, storeDirectory, sortBufferBytes);
+			return rv;
+		}
+
 		if (options.inputFiles.size() == 1 && !anyPbfHasLocationsOnWays && allPbfsHaveSortTypeThenID) {
-			std::shared_ptr<WayStore> rv = make_shared<SortedWayStore>(!options.osm.uncompressedWays, *nodeStore.get());
+			sortedWayStore = make_shared<SortedWayStore>(!options.osm.uncompressedWays, *nodeStore.get());
+			std::shared_ptr<WayStore> rv = sortedWayStore;
 			return rv;
 		}
 
@@ -287,28 +337,64 @@ int main(const int argc, const char* argv[]) {
 	// ----	Read all PBFs
 	
 	PbfProcessor pbfProcessor(osmStore);
+	if (options.osm.blockCacheMB > 0) {
+		try {
+			// Cached blocks are decompressed often, so favour speed
+			pbfProcessor.enableBlockCache(options.osm.blockCacheMB * 1048576ull, Compression::parse(options.osm.blockCacheCompress, 1));
+		} catch (std::invalid_argument& e) {
+			cerr << "--block-cache-compress: " << e.what() << endl;
+			return -1;
+		}
+	}
+	if (options.osm.decodeThreads > 0)
+		pbfProcessor.enablePipeline(options.osm.decodeThreads);
+	if (options.osm.spillWays)
+		pbfProcessor.enableWaySpill(storeDirectory);
+
+	// --reuse-stores maps the stores saved by an earlier run on the same input,
+	// or saves them for the next run
+	const std::string nodeStoreFilename = (boost::filesystem::path(options.osm.storeFile) / "nodes.tmstore").string();
+	const std::string wayStoreFilename = (boost::filesystem::path(options.osm.storeFile) / "ways.tmstore").string();
+	const std::string storeStamp = options.osm.reuseStores ? SortedStoreFile::stamp(options.inputFiles, options.osm.skipIntegrity ? "skip-integrity" : "") : "";
+	bool nodesLoaded = false, waysLoaded = false;
+	if (options.osm.reuseStores) {
+		if (!sortedNodeStore || !sortedWayStore) {
+			cerr << "--reuse-stores needs the sorted node and way stores (a sorted .pbf without locations on ways, or --external-sort), so stores won't be reused" << endl;
+		} else {
+			nodesLoaded = sortedNodeStore->load(nodeStoreFilename, storeStamp);
+			// Ways refer to nodes, so only reuse them alongside the nodes they were built with
+			waysLoaded = nodesLoaded && sortedWayStore->load(wayStoreFilename, storeStamp);
+			if (nodesLoaded) cout << "Reusing node store " << nodeStoreFilename << endl;
+			if (waysLoaded) cout << "Reusing way store " << wayStoreFilename << endl;
+
+			// Keep every node and way, so the saved stores suit any profile
+			pbfProcessor.storeAllObjects();
+			pbfProcessor.useLoadedStores(nodesLoaded, waysLoaded);
+		}
+	}
+
 	std::vector<bool> sortOrders = layers.getSortOrders();
 
+	std::vector<std::unique_ptr<PbfReader::MappedPbf>> pbfs;
+	std::vector<const PbfReader::MappedPbf*> inputs;
 	for (auto inputFile : options.inputFiles) {
 		cout << "Reading .pbf " << inputFile << endl;
 		ifstream infile(inputFile, ios::in | ios::binary);
 		if (!infile) { cerr << "Couldn't open .pbf file " << inputFile << endl; return -1; }
-		
-		const bool hasSortTypeThenID = PbfHasOptionalFeature(inputFile, OptionSortTypeThenID);
-		int ret = pbfProcessor.ReadPbfFile(
+		infile.close();
+
+		pbfs.emplace_back(new PbfReader::MappedPbf(inputFile));
+		inputs.push_back(pbfs.back().get());
+	}
+	if (!inputs.empty()) {
+		int ret = pbfProcessor.ReadPbfFiles(
 			nodeStore->shards(),
-			hasSortTypeThenID,
 			significantNodeTags,
 			significantWayTags,
 			options.threadNum,
-			[&]() {
-				thread_local std::pair<std::string, std::shared_ptr<ifstream>> pbfStream;
-				if (pbfStream.first != inputFile) {
-					pbfStream = std::make_pair(inputFile, std::make_shared<ifstream>(inputFile, ios::in | ios::binary));
-				}
-				return pbfStream.second;
-			},
-			[&]() {
+			inputs,
+			options.osm.pbfIndex,
+			[&](const std::string& inputFile) {
 				thread_local std::pair<std::string, std::shared_ptr<OsmLuaProcessing>> osmLuaProcessing;
 				if (osmLuaProcessing.first != inputFile) {
 					osmLuaProcessing = std::make_pair(inputFile, std::make_shared<OsmLuaProcessing>(osmStore, config, layers, options.luaFile, shpMemTiles, osmMemTiles, attributeStore, options.osm.materializeGeometries));
@@ -319,7 +405,15 @@ int main(const int argc, const char* argv[]) {
 			*wayStore
 		);
 		if (ret != 0) return ret;
-	} 
+		osmStore.clearScanData();
+
+		if (options.osm.reuseStores && sortedNodeStore && sortedWayStore) {
+			if (!nodesLoaded && !sortedNodeStore->save(nodeStoreFilename, storeStamp))
+				cerr << "Couldn't save node store " << nodeStoreFilename << endl;
+			if (!waysLoaded && !sortedWayStore->save(wayStoreFilename, storeStamp))
+				cerr << "Couldn't save way store " << wayStoreFilename << endl;
+		}
+	}
 	attributeStore.finalize();
 	osmMemTiles.reportSize();
 	attributeStore.reportSize();
@@ -335,9 +429,11 @@ int main(const int argc, const char* argv[]) {
 	// ----	Initialise mbtiles/pmtiles if required
 	
 	if (sharedData.outputMode == OptionsParser::OutputMode::MBTiles) {
-		sharedData.mbtiles.openForWriting(sharedData.outputFile);
+		sharedData.mbtiles.openForWriting(sharedData.outputFile, sharedData.mergeSqlite);
 		sharedData.writeMBTilesProjectData();
 	} else if (sharedData.outputMode == OptionsParser::OutputMode::PMTiles) {
+		sharedData.pmtiles.isClustered = options.clustered;
+		sharedData.pmtiles.compression = config.compression;
 		sharedData.pmtiles.open(sharedData.outputFile);
 	}
 
@@ -355,6 +451,10 @@ int main(const int argc, const char* argv[]) {
 	for (auto source : sources) {
 		source->finalize(options.threadNum);
 	}
+
+	// Release what reading needed, so tile writing has more room
+	void_mmap_allocator::beginPhase("tiles");
+	void_mmap_allocator::reportArenas(std::cout);
 	// tiles by zoom level
 
 	// The clipping bbox check is expensive - as an optimization, compute the set of
@@ -374,12 +474,13 @@ int main(const int argc, const char* argv[]) {
 	}
 
 	// For large areas (arbitrarily defined as 100 z6 tiles), use a dense index for pmtiles
-	if (coveredZ6Tiles.size()>100 && options.outputMode == OptionsParser::OutputMode::PMTiles) {
+	// (clustered .pmtiles build their index as they go, so don't need either)
+	if (coveredZ6Tiles.size()>100 && options.outputMode == OptionsParser::OutputMode::PMTiles && !options.clustered) {
 		std::cout << "Using dense index for .pmtiles" << std::endl;
 		sharedData.pmtiles.isSparse = false;
 	}
 
-	std::deque<std::pair<unsigned int, TileCoordinates>> tileCoordinates;
+	std::deque<ZoomedTileCoordinates> tileCoordinates;
 	std::vector<std::shared_ptr<TileCoordinatesSet>> zoomResults;
 	zoomResults.reserve(sharedData.config.endZoom + 1);
 
@@ -453,136 +554,165 @@ int main(const int argc, const char* argv[]) {
 	std::cout << std::endl;
 
 	// Cluster tiles: breadth-first for z0..z5, depth-first for z6
+	// (or, for clustered .pmtiles, in the order they'll be written)
 	const size_t baseZoom = config.baseZoom;
-	boost::sort::block_indirect_sort(
-		tileCoordinates.begin(), tileCoordinates.end(), 
-		[baseZoom](auto const &a, auto const &b) {
-			const auto aZoom = a.first;
-			const auto bZoom = b.first;
-			const auto aX = a.second.x;
-			const auto aY = a.second.y;
-			const auto bX = b.second.x;
-			const auto bY = b.second.y;
-			const bool aLowZoom = aZoom < CLUSTER_ZOOM;
-			const bool bLowZoom = bZoom < CLUSTER_ZOOM;
-
-			// Breadth-first for z0..5
-			if (aLowZoom != bLowZoom)
-				return aLowZoom;
-
-			if (aLowZoom && bLowZoom) {
-				if (aZoom != bZoom)
-					return aZoom < bZoom;
-
-				if (aX != bX)
-					return aX < bX;
-
-				return aY < bY;
-			}
-
-			for (size_t z = CLUSTER_ZOOM; z <= baseZoom; z++) {
-				// Translate both a and b to zoom z, compare.
-				// First, sanity check: can we translate it to this zoom?
-				if (aZoom < z || bZoom < z) {
-					return aZoom < bZoom;
-				}
+	auto tileOrder = [baseZoom](ZoomedTileCoordinates const &a, ZoomedTileCoordinates const &b) {
+		const auto aZoom = a.first;
+		const auto bZoom = b.first;
+		const auto aX = a.second.x;
+		const auto aY = a.second.y;
+		const auto bX = b.second.x;
+		const auto bY = b.second.y;
+		const bool aLowZoom = aZoom < CLUSTER_ZOOM;
+		const bool bLowZoom = bZoom < CLUSTER_ZOOM;
+
+		// Breadth-first for z0..5
+		if (aLowZoom != bLowZoom)
+			return aLowZoom;
+
+		if (aLowZoom && bLowZoom) {
+			if (aZoom != bZoom)
+				return aZoom < bZoom;
+
+			if (aX != bX)
+				return aX < bX;
+
+			return aY < bY;
+		}
 
-				const auto aXz = aX / (1 << (aZoom - z));
-				const auto aYz = aY / (1 << (aZoom - z));
-				const auto bXz = bX / (1 << (bZoom - z));
-				const auto bYz = bY / (1 << (bZoom - z));
+		for (size_t z = CLUSTER_ZOOM; z <= baseZoom; z++) {
+			// Translate both a and b to zoom z, compare.
+			// First, sanity check: can we translate it to this zoom?
+			if (aZoom < z || bZoom < z) {
+				return aZoom < bZoom;
+			}
 
-				if (aXz != bXz)
-					return aXz < bXz;
+			const auto aXz = aX / (1 << (aZoom - z));
+			const auto aYz = aY / (1 << (aZoom - z));
+			const auto bXz = bX / (1 << (bZoom - z));
+			const auto bYz = bY / (1 << (bZoom - z));
 
-				if (aYz != bYz)
-					return aYz < bYz;
-			}
+			if (aXz != bXz)
+				return aXz < bXz;
 
-			return false;
-		}, 
-		options.threadNum);
-
-	std::size_t batchSize = 0;
-	for(std::size_t startIndex = 0; startIndex < tileCoordinates.size(); startIndex += batchSize) {
-		// Compute how many tiles should be assigned to this batch --
-		// higher-zoom tiles are cheaper to compute, lower-zoom tiles more expensive.
-		batchSize = 0;
-		size_t weight = 0;
-		while (weight < 1000 && startIndex + batchSize < tileCoordinates.size()) {
-			const auto& zoom = tileCoordinates[startIndex + batchSize].first;
-			if (zoom > 12)
-				weight++;
-			else if (zoom > 11)
-				weight += 10;
-			else if (zoom > 10)
-				weight += 100;
-			else
-				weight += 1000;
-
-			batchSize++;
+			if (aYz != bYz)
+				return aYz < bYz;
 		}
 
-		boost::asio::post(pool, [=, &tileCoordinates, &pool, &sharedData, &sources, &attributeStore, &io_mutex, &tilesWritten, &lastTilesWritten]() {
-			std::vector<std::string> tileTimings;
-			std::size_t endIndex = std::min(tileCoordinates.size(), startIndex + batchSize);
-			for(std::size_t i = startIndex; i < endIndex; ++i) {
-				unsigned int zoom = tileCoordinates[i].first;
-				TileCoordinates coords = tileCoordinates[i].second;
+		return false;
+	};
+	if (options.clustered) {
+		boost::sort::block_indirect_sort(
+			tileCoordinates.begin(), tileCoordinates.end(), 
+			[](auto const &a, auto const &b) {
+				return pmtiles::zxy_to_tileid(a.first, a.second.x, a.second.y) < pmtiles::zxy_to_tileid(b.first, b.second.x, b.second.y);
+			},
+			options.threadNum);
+	} else {
+		boost::sort::block_indirect_sort(tileCoordinates.begin(), tileCoordinates.end(), tileOrder, options.threadNum);
+	}
+
+	// Write a single tile
+	// (scheduler is told the tile's object count, so it can spot expensive tiles early)
+	auto writeTile = [&](std::size_t i, TileScheduler *scheduler) {
+		unsigned int zoom = tileCoordinates[i].first;
+		TileCoordinates coords = tileCoordinates[i].second;
 
 #ifdef CLOCK_MONOTONIC
-				timespec start, end;
-				if (options.logTileTimings)
-					clock_gettime(CLOCK_MONOTONIC, &start);
+		timespec start, end;
+		if (options.logTileTimings)
+			clock_gettime(CLOCK_MONOTONIC, &start);
 #endif
 
-				std::vector<std::vector<OutputObjectID>> data;
-				for (auto source : sources) {
-					data.emplace_back(source->getObjectsForTile(sortOrders, zoom, coords));
-				}
-				outputProc(sharedData, sources, attributeStore, data, coords, zoom);
+		std::vector<std::vector<OutputObjectID>> data;
+		size_t numObjects = 0;
+		for (auto source : sources) {
+			data.emplace_back(source->getObjectsForTile(sortOrders, zoom, coords));
+			numObjects += data.back().size();
+		}
+		if (scheduler) scheduler->tileObjects(i, numObjects);
+		outputProc(sharedData, sources, attributeStore, data, coords, zoom);
 
 #ifdef CLOCK_MONOTONIC
-				if (options.logTileTimings) {
-					clock_gettime(CLOCK_MONOTONIC, &end);
-					uint64_t tileNs = 1e9 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
-					std::string output = "z" + std::to_string(zoom) + "/" + std::to_string(coords.x) + "/" + std::to_string(coords.y) + " took " + std::to_string(tileNs/1e6) + " ms";
-					tileTimings.push_back(output);
-				}
+		if (options.logTileTimings) {
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			uint64_t tileNs = 1e9 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
+			const std::lock_guard<std::mutex> lock(io_mutex);
+			std::cout << std::endl << "z" << zoom << "/" << coords.x << "/" << coords.y << " took " << (tileNs/1e6) << " ms" << std::endl;
+		}
 #endif
-			}
 
-			if (options.logTileTimings) {
-				const std::lock_guard<std::mutex> lock(io_mutex);
-				std::cout << std::endl;
-				for (const auto& output : tileTimings)
-					std::cout << output << std::endl;
+		uint64_t written = ++tilesWritten;
+		if (written % 100 != 0 && written != tileCoordinates.size()) return;
+		if (io_mutex.try_lock()) {
+			if (written >= lastTilesWritten + tileCoordinates.size() / 100 || ISATTY) {
+				lastTilesWritten = written;
+				// Show progress grouped by z6 (or lower)
+				size_t z = zoom;
+				size_t x = coords.x;
+				size_t y = coords.y;
+				if (z > CLUSTER_ZOOM) {
+					x = x / (1 << (z - CLUSTER_ZOOM));
+					y = y / (1 << (z - CLUSTER_ZOOM));
+					z = CLUSTER_ZOOM;
+				}
+				cout << "z" << z << "/" << x << "/" << y << ", writing tile " << written << " of " << tileCoordinates.size() << "               \r" << std::flush;
 			}
+			io_mutex.unlock();
+		}
+	};
 
-			tilesWritten += (endIndex - startIndex); 
-
-			if (io_mutex.try_lock()) {
-				uint64_t written = tilesWritten.load();
-
-				if (written >= lastTilesWritten + tileCoordinates.size() / 100 || ISATTY) {
-					lastTilesWritten = written;
-					// Show progress grouped by z6 (or lower)
-					size_t z = tileCoordinates[startIndex].first;
-					size_t x = tileCoordinates[startIndex].second.x;
-					size_t y = tileCoordinates[startIndex].second.y;
-					if (z > CLUSTER_ZOOM) {
-						x = x / (1 << (z - CLUSTER_ZOOM));
-						y = y / (1 << (z - CLUSTER_ZOOM));
-						z = CLUSTER_ZOOM;
-					}
-					cout << "z" << z << "/" << x << "/" << y << ", writing tile " << written << " of " << tileCoordinates.size() << "               \r" << std::flush;
-				}
-				io_mutex.unlock();
+	if (options.clustered) {
+		// Clustered .pmtiles are written in order, so tiles are posted in fixed
+		// batches, and the writer needs to know which batches are outstanding
+		std::size_t batchSize = 0;
+		for(std::size_t startIndex = 0; startIndex < tileCoordinates.size(); startIndex += batchSize) {
+			// Compute how many tiles should be assigned to this batch --
+			// higher-zoom tiles are cheaper to compute, lower-zoom tiles more expensive.
+			batchSize = 0;
+			size_t weight = 0;
+			while (weight < 1000 && startIndex + batchSize < tileCoordinates.size()) {
+				const auto& zoom = tileCoordinates[startIndex + batchSize].first;
+				if (zoom > 12)
+					weight++;
+				else if (zoom > 11)
+					weight += 10;
+				else if (zoom > 10)
+					weight += 100;
+				else
+					weight += 1000;
+
+				batchSize++;
 			}
-		});
+
+			uint64_t firstTileId = pmtiles::zxy_to_tileid(tileCoordinates[startIndex].first, tileCoordinates[startIndex].second.x, tileCoordinates[startIndex].second.y);
+			sharedData.pmtiles.queueBatch(firstTileId);
+
+			boost::asio::post(pool, [=, &tileCoordinates, &sharedData, &writeTile]() {
+				MemoryPlacement::pinThread();
+				sharedData.pmtiles.startBatch(firstTileId);
+				std::size_t endIndex = std::min(tileCoordinates.size(), startIndex + batchSize);
+				for(std::size_t i = startIndex; i < endIndex; ++i)
+					writeTile(i, nullptr);
+				sharedData.pmtiles.completeBatch(firstTileId);
+			});
+		}
+		// Wait for all tasks in the pool to complete.
+		pool.join();
+
+	} else {
+		// Otherwise each thread works through its own share of the tiles, stealing
+		// from the others when it runs out, and starting expensive tiles early
+		TileScheduler scheduler(tileCoordinates, tileOrder, options.threadNum);
+		for (unsigned int workerId = 0; workerId < options.threadNum; workerId++) {
+			boost::asio::post(pool, [workerId, &scheduler, &writeTile]() {
+				MemoryPlacement::pinThread();
+				scheduler.work(workerId, [&](size_t i) { writeTile(i, &scheduler); });
+			});
+		}
+		pool.join();
+		if (options.verbose) std::cout << std::endl << "Tile scheduler: " << scheduler.stats() << std::flush;
 	}
-	// Wait for all tasks in the pool to complete.
-	pool.join();
 
 	// ----	Close tileset
 
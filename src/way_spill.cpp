@@ -0,0 +1,219 @@
+#include "way_spill.h"
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/filesystem.hpp>
+
+// A spilled way is:
+//   uint32 input, uint64 id, uint32 refs, uint32 tags
+//   refs x uint64 node ID
+//   tags x (uint32 key length, key, uint32 value length, value)
+// in native byte order.
+
+namespace {
+	// Write a thread's buffer for a shard once it's this big, even mid-batch
+	const size_t ChunkBytes = 1 << 20;
+
+	// Identifies a set of thread buffers, so a thread can cache its own
+	std::atomic<uint64_t> nextGeneration(1);
+
+	template<typename T> void append(std::string& data, const T& value) {
+		data.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+	void appendString(std::string& data, const protozero::data_view& value) {
+		append<uint32_t>(data, value.size());
+		data.append(value.data(), value.size());
+	}
+
+	template<typename T> T take(const std::string& data, size_t& offset) {
+		if (offset + sizeof(T) > data.size())
+			throw std::runtime_error("truncated way spill");
+		T value;
+		memcpy(&value, data.data() + offset, sizeof(T));
+		offset += sizeof(T);
+		return value;
+	}
+	protozero::data_view takeString(const std::string& data, size_t& offset) {
+		uint32_t size = take<uint32_t>(data, offset);
+		if (offset + size > data.size())
+			throw std::runtime_error("truncated way spill");
+		protozero::data_view value(data.data() + offset, size);
+		offset += size;
+		return value;
+	}
+}
+
+bool WaySpill::Chunk::next(Way& way) {
+	if (offset == data.size())
+		return false;
+
+	way.input = take<uint32_t>(data, offset);
+	way.id = take<uint64_t>(data, offset);
+	const uint32_t refs = take<uint32_t>(data, offset);
+	const uint32_t tags = take<uint32_t>(data, offset);
+
+	way.refs.resize(refs);
+	if (offset + refs * sizeof(NodeID) > data.size())
+		throw std::runtime_error("truncated way spill");
+	memcpy(way.refs.data(), data.data() + offset, refs * sizeof(NodeID));
+	offset += refs * sizeof(NodeID);
+
+	way.tags.clear();
+	for (uint32_t i = 0; i < tags; i++) {
+		protozero::data_view key = takeString(data, offset);
+		protozero::data_view value = takeString(data, offset);
+		way.tags.push_back(Tag{key, value});
+	}
+	return true;
+}
+
+WaySpill::WaySpill(size_t shards): shards(shards), generation(nextGeneration++) {
+	files.resize(shards);
+	for (File& file : files)
+		file.mutex.reset(new std::mutex());
+}
+
+WaySpill::~WaySpill() {
+	clear();
+}
+
+void WaySpill::open(const std::string& parent) {
+	clear();
+	boost::filesystem::path dir = boost::filesystem::path(parent) / boost::filesystem::unique_path("tilemaker-spill-%%%%-%%%%");
+	boost::filesystem::create_directories(dir);
+	directory = dir.string();
+
+	for (size_t shard = 0; shard < shards; shard++) {
+		File& file = files[shard];
+		file.filename = directory + "/shard-" + std::to_string(shard);
+		file.out.reset(new std::ofstream(file.filename, std::ios::out | std::ios::binary | std::ios::trunc));
+		if (!*file.out) throw std::runtime_error("couldn't write " + file.filename);
+	}
+}
+
+void WaySpill::add(size_t shard, uint32_t input, WayID id, const std::vector<uint64_t>& refs, const TagMap& tags) {
+	Buffer& buffer = threadBuffers()[shard];
+
+	uint32_t tagCount = 0;
+	for (auto it = tags.begin(); it != tags.end(); ++it)
+		tagCount++;
+
+	append<uint32_t>(buffer.data, input);
+	append<uint64_t>(buffer.data, id);
+	append<uint32_t>(buffer.data, refs.size());
+	append<uint32_t>(buffer.data, tagCount);
+	buffer.data.append(reinterpret_cast<const char*>(refs.data()), refs.size() * sizeof(uint64_t));
+	for (auto it = tags.begin(); it != tags.end(); ++it) {
+		const Tag tag = *it;
+		appendString(buffer.data, tag.key);
+		appendString(buffer.data, tag.value);
+	}
+	buffer.ways++;
+
+	if (buffer.data.size() >= ChunkBytes)
+		write(shard, buffer);
+}
+
+void WaySpill::flush() {
+	std::vector<Buffer>& mine = threadBuffers();
+	for (size_t shard = 0; shard < shards; shard++)
+		write(shard, mine[shard]);
+}
+
+void WaySpill::finish() {
+	for (auto& entry : buffers)
+		for (size_t shard = 0; shard < shards; shard++)
+			write(shard, entry.second[shard]);
+	clearBuffers();
+
+	for (File& file : files) {
+		if (!file.out) continue;
+		file.out->close();
+		if (!*file.out) throw std::runtime_error("couldn't write " + file.filename);
+		file.out.reset();
+	}
+}
+
+void WaySpill::read(size_t shard, size_t threadNum, const std::function<void(Chunk&)>& process) {
+	const File& file = files[shard];
+	boost::asio::thread_pool pool(threadNum);
+	for (const auto& chunk : file.chunks) {
+		boost::asio::post(pool, [&file, chunk, &process]() {
+			std::string data(chunk.second, '\0');
+			std::ifstream in(file.filename, std::ios::in | std::ios::binary);
+			in.seekg(chunk.first);
+			in.read(&data[0], data.size());
+			if (!in) throw std::runtime_error("couldn't read " + file.filename);
+
+			Chunk c(std::move(data));
+			process(c);
+		});
+	}
+	pool.join();
+}
+
+uint64_t WaySpill::bytes() const {
+	uint64_t rv = 0;
+	for (const File& file : files)
+		rv += file.bytes;
+	return rv;
+}
+
+void WaySpill::clear() {
+	clearBuffers();
+	for (File& file : files) {
+		file.out.reset();
+		if (!file.filename.empty())
+			boost::filesystem::remove(file.filename);
+		file.filename.clear();
+		file.bytes = 0;
+		file.ways = 0;
+		file.chunks.clear();
+	}
+	if (!directory.empty()) {
+		boost::system::error_code ec;
+		boost::filesystem::remove(directory, ec);
+		directory.clear();
+	}
+}
+
+std::vector<WaySpill::Buffer>& WaySpill::threadBuffers() {
+	// Only take the lock the first time a thread spills a way
+	thread_local uint64_t cachedGeneration = 0;
+	thread_local std::vector<Buffer>* cached = nullptr;
+	if (cachedGeneration == generation)
+		return *cached;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<Buffer>& rv = buffers[std::this_thread::get_id()];
+	if (rv.empty())
+		rv.resize(shards);
+	cachedGeneration = generation;
+	cached = &rv;
+	return rv;
+}
+
+void WaySpill::clearBuffers() {
+	std::lock_guard<std::mutex> lock(mutex);
+	buffers.clear();
+	generation = nextGeneration++;
+}
+
+void WaySpill::write(size_t shard, Buffer& buffer) {
+	if (buffer.data.empty()) return;
+
+	File& file = files[shard];
+	{
+		std::lock_guard<std::mutex> lock(*file.mutex);
+		file.out->write(buffer.data.data(), buffer.data.size());
+		if (!*file.out) throw std::runtime_error("couldn't write " + file.filename);
+		file.chunks.push_back({ file.bytes, buffer.data.size() });
+		file.bytes += buffer.data.size();
+		file.ways += buffer.ways;
+	}
+
+	buffer.data.clear();
+	buffer.ways = 0;
+}
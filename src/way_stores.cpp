@@ -22,7 +22,7 @@ bool BinarySearchWayStore::contains(size_t shard, WayID id) const {
 	return !(iter == mLatpLonLists->end() || iter->first != id);
 }
 
-std::vector<LatpLon> BinarySearchWayStore::at(WayID wayid) const {
+void BinarySearchWayStore::at(WayID wayid, std::vector<LatpLon>& out) const {
 	std::lock_guard<std::mutex> lock(mutex);
 	
 	auto iter = std::lower_bound(mLatpLonLists->begin(), mLatpLonLists->end(), wayid, [](auto const &e, auto wayid) { 
@@ -32,12 +32,7 @@ std::vector<LatpLon> BinarySearchWayStore::at(WayID wayid) const {
 	if(iter == mLatpLonLists->end() || iter->first != wayid)
 		throw std::out_of_range("Could not find way with id " + std::to_string(wayid));
 
-	std::vector<LatpLon> rv;
-	rv.reserve(iter->second.size());
-	// TODO: copy iter->second to rv more efficiently
-	for (const LatpLon& el : iter->second)
-		rv.push_back(el);
-	return rv;
+	out.assign(iter->second.begin(), iter->second.end());
 }
 
 void BinarySearchWayStore::insertLatpLons(std::vector<WayStore::ll_element_t> &newWays) {
@@ -0,0 +1,77 @@
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "external/minunit.h"
+#include "atomic_bitset.h"
+
+MU_TEST(test_atomic_bitset) {
+	AtomicBitset bits;
+	mu_check(!bits.test(0));
+	mu_check(bits.chunks() == 0);
+
+	bits.set(0);
+	bits.set(65535);
+	bits.set(65536);
+	bits.set(12000000000ull);
+	mu_check(bits.test(0));
+	mu_check(!bits.test(1));
+	mu_check(bits.test(65535));
+	mu_check(bits.test(65536));
+	mu_check(bits.test(12000000000ull));
+	mu_check(!bits.test(12000000001ull));
+	// Only the chunks that were touched
+	mu_check(bits.chunks() == 3);
+
+	// Too large to track: never set
+	mu_check(!bits.test(1ull << 40));
+	bool threw = false;
+	try {
+		bits.set(1ull << 40);
+	} catch (std::out_of_range&) {
+		threw = true;
+	}
+	mu_check(threw);
+
+	bits.clear();
+	mu_check(!bits.test(0));
+	mu_check(bits.chunks() == 0);
+
+	// Only the chunks covering the range
+	bits.reserve(100000, 200000);
+	mu_check(bits.chunks() == 3);
+	mu_check(!bits.test(100000));
+}
+
+MU_TEST(test_atomic_bitset_threads) {
+	// Threads share chunks and words, so they race to allocate and set them
+	AtomicBitset bits;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 8; t++)
+		threads.emplace_back([&bits, t]() {
+			for (uint64_t id = t; id < 1000000; id += 8)
+				bits.set(id * 3);
+		});
+	for (auto& thread : threads)
+		thread.join();
+
+	size_t set = 0;
+	for (uint64_t id = 0; id < 3000000; id++)
+		if (bits.test(id)) {
+			mu_check(id % 3 == 0);
+			set++;
+		}
+	mu_check(set == 1000000);
+	mu_check(bits.chunks() == 3000000 / 65536 + 1);
+}
+
+MU_TEST_SUITE(test_suite_atomic_bitset) {
+	MU_RUN_TEST(test_atomic_bitset);
+	MU_RUN_TEST(test_atomic_bitset_threads);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_atomic_bitset);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,107 @@
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include "external/minunit.h"
+#include "external_sort_stores.h"
+#include "sorted_node_store.h"
+#include "sorted_way_store.h"
+
+MU_TEST(test_external_sort_node_store) {
+	// Nodes from two "files", each shuffled, with some IDs in both
+	std::vector<NodeStore::element_t> nodes;
+	for (NodeID id = 1; id < 300000; id += 3)
+		nodes.push_back({ id, { (int32_t)id, -(int32_t)id } });
+	for (NodeID id = 150000; id < 500000; id += 7)
+		nodes.push_back({ id, { (int32_t)id, -(int32_t)id } });
+	std::mt19937 rng(42);
+	std::shuffle(nodes.begin(), nodes.end(), rng);
+
+	auto sorted = std::make_shared<SortedNodeStore>(true);
+	// A small buffer, so there are many runs to merge
+	ExternalSortNodeStore store(sorted, boost::filesystem::temp_directory_path().string(), 16384);
+
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < 4; t++) {
+		threads.emplace_back([&, t]() {
+			store.batchStart();
+			for (size_t i = t * 1000; i < nodes.size(); i += 4000) {
+				std::vector<NodeStore::element_t> batch(nodes.begin() + i, nodes.begin() + std::min(nodes.size(), i + 1000));
+				store.insert(batch);
+			}
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	// With many merging threads, each merge reads fewer runs, so the runs
+	// are first merged into longer ones
+	store.finalize(32);
+
+	std::vector<NodeID> ids;
+	for (const auto& node : nodes)
+		ids.push_back(node.first);
+	std::sort(ids.begin(), ids.end());
+	ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+	mu_check(store.size() == ids.size());
+	bool allFound = true;
+	for (NodeID id : ids)
+		allFound = allFound && store.at(id) == LatpLon({ (int32_t)id, -(int32_t)id });
+	mu_check(allFound);
+	mu_check(store.contains(0, 4));
+	mu_check(!store.contains(0, 5));
+}
+
+class TestNodeStore : public NodeStore {
+	void clear() override {}
+	void reopen() override {}
+	void batchStart() override {}
+	void finalize(size_t threadNum) override {}
+	size_t size() const override { return 1; }
+	LatpLon at(NodeID id) const override {
+		return { (int32_t)id, -(int32_t)id };
+	}
+	void insert(const std::vector<std::pair<NodeID, LatpLon>>& elements) override {}
+
+	bool contains(size_t shard, NodeID id) const override { return true; }
+	NodeStore& shard(size_t shard) override { return *this; }
+	const NodeStore& shard(size_t shard) const override { return *this; }
+
+	size_t shards() const override { return 1; }
+};
+
+MU_TEST(test_external_sort_way_store) {
+	std::vector<ExternalSortWayStore::element_t> ways;
+	for (WayID id = 200000; id > 0; id -= 5)
+		ways.push_back({ id, { id, id + 1, id + 2 + (id % 13) } });
+
+	TestNodeStore nodes;
+	auto sorted = std::make_shared<SortedWayStore>(true, nodes);
+	ExternalSortWayStore store(sorted, boost::filesystem::temp_directory_path().string(), 4096);
+
+	for (size_t i = 0; i < ways.size(); i += 500) {
+		std::vector<ExternalSortWayStore::element_t> batch(ways.begin() + i, ways.begin() + std::min(ways.size(), i + 500));
+		store.insertNodes(batch);
+	}
+	store.finalize(2);
+
+	mu_check(store.size() == ways.size());
+	bool allFound = true;
+	for (const auto& way : ways) {
+		std::vector<LatpLon> latplons = store.at(way.first);
+		allFound = allFound && latplons.size() == 3 && latplons[2] == LatpLon({ (int32_t)way.second[2], -(int32_t)way.second[2] });
+	}
+	mu_check(allFound);
+}
+
+MU_TEST_SUITE(test_suite_external_sort_stores) {
+	MU_RUN_TEST(test_external_sort_node_store);
+	MU_RUN_TEST(test_external_sort_way_store);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_external_sort_stores);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
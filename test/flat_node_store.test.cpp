@@ -0,0 +1,54 @@
+#include <iostream>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include "external/minunit.h"
+#include "flat_node_store.h"
+
+MU_TEST(test_flat_node_store) {
+	FlatNodeStore store(boost::filesystem::temp_directory_path().string());
+	mu_check(store.size() == 0);
+
+	// Any order, and IDs as large as the planet's
+	store.insert({ {12000000000ull, {2, 3}}, {1, {-4, -5}}, {7, {0, 0}} });
+	store.insert({ {2, {6, 7}} });
+	store.finalize(1);
+
+	mu_check(store.size() == 4);
+	mu_check(store.at(12000000000ull) == LatpLon({2, 3}));
+	mu_check(store.at(1) == LatpLon({-4, -5}));
+	mu_check(store.at(2) == LatpLon({6, 7}));
+
+	// (0, 0) is a location, not a missing node
+	mu_check(store.contains(0, 7));
+	mu_check(store.at(7) == LatpLon({0, 0}));
+
+	mu_check(!store.contains(0, 3));
+	mu_check(!store.contains(0, 1ull << 40));
+
+	bool threw = false;
+	try {
+		store.at(3);
+	} catch (std::out_of_range&) {
+		threw = true;
+	}
+	mu_check(threw);
+
+	// Storing a node again doesn't count it twice
+	store.insert({ {1, {8, 9}} });
+	mu_check(store.size() == 4);
+	mu_check(store.at(1) == LatpLon({8, 9}));
+
+	store.clear();
+	mu_check(store.size() == 0);
+	mu_check(!store.contains(0, 1));
+}
+
+MU_TEST_SUITE(test_suite_flat_node_store) {
+	MU_RUN_TEST(test_flat_node_store);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_flat_node_store);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -81,11 +81,49 @@ MU_TEST(test_compression_zlib) {
 	mu_check(unzipped == input);
 }
 
+MU_TEST(test_compression_codecs) {
+	std::string input = "a random string to be compressed";
+
+	std::vector<std::string> names = { "gzip", "deflate", "none" };
+	if (Compression::zstdAvailable()) names.push_back("zstd");
+	for (const auto &name : names) {
+		for (int level : { -1, 1, 9 }) {
+			Compression c = Compression::parse(name, level);
+			mu_check(c.name() == name);
+			std::string compressed, uncompressed;
+			compress_string(compressed, input, c);
+			decompress_string(uncompressed, compressed.data(), compressed.size(), c);
+			mu_check(uncompressed == input);
+		}
+	}
+	mu_check(!Compression::parse("none").enabled());
+
+	bool threw = false;
+	try { Compression::parse("brotli"); } catch (std::invalid_argument &e) { threw = true; }
+	mu_check(threw);
+	threw = false;
+	try { Compression::parse("gzip", 13); } catch (std::invalid_argument &e) { threw = true; }
+	mu_check(threw);
+}
+
+MU_TEST(test_hash128) {
+	mu_check(hash128("") == (Hash128{ 0, 0 }));
+	mu_check(hash128("hello") == hash128("hello"));
+	mu_check(hash128("hello") != hash128("hellp"));
+	mu_check(hash128("hello").hex().size() == 32);
+
+	// every tail length hashes differently
+	std::string input = "a somewhat longer string that spans several blocks";
+	for (size_t i = 1; i < input.size(); i++)
+		mu_check(hash128(input.substr(0, i)) != hash128(input.substr(0, i - 1)));
+}
 
 MU_TEST_SUITE(test_suite_helpers) {
 	MU_RUN_TEST(test_get_chunks);
 	MU_RUN_TEST(test_compression_gzip);
 	MU_RUN_TEST(test_compression_zlib);
+	MU_RUN_TEST(test_compression_codecs);
+	MU_RUN_TEST(test_hash128);
 }
 
 int main() {
@@ -0,0 +1,68 @@
+#include <iostream>
+#include <stdexcept>
+#include "external/minunit.h"
+#include "memory_placement.h"
+
+MU_TEST(test_parse_settings) {
+	mu_check(MemoryPlacement::parseHugePages("none") == MemoryPlacement::HugePages::None);
+	mu_check(MemoryPlacement::parseHugePages("transparent") == MemoryPlacement::HugePages::Transparent);
+	mu_check(MemoryPlacement::parseHugePages("explicit") == MemoryPlacement::HugePages::Explicit);
+
+	mu_check(MemoryPlacement::parseNuma("none") == MemoryPlacement::Numa::None);
+	mu_check(MemoryPlacement::parseNuma("interleave") == MemoryPlacement::Numa::Interleave);
+
+	bool threw = false;
+	try {
+		MemoryPlacement::parseHugePages("always");
+	} catch (std::invalid_argument&) {
+		threw = true;
+	}
+	mu_check(threw);
+
+	threw = false;
+	try {
+		MemoryPlacement::parseNuma("");
+	} catch (std::invalid_argument&) {
+		threw = true;
+	}
+	mu_check(threw);
+}
+
+MU_TEST(test_parse_cpu_list) {
+	mu_check(MemoryPlacement::parseCpuList("0-3,8,10-11") == std::vector<int>({ 0, 1, 2, 3, 8, 10, 11 }));
+	mu_check(MemoryPlacement::parseCpuList("0") == std::vector<int>({ 0 }));
+	mu_check(MemoryPlacement::parseCpuList("4-5\n") == std::vector<int>({ 4, 5 }));
+	mu_check(MemoryPlacement::parseCpuList("0,2\n") == std::vector<int>({ 0, 2 }));
+
+	// A memory-only node has an empty cpulist
+	mu_check(MemoryPlacement::parseCpuList("").empty());
+	mu_check(MemoryPlacement::parseCpuList("\n").empty());
+}
+
+MU_TEST(test_places_memory) {
+	mu_check(!MemoryPlacement::placesMemory());
+
+	// Pinning alone doesn't change how memory is mapped
+	MemoryPlacement::configure(MemoryPlacement::HugePages::None, MemoryPlacement::Numa::None, true);
+	mu_check(!MemoryPlacement::placesMemory());
+
+	MemoryPlacement::configure(MemoryPlacement::HugePages::Transparent, MemoryPlacement::Numa::None, false);
+	mu_check(MemoryPlacement::placesMemory());
+
+	MemoryPlacement::configure(MemoryPlacement::HugePages::None, MemoryPlacement::Numa::Interleave, false);
+	mu_check(MemoryPlacement::placesMemory());
+
+	MemoryPlacement::configure(MemoryPlacement::HugePages::None, MemoryPlacement::Numa::None, false);
+}
+
+MU_TEST_SUITE(test_suite_memory_placement) {
+	MU_RUN_TEST(test_parse_settings);
+	MU_RUN_TEST(test_parse_cpu_list);
+	MU_RUN_TEST(test_places_memory);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_memory_placement);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
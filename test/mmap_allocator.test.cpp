@@ -0,0 +1,97 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include "external/minunit.h"
+#include "mmap_allocator.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+std::string arenas() {
+	std::ostringstream str;
+	void_mmap_allocator::reportArenas(str);
+	return str.str();
+}
+
+MU_TEST(test_mmap_allocator_phases) {
+	void_mmap_allocator::beginPhase("scan");
+	std::vector<uint64_t, mmap_allocator<uint64_t>>* scratch = new std::vector<uint64_t, mmap_allocator<uint64_t>>(1000000, 1);
+
+	void_mmap_allocator::beginPhase("nodes");
+	std::vector<uint64_t, mmap_allocator<uint64_t>> nodes(1000000, 2);
+	// Each phase has its own region: 64MB, plus the allocation that opened it
+	mu_check(arenas() == "Arena scan: 8 MB used of 72 MB in 1 regions\nArena nodes: 8 MB used of 72 MB in 1 regions\n");
+
+	// Freed memory is reused...
+	nodes.clear();
+	nodes.shrink_to_fit();
+	nodes.resize(1000000, 3);
+	mu_check(arenas() == "Arena scan: 8 MB used of 72 MB in 1 regions\nArena nodes: 8 MB used of 72 MB in 1 regions\n");
+
+	// ...and a phase's regions are released once they're empty
+	delete scratch;
+	void_mmap_allocator::beginPhase("ways");
+	mu_check(arenas() == "Arena scan: 0 MB used of 0 MB in 0 regions, 72 MB released\nArena nodes: 8 MB used of 72 MB in 1 regions\n");
+	mu_check(nodes[999999] == 3);
+
+	// Memory that didn't come from the allocator is left alone
+	uint64_t other;
+	void_mmap_allocator::deallocate(&other);
+}
+
+#ifdef __linux__
+// How many of the pages from p to p+size are in memory
+size_t residentPages(const void* p, size_t size) {
+	const uintptr_t page = sysconf(_SC_PAGESIZE);
+	const uintptr_t start = reinterpret_cast<uintptr_t>(p) & ~(page - 1);
+	std::vector<unsigned char> pages((reinterpret_cast<uintptr_t>(p) + size - start + page - 1) / page);
+	mincore(reinterpret_cast<void*>(start), reinterpret_cast<uintptr_t>(p) + size - start, pages.data());
+	size_t rv = 0;
+	for (unsigned char resident : pages)
+		rv += resident & 1;
+	return rv;
+}
+
+MU_TEST(test_mmap_allocator_live_region) {
+	void_mmap_allocator::beginPhase("tiles");
+	std::vector<uint64_t, mmap_allocator<uint64_t>> live(1000000, 4);
+	std::vector<uint64_t, mmap_allocator<uint64_t>>* freed = new std::vector<uint64_t, mmap_allocator<uint64_t>>(1000000, 5);
+	std::vector<uint64_t, mmap_allocator<uint64_t>> small(1000, 6);
+	const uint64_t* freedData = freed->data();
+	const size_t freedSize = freed->size() * sizeof(uint64_t);
+	mu_check(residentPages(freedData, freedSize) * sysconf(_SC_PAGESIZE) >= freedSize);
+
+	// A large block freed from a region that's still in use gives its pages
+	// back at once, apart from the ends of the block
+	delete freed;
+	mu_check(residentPages(freedData, freedSize) <= 2);
+	mu_check(arenas().find("Arena tiles: 8 MB used of 72 MB in 1 regions\n") != std::string::npos);
+
+	// The live data is untouched, and the freed block can be used again
+	mu_check(live[0] == 4 && live[999999] == 4);
+	mu_check(small[0] == 6 && small[999] == 6);
+	std::vector<uint64_t, mmap_allocator<uint64_t>> reused(1000000, 7);
+	mu_check(reused[0] == 7 && reused[999999] == 7);
+	mu_check(arenas().find("Arena tiles: 16 MB used of 72 MB in 1 regions\n") != std::string::npos);
+
+	// Small blocks are left as they are
+	const uint64_t* smallData = small.data();
+	small = std::vector<uint64_t, mmap_allocator<uint64_t>>();
+	mu_check(residentPages(smallData, 1000 * sizeof(uint64_t)) > 0);
+}
+#endif
+
+MU_TEST_SUITE(test_suite_mmap_allocator) {
+	MU_RUN_TEST(test_mmap_allocator_phases);
+#ifdef __linux__
+	MU_RUN_TEST(test_mmap_allocator_live_region);
+#endif
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_mmap_allocator);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
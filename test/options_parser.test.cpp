@@ -95,6 +95,15 @@ MU_TEST(test_options_parser) {
 		mu_check(!opts.osm.shardStores);
 	}
 
+	// --reuse-stores maps the saved stores, so doesn't shard them
+	{
+		std::vector<std::string> args = {"--output", "foo.mbtiles", "--input", "ontario.pbf", "--store", "/tmp/store", "--reuse-stores"};
+		auto opts = parse(args);
+		mu_check(opts.osm.reuseStores);
+		mu_check(!opts.osm.materializeGeometries);
+		mu_check(!opts.osm.shardStores);
+	}
+
 	// Two input files implies --materialize
 	{
 		std::vector<std::string> args = {"--output", "foo.mbtiles", "--input", "ontario.pbf", "--input", "alberta.pbf"};
@@ -108,6 +117,7 @@ MU_TEST(test_options_parser) {
 		mu_check(!opts.osm.shardStores);
 	}
 
+	ASSERT_THROWS("--reuse-stores needs a --store directory", "--input", "foo", "--output", "bar", "--reuse-stores");
 	ASSERT_THROWS("Couldn't open .json config", "--input", "foo", "--output", "bar", "--config", "nonexistent-config.json");
 	ASSERT_THROWS("Couldn't open .lua script", "--input", "foo", "--output", "bar", "--process", "nonexistent-script.lua");
 }
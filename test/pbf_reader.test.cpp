@@ -3,6 +3,15 @@
 #include <sstream>
 #include "external/minunit.h"
 #include "pbf_reader.h"
+#include "pbf_index.h"
+#include "pbf_block_cache.h"
+#include "pbf_varint.h"
+#include "helpers.h"
+#include <boost/filesystem.hpp>
+#include <protozero/pbf_writer.hpp>
+#ifdef TM_LZ4
+#include <lz4.h>
+#endif
 
 MU_TEST(test_pbf_reader) {
 	std::ifstream monaco("test/monaco.pbf", std::ifstream::in);
@@ -119,8 +128,248 @@ MU_TEST(test_pbf_reader) {
 	mu_check(relations == 285);
 }
 
+MU_TEST(test_pbf_reader_mapped) {
+	PbfReader::MappedPbf monaco("test/monaco.pbf");
+	monaco.advise(PbfReader::MappedPbf::Access::Sequential);
+
+	PbfReader::PbfReader reader;
+	size_t offset = 0;
+	PbfReader::BlobHeader bh = reader.readBlobHeader(monaco, offset);
+	PbfReader::HeaderBlock header = reader.readHeaderBlock(reader.readBlob(monaco.view(offset, bh.datasize)));
+	offset += bh.datasize;
+	mu_check(header.hasBbox);
+	mu_check(header.bbox.minLon == 7.409205);
+
+	int blocks = 0, nodes = 0, ways = 0, relations = 0;
+	while (true) {
+		bh = reader.readBlobHeader(monaco, offset);
+		if (bh.type == "eof")
+			break;
+
+		blocks++;
+		monaco.willNeed(offset, bh.datasize);
+		PbfReader::PrimitiveBlock& pb = reader.readPrimitiveBlock(reader.readBlob(monaco.view(offset, bh.datasize)));
+		offset += bh.datasize;
+
+		for (const auto& group : pb.groups()) {
+			for (const auto& node : group.nodes()) { (void)node; nodes++; }
+			for (const auto& way : group.ways()) { (void)way; ways++; }
+			for (const auto& relation : group.relations()) { (void)relation; relations++; }
+		}
+	}
+
+	mu_check(offset == monaco.size());
+	mu_check(blocks == 6);
+	mu_check(nodes == 30477);
+	mu_check(ways == 4825);
+	mu_check(relations == 285);
+
+	bool threw = false;
+	try { monaco.view(monaco.size() - 1, 2); } catch (std::runtime_error&) { threw = true; }
+	mu_check(threw);
+}
+
+MU_TEST(test_pbf_index) {
+	// Work on a copy, so the index isn't left in the source tree
+	std::string pbf = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("%%%%-%%%%.osm.pbf")).string();
+	boost::filesystem::copy_file("test/monaco.pbf", pbf);
+
+	PbfIndex index;
+	mu_check(!index.load(pbf));
+	{
+		PbfReader::MappedPbf input(pbf);
+		index.scan(input);
+		mu_check(!index.classified);
+		mu_check(index.blocks.size() == 6);
+		mu_check(index.blocks[0].hasNodes && index.blocks[0].hasWays && index.blocks[0].hasRelations);
+
+		index.classify(input, 2);
+	}
+	mu_check(index.classified);
+	mu_check(index.save(pbf));
+
+	PbfIndex loaded;
+	mu_check(loaded.load(pbf));
+	mu_check(loaded.classified);
+	mu_check(loaded.blockBytes == index.blockBytes);
+	mu_check(loaded.header.hasBbox);
+	mu_check(loaded.header.bbox.minLon == 7.409205);
+	mu_check(loaded.header.optionalFeatures.count("Sort.Type_then_ID") == 1);
+	mu_check(loaded.blocks.size() == 6);
+
+	int nodeBlocks = 0, wayBlocks = 0, relationBlocks = 0;
+	bool sameBlocks = true;
+	for (size_t i = 0; i < loaded.blocks.size(); i++) {
+		const auto& a = index.blocks[i];
+		const auto& b = loaded.blocks[i];
+		sameBlocks = sameBlocks && a.offset == b.offset && a.length == b.length &&
+			a.minNodeId == b.minNodeId && a.maxWayId == b.maxWayId && a.minRelationId == b.minRelationId;
+		nodeBlocks += b.hasNodes;
+		wayBlocks += b.hasWays;
+		relationBlocks += b.hasRelations;
+	}
+	mu_check(sameBlocks);
+	mu_check(nodeBlocks + wayBlocks + relationBlocks == 6);
+	mu_check(loaded.blocks[0].hasNodes && !loaded.blocks[0].hasWays);
+	mu_check(loaded.blocks[0].minNodeId <= 21911886);
+	mu_check(loaded.blocks[5].hasRelations);
+
+	mu_check(ReadPbfHeader(pbf).optionalFeatures.count("Sort.Type_then_ID") == 1);
+
+	// A corrupt block count or string length means the index isn't used
+	std::string saved;
+	{
+		std::ifstream in(PbfIndex::indexFilename(pbf), std::ios::binary);
+		saved.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	auto corrupt = [&](size_t offset, size_t bytes) {
+		std::string data = saved;
+		for (size_t i = 0; i < bytes; i++)
+			data[offset + i] = (char)0xff;
+		std::ofstream out(PbfIndex::indexFilename(pbf), std::ios::binary | std::ios::trunc);
+		out << data;
+	};
+	// The block count comes before six 61-byte blocks and the closing magic
+	corrupt(saved.size() - 8 - 6 * 61 - 8, 8);
+	mu_check(!loaded.load(pbf));
+	mu_check(loaded.blocks.empty());
+	// The first optional feature's length follows the stamp, bbox and feature count
+	corrupt(8 + 4 + 8 + 8 + 1 + 8 + 1 + 4 * 8 + 4, 4);
+	mu_check(!loaded.load(pbf));
+
+	// A changed .pbf makes the index stale
+	boost::filesystem::last_write_time(pbf, boost::filesystem::last_write_time(pbf) + 10);
+	mu_check(!loaded.load(pbf));
+
+	boost::filesystem::remove(pbf);
+	boost::filesystem::remove(PbfIndex::indexFilename(pbf));
+}
+
+MU_TEST(test_pbf_block_cache) {
+	PbfReader::MappedPbf monaco("test/monaco.pbf");
+	PbfIndex index;
+	index.scan(monaco);
+	PbfReader::PbfReader reader;
+
+	// Read every block twice through the cache; the second time should be all hits
+	auto readAll = [&](PbfBlockCache& cache, std::vector<std::string>& contents) {
+		contents.clear();
+		for (const auto& block : index.blocks) {
+			protozero::data_view data = cache.read(reader, monaco, block.offset, block.length, true);
+			contents.push_back(std::string(data.data(), data.size()));
+		}
+	};
+
+	for (const Compression& compression : { Compression(Compression::Codec::None), Compression(Compression::Codec::Gzip, 1) }) {
+		PbfBlockCache cache(100 * 1048576, compression);
+		std::vector<std::string> first, second;
+		readAll(cache, first);
+		readAll(cache, second);
+		mu_check(first == second);
+		mu_check(cache.stats().find(std::to_string(index.blocks.size()) + " hits") != std::string::npos);
+
+		// Dropping a block means it's read again
+		uint64_t dropped = index.blocks[0].offset;
+		cache.retain([&](const PbfReader::MappedPbf&, uint64_t offset) { return offset != dropped; });
+		readAll(cache, second);
+		mu_check(first == second);
+		mu_check(cache.stats().find(std::to_string(index.blocks.size() + 1) + " misses") != std::string::npos);
+	}
+
+	// Blocks that don't fit in the budget aren't kept
+	PbfBlockCache small(1, Compression(Compression::Codec::None));
+	std::vector<std::string> contents;
+	readAll(small, contents);
+	readAll(small, contents);
+	mu_check(small.stats().find(" 0 hits") != std::string::npos);
+}
+
+MU_TEST(test_pbf_varint) {
+	// Deltas of every length, including 10-byte varints, and long runs of
+	// one-byte varints
+	std::vector<int64_t> deltas;
+	for (int i = 0; i < 1000; i++) {
+		int bits = (i * 7) % 64;
+		int64_t delta = (int64_t)((0x9e3779b97f4a7c15ull * (i + 1)) >> (63 - bits));
+		deltas.push_back(i % 3 == 0 ? -delta : delta);
+		for (int j = 0; j < i % 20; j++)
+			deltas.push_back(1);
+	}
+	std::string packed;
+	protozero::pbf_writer writer(packed);
+	writer.add_packed_sint64(1, deltas.begin(), deltas.end());
+	protozero::pbf_reader message(packed);
+	message.next();
+	protozero::data_view data = message.get_view();
+
+	std::vector<uint64_t> expected;
+	uint64_t total = 0;
+	for (int64_t delta : deltas) {
+		total += delta;
+		expected.push_back(total);
+	}
+
+	for (PbfReader::DeltaDecoder decoder : { PbfReader::DeltaDecoder::Scalar, PbfReader::bestDeltaDecoder() }) {
+		std::vector<uint64_t> ids = { 42 };
+		uint64_t sum = 0;
+		PbfReader::decodeDeltas(data, sum, ids, decoder);
+		mu_check(ids.size() == expected.size() + 1);
+		mu_check(ids[0] == 42);
+		mu_check(std::equal(expected.begin(), expected.end(), ids.begin() + 1));
+		mu_check(sum == total);
+
+		// Narrower types wrap
+		std::vector<int32_t> lats;
+		sum = 0;
+		PbfReader::decodeDeltas(data, sum, lats, decoder);
+		mu_check(lats.size() == expected.size());
+		for (size_t i = 0; i < lats.size(); i++)
+			mu_check(lats[i] == (int32_t)expected[i]);
+	}
+}
+
+MU_TEST(test_pbf_reader_blob_codecs) {
+	// Recompress monaco's first data block with each codec we were built with
+	PbfReader::MappedPbf monaco("test/monaco.pbf");
+	PbfIndex index;
+	index.scan(monaco);
+	PbfReader::PbfReader reader;
+	protozero::data_view data = reader.readBlob(monaco.view(index.blocks[0].offset, index.blocks[0].length));
+	std::string raw(data.data(), data.size());
+
+	auto roundTrip = [&](PbfReader::Schema::Blob codec, const std::string& compressed) {
+		std::string blob;
+		protozero::pbf_writer writer(blob);
+		writer.add_int32(static_cast<protozero::pbf_tag_type>(PbfReader::Schema::Blob::optional_int32_raw_size), raw.size());
+		writer.add_bytes(static_cast<protozero::pbf_tag_type>(codec), compressed);
+		protozero::data_view decoded = reader.readBlob({ blob.data(), blob.size() });
+		return std::string(decoded.data(), decoded.size());
+	};
+
+	mu_check(roundTrip(PbfReader::Schema::Blob::oneof_data_bytes_zlib_data, compress_string(raw)) == raw);
+#ifdef TM_ZSTD
+	std::string zstd;
+	compress_string(zstd, raw, Compression(Compression::Codec::Zstd));
+	mu_check(roundTrip(PbfReader::Schema::Blob::oneof_data_bytes_zstd_data, zstd) == raw);
+	// Reusing the buffer for a smaller block
+	raw.resize(raw.size() / 2);
+	compress_string(zstd, raw, Compression(Compression::Codec::Zstd));
+	mu_check(roundTrip(PbfReader::Schema::Blob::oneof_data_bytes_zstd_data, zstd) == raw);
+#endif
+#ifdef TM_LZ4
+	std::string lz4(LZ4_compressBound(raw.size()), '\0');
+	lz4.resize(LZ4_compress_default(raw.data(), &lz4[0], raw.size(), lz4.size()));
+	mu_check(roundTrip(PbfReader::Schema::Blob::oneof_data_bytes_lz4_data, lz4) == raw);
+#endif
+}
+
 MU_TEST_SUITE(test_suite_pbf_reader) {
 	MU_RUN_TEST(test_pbf_reader);
+	MU_RUN_TEST(test_pbf_reader_mapped);
+	MU_RUN_TEST(test_pbf_index);
+	MU_RUN_TEST(test_pbf_block_cache);
+	MU_RUN_TEST(test_pbf_varint);
+	MU_RUN_TEST(test_pbf_reader_blob_codecs);
 }
 
 int main() {
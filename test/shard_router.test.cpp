@@ -0,0 +1,38 @@
+#include <iostream>
+#include "external/minunit.h"
+#include "shard_router.h"
+
+MU_TEST(test_shard_router) {
+	ShardRouter router;
+	mu_check(router.shards(1) == 0);
+
+	router.mark(0, 1);
+	router.mark(2, 4095);
+	router.mark(1, 4096);
+
+	// IDs 0..4095 share a range
+	mu_check(router.shards(1) == 0b101);
+	mu_check(router.shards(0) == 0b101);
+	mu_check(router.mayContain(0, 4095));
+	mu_check(!router.mayContain(1, 4095));
+
+	mu_check(router.shards(4096) == 0b010);
+	mu_check(router.shards(8192) == 0);
+
+	// IDs past the index could be anywhere
+	mu_check(router.shards(1ull << 40) == ShardRouter::AnyShard);
+	mu_check(router.mayContain(5, 1ull << 40));
+
+	router.clear();
+	mu_check(router.shards(1) == 0);
+}
+
+MU_TEST_SUITE(test_suite_shard_router) {
+	MU_RUN_TEST(test_shard_router);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_shard_router);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <boost/filesystem.hpp>
 #include "external/minunit.h"
 #include "sorted_node_store.h"
 
@@ -30,8 +31,35 @@ MU_TEST(test_sorted_node_store) {
 	}
 }
 
+MU_TEST(test_save_load) {
+	const std::string filename = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("test-%%%%-%%%%.tmstore")).string();
+
+	{
+		SortedNodeStore s1(true);
+		s1.batchStart();
+		s1.insert({ {1, {2, 3}}, {2, {3, 4}}, {70000, {5, 6}} });
+		s1.finalize(1);
+		mu_check(s1.save(filename, "stamp"));
+	}
+
+	SortedNodeStore s2(true);
+	mu_check(!s2.load(filename, "other stamp"));
+	mu_check(s2.load(filename, "stamp"));
+	mu_check(s2.size() == 3);
+	mu_check(s2.at(1) == LatpLon({2, 3}));
+	mu_check(s2.at(2) == LatpLon({3, 4}));
+	mu_check(s2.at(70000) == LatpLon({5, 6}));
+	mu_check(s2.contains(0, 70000));
+	mu_check(!s2.contains(0, 3));
+
+	s2.clear();
+	mu_check(s2.size() == 0);
+	boost::filesystem::remove(filename);
+}
+
 MU_TEST_SUITE(test_suite_sorted_node_store) {
 	MU_RUN_TEST(test_sorted_node_store);
+	MU_RUN_TEST(test_save_load);
 }
 
 int main() {
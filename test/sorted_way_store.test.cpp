@@ -1,4 +1,5 @@
 #include <iostream>
+#include <boost/filesystem.hpp>
 #include "external/minunit.h"
 #include "sorted_way_store.h"
 #include "node_store.h"
@@ -164,6 +165,16 @@ MU_TEST(test_way_store) {
 		mu_check(rv[99].latp == 299);
 	}
 
+	// Decoding into a buffer replaces what was there
+	{
+		std::vector<LatpLon> rv;
+		sws.at(65536, rv);
+		mu_check(rv.size() == 100);
+		sws.at(1, rv);
+		mu_check(rv.size() == 1);
+		mu_check(rv[0].latp == 123);
+	}
+
 	// missing things should throw std::out_of_range
 
 	bool threw = false;
@@ -184,6 +195,38 @@ MU_TEST(test_way_store) {
 
 }
 
+MU_TEST(test_save_load) {
+	const std::string filename = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("test-%%%%-%%%%.tmstore")).string();
+	TestNodeStore ns;
+
+	std::vector<NodeID> longWay;
+	for (int i = 200; i < 2048; i++)
+		longWay.push_back(i + 3 * (i % 37));
+
+	{
+		SortedWayStore s1(true, ns);
+		s1.batchStart();
+		s1.insertNodes({{ 1, { 1, 2 } }, { 42, longWay }, { 1000000, { 3, 4, 3 } }});
+		s1.finalize(1);
+		mu_check(s1.save(filename, "stamp"));
+	}
+
+	SortedWayStore s2(true, ns);
+	mu_check(!s2.load(filename, "other stamp"));
+	mu_check(s2.load(filename, "stamp"));
+	mu_check(s2.size() == 3);
+	mu_check(s2.contains(0, 42));
+	mu_check(!s2.contains(0, 43));
+
+	const std::vector<LatpLon> way = s2.at(42);
+	mu_check(way.size() == longWay.size());
+	for (size_t i = 0; i < way.size(); i++)
+		mu_check(way[i] == LatpLon({ (int32_t)longWay[i], -(int32_t)longWay[i] }));
+	mu_check(s2.at(1000000).size() == 3);
+
+	boost::filesystem::remove(filename);
+}
+
 MU_TEST(test_populate_mask) {
 	uint8_t mask[32];
 	std::vector<uint8_t> ids;
@@ -219,6 +262,7 @@ MU_TEST_SUITE(test_suite_sorted_way_store) {
 	MU_RUN_TEST(test_encode_way);
 	MU_RUN_TEST(test_multiple_stores);
 	MU_RUN_TEST(test_way_store);
+	MU_RUN_TEST(test_save_load);
 }
 
 MU_TEST_SUITE(test_suite_bitmask) {
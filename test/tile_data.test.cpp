@@ -0,0 +1,99 @@
+#include <iostream>
+#include <boost/sort/sort.hpp>
+#include "external/minunit.h"
+#include "tile_data.h"
+
+MU_TEST(test_z6_offset_key) {
+	mu_check(spreadZ6OffsetBits(0) == 0);
+	mu_check(spreadZ6OffsetBits(1) == 1);
+	mu_check(spreadZ6OffsetBits(2) == 4);
+	mu_check(spreadZ6OffsetBits(3) == 5);
+	mu_check(spreadZ6OffsetBits(255) == 0x5555);
+
+	// x bit before y bit at each level
+	mu_check(z6OffsetKey(0, 0) == 0);
+	mu_check(z6OffsetKey(0, 1) == 1);
+	mu_check(z6OffsetKey(1, 0) == 2);
+	mu_check(z6OffsetKey(1, 1) == 3);
+	mu_check(z6OffsetKey(2, 0) == 8);
+	mu_check(z6OffsetKey(255, 255) == 0xFFFF);
+
+	for (unsigned x = 0; x < 256; x++) {
+		mu_check(compactZ6OffsetBits(spreadZ6OffsetBits(x)) == x);
+		for (unsigned y = 0; y < 256; y++) {
+			uint16_t key = z6OffsetKey(x, y);
+			mu_check(compactZ6OffsetBits(key >> 1) == x);
+			mu_check(compactZ6OffsetBits(key) == y);
+		}
+	}
+
+	// Every tile's objects form one contiguous run of keys
+	mu_check(z6OffsetKey(4, 4) == 0x30);
+	mu_check(z6OffsetKey(7, 7) == 0x3F);
+}
+
+OutputObjectXYID objectAt(Z6Offset x, Z6Offset y, uint64_t id) {
+	OutputObject oo(POINT_, 0, id, 0, id % 16);
+	return OutputObjectXYID{ oo, x, y, id };
+}
+
+MU_TEST(test_z6_bucket) {
+	Z6Bucket<OutputObjectXYID> empty;
+	mu_check(empty.lowerBound(0) == 0);
+	mu_check(empty.lowerBound(100) == 0);
+
+	AppendVectorNS::AppendVector<OutputObjectXYID> objects;
+	uint64_t id = 0;
+	for (unsigned x = 0; x < 64; x++)
+		for (unsigned y = 0; y < 64; y += 2)
+			objects.push_back(objectAt(x, y, id++));
+	boost::sort::pdqsort(objects.begin(), objects.end(), z6OffsetOrder<OutputObjectXYID>);
+
+	Z6Bucket<OutputObjectXYID> bucket;
+	bucket.assign(objects);
+	mu_check(objects.size() == 0);
+	mu_check(objects.begin() == objects.end());
+	mu_check(bucket.keys.size() == 64 * 32);
+	mu_check(bucket.objects.size() == 64 * 32);
+
+	for (size_t i = 0; i < bucket.keys.size(); i++) {
+		mu_check(bucket.keys[i] == z6OffsetKey(bucket.objects[i].x, bucket.objects[i].y));
+		mu_check(i == 0 || bucket.keys[i - 1] < bucket.keys[i]);
+		mu_check(bucket.at(i).id == bucket.objects[i].id);
+		mu_check(bucket.at(i).oo.objectID == bucket.objects[i].id);
+	}
+
+	// Present keys are found exactly; absent (odd y) keys give the next one
+	for (unsigned x = 0; x < 64; x++) {
+		for (unsigned y = 0; y < 64; y++) {
+			size_t i = bucket.lowerBound(z6OffsetKey(x, y));
+			mu_check(i == bucket.keys.size() || bucket.keys[i] >= z6OffsetKey(x, y));
+			mu_check(i == 0 || bucket.keys[i - 1] < z6OffsetKey(x, y));
+			if (y % 2 == 0)
+				mu_check(bucket.objects[i].x == x && bucket.objects[i].y == y);
+		}
+	}
+	mu_check(bucket.lowerBound(0) == 0);
+	mu_check(bucket.lowerBound(z6OffsetKey(255, 255)) == bucket.keys.size());
+
+	// The 4x4 tile at (8, 8) holds 8 objects, one contiguous run
+	uint16_t firstKey = z6OffsetKey(8, 8);
+	size_t count = 0;
+	for (size_t i = bucket.lowerBound(firstKey); i < bucket.keys.size() && bucket.keys[i] < firstKey + 16; i++) {
+		mu_check(bucket.objects[i].x >= 8 && bucket.objects[i].x < 12);
+		mu_check(bucket.objects[i].y >= 8 && bucket.objects[i].y < 12);
+		count++;
+	}
+	mu_check(count == 8);
+}
+
+MU_TEST_SUITE(test_suite_tile_data) {
+	MU_RUN_TEST(test_z6_offset_key);
+	MU_RUN_TEST(test_z6_bucket);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_tile_data);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,79 @@
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include "external/minunit.h"
+#include "tile_scheduler.h"
+
+bool zoomOrder(const ZoomedTileCoordinates &a, const ZoomedTileCoordinates &b) {
+	if (a.first != b.first) return a.first < b.first;
+	return a.second < b.second;
+}
+
+MU_TEST(test_tile_cost_model) {
+	TileCostModel costs;
+
+	// unmeasured: lower zooms are assumed to be more expensive
+	mu_check(costs.estimate(8, TileCoordinates(0, 0)) > costs.estimate(14, TileCoordinates(0, 0)));
+
+	// after enough samples, an outlier is expensive
+	for (int i = 0; i < 20; i++)
+		mu_check(!costs.recordTime(8, TileCoordinates(i, 0), 1000));
+	mu_check(costs.recordTime(8, TileCoordinates(100, 100), 1000000));
+
+	// ...and its children are estimated from it, others from the mean
+	for (int i = 0; i < 20; i++)
+		costs.recordTime(9, TileCoordinates(i, 0), 1000);
+	mu_check(costs.estimate(9, TileCoordinates(200, 201)) > costs.estimate(9, TileCoordinates(0, 0)));
+
+	// anything slower than TILE_SCHEDULER_EXPENSIVE_NS is expensive
+	mu_check(costs.recordTime(3, TileCoordinates(0, 0), TILE_SCHEDULER_EXPENSIVE_NS + 1));
+
+	// object counts work the same way
+	for (int i = 0; i < 20; i++)
+		mu_check(!costs.recordObjects(10, TileCoordinates(i, 0), 10));
+	mu_check(costs.recordObjects(10, TileCoordinates(100, 100), 1000));
+}
+
+MU_TEST(test_tile_scheduler) {
+	std::deque<ZoomedTileCoordinates> tiles;
+	for (unsigned int z = 0; z <= 7; z++)
+		for (TileCoordinate x = 0; x < (1u << z); x++)
+			for (TileCoordinate y = 0; y < (1u << z); y++)
+				tiles.push_back(ZoomedTileCoordinates(z, TileCoordinates(x, y)));
+	std::sort(tiles.begin(), tiles.end(), zoomOrder);
+
+	for (unsigned int numWorkers : { 1, 3, 8 }) {
+		TileScheduler scheduler(tiles, zoomOrder, numWorkers);
+		std::vector<std::atomic<int>> processed(tiles.size());
+		for (auto &p : processed) p = 0;
+
+		std::vector<std::thread> threads;
+		for (unsigned int w = 0; w < numWorkers; w++) {
+			threads.emplace_back([&, w]() {
+				scheduler.work(w, [&](size_t i) {
+					// one z3 tile has far more objects than the rest
+					bool heavy = tiles[i].first == 3 && tiles[i].second == TileCoordinates(5, 5);
+					scheduler.tileObjects(i, heavy ? 10000 : 10);
+					processed[i]++;
+				});
+			});
+		}
+		for (auto &t : threads) t.join();
+
+		// every tile is written exactly once
+		bool once = true;
+		for (auto &p : processed) once = once && p == 1;
+		mu_check(once);
+	}
+}
+
+MU_TEST_SUITE(test_suite_tile_scheduler) {
+	MU_RUN_TEST(test_tile_cost_model);
+	MU_RUN_TEST(test_tile_scheduler);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_tile_scheduler);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
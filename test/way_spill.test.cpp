@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <boost/filesystem.hpp>
+#include "external/minunit.h"
+#include "way_spill.h"
+
+// TagMap doesn't keep tags in the order they were added, so sort them
+std::string tagString(const std::vector<Tag>& tags) {
+	std::vector<std::string> strings;
+	for (const Tag& tag : tags)
+		strings.push_back(std::string(tag.key.data(), tag.key.size()) + "=" + std::string(tag.value.data(), tag.value.size()) + ";");
+	std::sort(strings.begin(), strings.end());
+
+	std::string rv;
+	for (const std::string& string : strings)
+		rv += string;
+	return rv;
+}
+
+MU_TEST(test_way_spill) {
+	WaySpill spill(3);
+	spill.open(boost::filesystem::temp_directory_path().string());
+
+	std::string highway = "highway", primary = "primary", name = "name", empty = "";
+	protozero::data_view highwayKey(highway.data(), highway.size()), primaryValue(primary.data(), primary.size());
+	protozero::data_view nameKey(name.data(), name.size()), emptyValue(empty.data(), empty.size());
+
+	TagMap tags;
+	tags.addTag(highwayKey, primaryValue);
+	tags.addTag(nameKey, emptyValue);
+	spill.add(1, 0, 10, { 1, 2, 3 }, tags);
+
+	tags.reset();
+	spill.add(1, 1, 11, { 12000000000ull }, tags);
+	spill.flush();
+
+	tags.addTag(nameKey, primaryValue);
+	spill.add(2, 0, 20, { 4, 5 }, tags);
+	// Not flushed: finish writes what's left
+	spill.finish();
+
+	mu_check(spill.ways(0) == 0);
+	mu_check(spill.ways(1) == 2);
+	mu_check(spill.ways(2) == 1);
+	mu_check(spill.chunks(1) == 1);
+	mu_check(spill.bytes() > 0);
+
+	std::mutex mutex;
+	std::vector<WayID> ids;
+	std::vector<std::vector<NodeID>> refs;
+	std::vector<std::string> tagStrings;
+	std::vector<uint32_t> inputs;
+	auto collect = [&](WaySpill::Chunk& chunk) {
+		std::lock_guard<std::mutex> lock(mutex);
+		WaySpill::Way way;
+		while (chunk.next(way)) {
+			ids.push_back(way.id);
+			refs.push_back(way.refs);
+			tagStrings.push_back(tagString(way.tags));
+			inputs.push_back(way.input);
+		}
+	};
+
+	spill.read(0, 2, collect);
+	mu_check(ids.empty());
+
+	spill.read(1, 2, collect);
+	mu_check(ids.size() == 2);
+	mu_check(ids[0] == 10);
+	mu_check(refs[0] == std::vector<NodeID>({ 1, 2, 3 }));
+	mu_check(tagStrings[0] == "highway=primary;name=;");
+	mu_check(inputs[0] == 0);
+	mu_check(ids[1] == 11);
+	mu_check(refs[1] == std::vector<NodeID>({ 12000000000ull }));
+	mu_check(tagStrings[1] == "");
+	mu_check(inputs[1] == 1);
+
+	ids.clear();
+	refs.clear();
+	tagStrings.clear();
+	spill.read(2, 2, collect);
+	mu_check(ids.size() == 1);
+	mu_check(ids[0] == 20);
+	mu_check(refs[0] == std::vector<NodeID>({ 4, 5 }));
+	mu_check(tagStrings[0] == "name=primary;");
+
+	spill.clear();
+	mu_check(spill.bytes() == 0);
+	mu_check(spill.ways(1) == 0);
+}
+
+MU_TEST_SUITE(test_suite_way_spill) {
+	MU_RUN_TEST(test_way_spill);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_way_spill);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}